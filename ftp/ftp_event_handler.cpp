@@ -49,3 +49,4 @@ ftp_injected<Fn_>* ftp_injected<Fn_>::_this = new ftp_injected();
 /// Tell TU to generate classes for the following functions:
 template class ftp_injected<on_send_fn>; // on_receive is the same
 template class ftp_injected<on_process_fn>;
+template class ftp_injected<on_login_fn>;
@@ -14,6 +14,8 @@ typedef void (*on_process_fn)(
         const std::string& ftp_command, const std::string& parameters,
         const std::string& ftp_working_directory, std::shared_ptr<::fineftp::FtpUser> ftp_user
     );
+/// Called on PASS before the user database is asked. May replace the password with what the database should compare
+typedef void (*on_login_fn)(const std::string& username, std::string* password);
 
 template <typename Fn_>
 class ftp_injected
@@ -44,5 +46,6 @@ private:
 /// Promise TU to generate classes later
 extern template class ftp_injected<on_send_fn>; // on_receive is the same
 extern template class ftp_injected<on_process_fn>;
+extern template class ftp_injected<on_login_fn>;
 
 #endif //FINEFTP_SERVER_FTP_EVENT_HANDLER_H
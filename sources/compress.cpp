@@ -0,0 +1,336 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "compress.h"
+
+#include "constants.h"
+#include "server.h"
+#include "tools.h"
+
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <unordered_map>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+
+typedef enum
+{
+    VARIANT_PENDING, // Queued or being compressed
+    VARIANT_READY,
+    VARIANT_USELESS  // Doesn't compress well: the file goes as is
+} variant_state;
+
+/// File to compress and where to put the result
+typedef struct
+{
+    std::string source;
+    struct stat st; // What the source looked like when it was queued
+    std::string variant;
+    bool zstd;
+} compress_job;
+
+static std::string compress_dir;
+static std::deque<compress_job> compress_queue;
+// Known variants by path. Saves stat() calls on the hot path, rebuilt from the disk after restarts
+static std::unordered_map<std::string, variant_state> compress_index;
+static pthread_mutex_t compress_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t compress_thread;
+static std::atomic<bool> compress_running{false};
+
+// Statistics
+static std::atomic<unsigned long long> compress_hits{0}, compress_misses{0}, compress_done{0}, compress_useless{0},
+    compress_failed{0}, compress_dropped{0}, compress_bytes_in{0}, compress_bytes_out{0};
+
+
+/// Name of the variant: changes whenever the file does
+static std::string compress_fingerprint(const struct stat& st)
+{
+    return string_format(
+        "%llx-%llx-%llx-%llx.%lx",
+        static_cast<unsigned long long>(st.st_dev), static_cast<unsigned long long>(st.st_ino),
+        static_cast<unsigned long long>(st.st_size), static_cast<unsigned long long>(st.st_mtim.tv_sec),
+        static_cast<unsigned long>(st.st_mtim.tv_nsec)
+    );
+}
+
+/// Stream in to out through gzip. Returns compressed size, -1 on failure
+static long long compress_gzip(int in, int out)
+{
+    z_stream z{ };
+    if (deflateInit2(&z, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16 /* gzip header */, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    unsigned char ibuf[65536], obuf[65536];
+    long long total = 0;
+    int flush = Z_NO_FLUSH;
+    while (flush != Z_FINISH)
+    {
+        ssize_t n = read(in, ibuf, sizeof(ibuf));
+        if (n < 0) break;
+        flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+        z.next_in = ibuf;
+        z.avail_in = static_cast<uInt>(n);
+        do
+        {
+            z.next_out = obuf;
+            z.avail_out = sizeof(obuf);
+            deflate(&z, flush);
+            size_t have = sizeof(obuf) - z.avail_out;
+            if (have > 0 && write(out, obuf, have) != static_cast<ssize_t>(have))
+            {
+                deflateEnd(&z);
+                return -1;
+            }
+            total += static_cast<long long>(have);
+        } while (z.avail_out == 0);
+    }
+    deflateEnd(&z);
+    return flush == Z_FINISH ? total : -1;
+}
+
+#ifdef HAVE_ZSTD
+/// Stream in to out through zstd. Returns compressed size, -1 on failure
+static long long compress_zstd(int in, int out)
+{
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    if (cctx == nullptr) return -1;
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, COMPRESS_ZSTD_LEVEL);
+
+    unsigned char ibuf[65536], obuf[65536];
+    long long total = 0;
+    bool finished = false;
+    while (!finished)
+    {
+        ssize_t n = read(in, ibuf, sizeof(ibuf));
+        if (n < 0) break;
+        ZSTD_EndDirective mode = n == 0 ? ZSTD_e_end : ZSTD_e_continue;
+        ZSTD_inBuffer input{ibuf, static_cast<size_t>(n), 0};
+        size_t remaining;
+        do
+        {
+            ZSTD_outBuffer output{obuf, sizeof(obuf), 0};
+            remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+            if (ZSTD_isError(remaining) || (output.pos > 0 && write(out, obuf, output.pos) != static_cast<ssize_t>(output.pos)))
+            {
+                ZSTD_freeCCtx(cctx);
+                return -1;
+            }
+            total += static_cast<long long>(output.pos);
+        } while (mode == ZSTD_e_end ? remaining != 0 : input.pos != input.size);
+        finished = mode == ZSTD_e_end;
+    }
+    ZSTD_freeCCtx(cctx);
+    return finished ? total : -1;
+}
+#endif
+
+/// Remove variants of older versions of the same file (same device and inode)
+static void compress_remove_stale(const compress_job& job)
+{
+    std::string name = path_basename(job.variant);
+    std::string prefix = name.substr(0, name.find('-', name.find('-') + 1) + 1); // "<dev>-<ino>-"
+    std::string current = name.substr(0, name.find('.', name.find('.') + 1));  // Fingerprint
+
+    DIR* dir = opendir(compress_dir.c_str());
+    if (dir == nullptr) return;
+    while (struct dirent* de = readdir(dir))
+        if (starts_with(de->d_name, prefix.c_str()) && !starts_with(de->d_name, current.c_str()))
+            unlinkat(dirfd(dir), de->d_name, 0);
+    closedir(dir);
+}
+
+/// Compress job's source into a temporary file, then move it in place
+static variant_state compress_run(const compress_job& job)
+{
+    int in = open(job.source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return VARIANT_USELESS;
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    std::string tmp = job.variant + ".XXXXXX";
+    int out = mkostemp(tmp.data(), O_CLOEXEC);
+    if (out < 0)
+    {
+        MG_ERROR(("[Compress] Can't create [%s]: %s", tmp.c_str(), strerror(errno)));
+        close(in);
+        return VARIANT_USELESS;
+    }
+
+#ifdef HAVE_ZSTD
+    long long size = job.zstd ? compress_zstd(in, out) : compress_gzip(in, out);
+#else
+    long long size = compress_gzip(in, out);
+#endif
+
+    // The file could have been rewritten meanwhile: then the result belongs to nothing
+    struct stat st{ };
+    bool changed = fstat(in, &st) != 0 || st.st_size != job.st.st_size ||
+        st.st_mtim.tv_sec != job.st.st_mtim.tv_sec || st.st_mtim.tv_nsec != job.st.st_mtim.tv_nsec;
+    close(in);
+    close(out);
+
+    if (size < 0 || changed)
+    {
+        unlink(tmp.c_str());
+        ++compress_failed;
+        return VARIANT_USELESS;
+    }
+
+    if (size > job.st.st_size * COMPRESS_MAX_RATIO / 100) // Not worth a Content-Encoding
+    {
+        unlink(tmp.c_str());
+        close(open((job.variant + ".none").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644)); // Don't try again after restart
+        ++compress_useless;
+        return VARIANT_USELESS;
+    }
+
+    if (rename(tmp.c_str(), job.variant.c_str()) != 0)
+    {
+        unlink(tmp.c_str());
+        ++compress_failed;
+        return VARIANT_USELESS;
+    }
+    compress_bytes_in += static_cast<unsigned long long>(job.st.st_size);
+    compress_bytes_out += static_cast<unsigned long long>(size);
+    ++compress_done;
+    MG_DEBUG(("[Compress] [%s] => [%s]: %lld -> %lld bytes", job.source.c_str(), job.variant.c_str(),
+        static_cast<long long>(job.st.st_size), size));
+
+    compress_remove_stale(job);
+    return VARIANT_READY;
+}
+
+static void* compress_thread_loop(void*)
+{
+    while (true)
+    {
+        compress_job job;
+        {
+            mutex_locker l(&compress_mutex);
+            while (compress_running && compress_queue.empty()) pthread_cond_wait(&compress_cond, &compress_mutex);
+            if (!compress_running) break;
+            job = std::move(compress_queue.front());
+            compress_queue.pop_front();
+        }
+
+        variant_state state = compress_run(job);
+
+        mutex_locker l(&compress_mutex);
+        compress_index[job.variant] = state;
+    }
+    return nullptr;
+}
+
+/// Tell what is known about the variant, queue making it if nothing is and schedule is set.
+/// Caller holds compress_mutex
+static variant_state compress_state_locked(
+        const std::string& variant, const char* path, const struct stat& st, bool zstd, bool schedule
+    )
+{
+    if (auto it = compress_index.find(variant); it != compress_index.end()) return it->second;
+
+    if (compress_index.size() >= COMPRESS_INDEX_MAX_SIZE) compress_index.clear(); // The disk still knows
+
+    struct stat vst{ };
+    if (::stat(variant.c_str(), &vst) == 0) return compress_index[variant] = VARIANT_READY;
+    if (::stat((variant + ".none").c_str(), &vst) == 0) return compress_index[variant] = VARIANT_USELESS;
+
+    if (!schedule) return VARIANT_PENDING;
+    if (compress_queue.size() >= COMPRESS_QUEUE_MAX_SIZE)
+    {
+        ++compress_dropped;
+        return VARIANT_PENDING; // Try again on the next request
+    }
+
+    compress_queue.push_back(compress_job{.source = path, .st = st, .variant = variant, .zstd = zstd});
+    pthread_cond_signal(&compress_cond);
+    return compress_index[variant] = VARIANT_PENDING;
+}
+
+
+bool compress_start()
+{
+    if (compress_cache_dir == nullptr || *compress_cache_dir == 0) return false; // Disabled
+
+    compress_dir = compress_cache_dir;
+    if (!compress_dir.ends_with('/')) compress_dir += '/';
+    if (!mkdir_p(compress_dir) || access(compress_dir.c_str(), W_OK) != 0)
+    {
+        MG_ERROR(("[Compress] Can't use [%s] as cache. Files will be sent uncompressed", compress_dir.c_str()));
+        return false;
+    }
+
+    compress_running = true;
+    if (pthread_create(&compress_thread, nullptr, compress_thread_loop, nullptr) != 0)
+    {
+        MG_ERROR(("[Compress] Could not start compression thread."));
+        compress_running = false;
+        return false;
+    }
+    return true;
+}
+
+void compress_stop()
+{
+    if (!compress_running) return;
+    {
+        mutex_locker l(&compress_mutex);
+        compress_running = false;
+        compress_queue.clear();
+        pthread_cond_signal(&compress_cond);
+    }
+    pthread_join(compress_thread, nullptr);
+}
+
+const char* compress_find_variant(
+        const char* path, const struct stat& st, bool accept_gzip, bool accept_zstd, std::string& variant
+    )
+{
+    if (!compress_running || st.st_size < COMPRESS_MIN_SIZE || st.st_size > COMPRESS_MAX_SIZE) return nullptr;
+#ifndef HAVE_ZSTD
+    accept_zstd = false;
+#endif
+    if (!accept_gzip && !accept_zstd) return nullptr;
+
+    std::string base = compress_dir + compress_fingerprint(st);
+    std::string zst = base + ".zst", gz = base + ".gz";
+
+    // The best coding gets made if it is missing, the other one is only used if it happens to be there
+    mutex_locker l(&compress_mutex);
+    if (accept_zstd && compress_state_locked(zst, path, st, true, true) == VARIANT_READY)
+    {
+        ++compress_hits;
+        variant = std::move(zst);
+        return "zstd";
+    }
+    if (accept_gzip && compress_state_locked(gz, path, st, false, !accept_zstd) == VARIANT_READY)
+    {
+        ++compress_hits;
+        variant = std::move(gz);
+        return "gzip";
+    }
+    ++compress_misses;
+    return nullptr;
+}
+
+void compress_metrics(std::string& out)
+{
+    append_metric(out, "compress_hits", compress_hits);
+    append_metric(out, "compress_misses", compress_misses);
+    append_metric(out, "compress_done", compress_done);
+    append_metric(out, "compress_useless", compress_useless);
+    append_metric(out, "compress_failed", compress_failed);
+    append_metric(out, "compress_dropped", compress_dropped);
+    append_metric(out, "compress_bytes_in", compress_bytes_in);
+    append_metric(out, "compress_bytes_out", compress_bytes_out);
+}
@@ -0,0 +1,32 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Compressed variants of text files served from /dir/. A background thread compresses them
+/// into the cache directory under the file's fingerprint (device, inode, size, mtime),
+/// so every later download is sent precompressed
+
+#ifndef WEBSERVER_COMPRESS_H
+#define WEBSERVER_COMPRESS_H
+
+#include <string>
+#include <sys/stat.h>
+
+
+/// Create the cache directory and start the compression thread.
+/// Returns false (and serving stays uncompressed) if that is not possible
+extern bool compress_start();
+
+/// Stop the compression thread. Queued files are dropped
+extern void compress_stop();
+
+/// Find a ready compressed variant of the file at path (described by st) in a coding the client accepts.
+/// Returns the coding ("zstd" or "gzip") and puts the variant's path into variant. If there is none yet,
+/// schedules making one and returns nullptr: this time the file goes as is
+extern const char* compress_find_variant(
+        const char* path, const struct stat& st, bool accept_gzip, bool accept_zstd, std::string& variant
+    );
+
+/// Append compression counters to metrics
+extern void compress_metrics(std::string& out);
+
+#endif //WEBSERVER_COMPRESS_H
@@ -30,8 +30,212 @@
 #  define MAX_INLINE_FILE_SIZE 16777216 // 16 MB
 # endif
 
+# ifndef DEFAULT_DIR_CACHE_SIZE
+#  define DEFAULT_DIR_CACHE_SIZE 33554432 // Memory for cached directory listings: 32 MB
+# endif
+
+# ifndef DIR_CACHE_LARGE_SIZE
+#  define DIR_CACHE_LARGE_SIZE 67108864 // Memory for listings too big for the directory cache: 64 MB, one bigger is kept alone
+# endif
+
+# ifndef DIR_LISTING_PAGE_SIZE
+#  define DIR_LISTING_PAGE_SIZE 1000 // Rows on one page of a directory listing
+# endif
+
+# ifndef DIR_LISTING_SEND_BUDGET
+#  define DIR_LISTING_SEND_BUDGET 65536 // Don't render more listing rows while this much is waiting to be sent
+# endif
+
+# ifndef DIR_API_DEFAULT_LIMIT
+#  define DIR_API_DEFAULT_LIMIT 1000 // Entries in one /api/dir/ response unless ?limit= says otherwise
+# endif
+
+# ifndef DIR_API_MAX_LIMIT
+#  define DIR_API_MAX_LIMIT 10000
+# endif
+
+# ifndef DEFAULT_FILE_CACHE_SIZE
+#  define DEFAULT_FILE_CACHE_SIZE 67108864 // Memory for cached files under /dir/: 64 MB
+# endif
+
+# ifndef FILE_CACHE_MAX_FILE_SIZE
+#  define FILE_CACHE_MAX_FILE_SIZE 262144 // Bigger files are cached as open descriptors, not contents
+# endif
+
+# ifndef FILE_CACHE_MAX_FDS
+#  define FILE_CACHE_MAX_FDS 256 // Open descriptors kept by the file cache
+# endif
+
+# ifndef DEFAULT_FS_BACKEND
+#  define DEFAULT_FS_BACKEND "posix" // "posix" or "uring"
+# endif
+
+# ifndef URING_QUEUE_DEPTH
+#  define URING_QUEUE_DEPTH 256 // io_uring submission queue entries: requests in flight at once
+# endif
+
+# ifndef DEFAULT_COMPRESS_CACHE_DIR
+#  define DEFAULT_COMPRESS_CACHE_DIR "/var/cache/webserver/" // Compressed variants of files served from /dir/
+# endif
+
+# ifndef COMPRESS_MIN_SIZE
+#  define COMPRESS_MIN_SIZE 1024 // Smaller files aren't worth it
+# endif
+
+# ifndef COMPRESS_MAX_SIZE
+#  define COMPRESS_MAX_SIZE 1073741824 // 1 GB
+# endif
+
+# ifndef COMPRESS_MAX_RATIO
+#  define COMPRESS_MAX_RATIO 90 // Keep the variant only if it is at most this % of the original
+# endif
+
+# ifndef COMPRESS_GZIP_LEVEL
+#  define COMPRESS_GZIP_LEVEL 6
+# endif
+
+# ifndef COMPRESS_ZSTD_LEVEL
+#  define COMPRESS_ZSTD_LEVEL 9
+# endif
+
+# ifndef COMPRESS_QUEUE_MAX_SIZE
+#  define COMPRESS_QUEUE_MAX_SIZE 256 // Files waiting for the compression thread
+# endif
+
+# ifndef COMPRESS_INDEX_MAX_SIZE
+#  define COMPRESS_INDEX_MAX_SIZE 65536 // Variant states remembered in memory
+# endif
+
+# ifndef SENDFILE_CHUNK_SIZE
+#  define SENDFILE_CHUNK_SIZE 1048576 // Max bytes passed to one sendfile() call, so big downloads don't starve other connections
+# endif
+
+# ifndef RESOURCE_CACHE_CONTROL
+#  define RESOURCE_CACHE_CONTROL "public, max-age=31536000, immutable" // Built-in resources only change with the binary
+# endif
+
+# ifndef ERROR_PAGE_CACHE_SIZE
+#  define ERROR_PAGE_CACHE_SIZE 64 // Rendered error pages kept per worker
+# endif
+
+# ifndef TLS_RELOAD_CHECK_INTERVAL
+#  define TLS_RELOAD_CHECK_INTERVAL 60000 // Check certificate files for changes every minute (ms)
+# endif
+
+# ifndef TLS_SESSION_CACHE_SIZE
+#  define TLS_SESSION_CACHE_SIZE 20480 // Sessions kept for resumption by id
+# endif
+
+# ifndef TLS_SESSION_TIMEOUT
+#  define TLS_SESSION_TIMEOUT 7200 // Session (and ticket) lifetime (s)
+# endif
+
+# ifndef DEFAULT_TLS_TICKET_ROTATION_INTERVAL
+#  define DEFAULT_TLS_TICKET_ROTATION_INTERVAL 3600 // Make a new session ticket key every hour (s)
+# endif
+
+# ifndef MAIL_QUEUE_MAX_SIZE
+#  define MAIL_QUEUE_MAX_SIZE 1024 // Unsent verification emails kept in memory
+# endif
+
+# ifndef MAIL_MAX_PARALLEL_TRANSFERS
+#  define MAIL_MAX_PARALLEL_TRANSFERS 8 // Simultaneous SMTP connections
+# endif
+
+# ifndef MAIL_MAX_ATTEMPTS
+#  define MAIL_MAX_ATTEMPTS 5 // Give up on a message after this many failures
+# endif
+
+# ifndef MAIL_RETRY_DELAY
+#  define MAIL_RETRY_DELAY 2000 // First retry delay, doubles every attempt (ms)
+# endif
+
+# ifndef MAIL_CONNECT_TIMEOUT
+#  define MAIL_CONNECT_TIMEOUT 15 // (s)
+# endif
+
+# ifndef MAIL_TRANSFER_TIMEOUT
+#  define MAIL_TRANSFER_TIMEOUT 60 // (s)
+# endif
+
 # ifndef CONFIG_DIR
 #  define CONFIG_DIR "/etc/webserver/" // 16 MB
 # endif
 
+# ifndef USERS_RECENT_MIN_SIZE
+#  define USERS_RECENT_MIN_SIZE 64 // New users kept aside before the user table gets rebuilt, while it is small
+# endif
+
+# ifndef JOURNAL_SYNC_INTERVAL
+#  define JOURNAL_SYNC_INTERVAL 100 // Milliseconds between fsyncs of the users journal: appends in between share one
+# endif
+
+# ifndef JOURNAL_COMPACT_SIZE
+#  define JOURNAL_COMPACT_SIZE 1048576 // Users journal size that triggers writing passwd anew
+# endif
+
+# ifndef DEFAULT_PENDING_TTL
+#  define DEFAULT_PENDING_TTL 86400 // How long a verification link stays valid (s)
+# endif
+
+# ifndef PENDING_USERS_TICK
+#  define PENDING_USERS_TICK 1000 // Resolution of pending registrations' expiry (ms)
+# endif
+
+# ifndef PENDING_USERS_MAX_COUNT
+#  define PENDING_USERS_MAX_COUNT 65536 // Unverified registrations kept at once. New ones get 503 beyond that
+# endif
+
+# ifndef PENDING_USERS_MAX_MEMORY
+#  define PENDING_USERS_MAX_MEMORY 16777216 // Memory for unverified registrations: 16 MB
+# endif
+
+# ifndef DEFAULT_RATE_REGISTER
+#  define DEFAULT_RATE_REGISTER {.per_minute = 6, .burst = 3, .global_per_minute = 600} // Requests to /register
+# endif
+
+# ifndef DEFAULT_RATE_VERIFY
+#  define DEFAULT_RATE_VERIFY {.per_minute = 30, .burst = 10, .global_per_minute = 3000} // Requests to /verify/*
+# endif
+
+# ifndef RATELIMIT_TABLE_SIZE
+#  define RATELIMIT_TABLE_SIZE 16384 // Clients remembered by the rate limiter (power of 2): 32 bytes each
+# endif
+
+# ifndef DEFAULT_SCRYPT_N
+#  define DEFAULT_SCRYPT_N 16384 // scrypt CPU/memory cost of new password hashes (power of 2): 16 MB with r = 8
+# endif
+
+# ifndef DEFAULT_SCRYPT_R
+#  define DEFAULT_SCRYPT_R 8 // scrypt block size
+# endif
+
+# ifndef DEFAULT_SCRYPT_P
+#  define DEFAULT_SCRYPT_P 1 // scrypt parallelization
+# endif
+
+# ifndef SCRYPT_SALT_SIZE
+#  define SCRYPT_SALT_SIZE 16 // (bytes)
+# endif
+
+# ifndef SCRYPT_KEY_SIZE
+#  define SCRYPT_KEY_SIZE 32 // (bytes)
+# endif
+
+# ifndef SCRYPT_MAX_MEMORY
+#  define SCRYPT_MAX_MEMORY 268435456 // Stored hashes asking for more memory than this (256 MB) never match
+# endif
+
+# ifndef PASSWORD_HASH_MAX_SIZE
+#  define PASSWORD_HASH_MAX_SIZE 255 // Longest password (hash) read from passwd
+# endif
+
+# ifndef DEFAULT_HASH_THREADS
+#  define DEFAULT_HASH_THREADS 2 // Threads hashing and checking passwords: every one takes scrypt's memory
+# endif
+
+# ifndef PASSWORDS_QUEUE_MAX_SIZE
+#  define PASSWORDS_QUEUE_MAX_SIZE 256 // Passwords waiting for a hashing thread. Registrations get 503 beyond that
+# endif
+
 #endif //WEBSERVER_CONSTANTS_H
@@ -0,0 +1,312 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "dirlist.h"
+
+#include "constants.h"
+#include "server.h"
+#include "tools.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <strings.h>
+#include <list>
+#include <unordered_map>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+
+// Anything that changes what a listing shows
+#define DIRLIST_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | \
+                            IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+
+/// Cached listing and what it takes to tell if it is still valid
+typedef struct
+{
+    std::shared_ptr<const dir_listing> listing;
+    int wd;                       // inotify watch of the directory, -1 - none (only mtime is checked then)
+    unsigned long long version;   // Version of the watch the listing was read at
+    unsigned long long overflows; // Events lost before the listing was read
+    size_t bytes;
+    bool large;                   // Didn't fit into dir_cache_size: kept in dirlist_large_lru
+    std::list<std::string>::iterator lru;
+} dirlist_cached;
+
+/// inotify watch shared by listings of the same directory
+typedef struct
+{
+    unsigned long long version; // Bumped on every event
+    unsigned users;
+} dirlist_watch;
+
+static std::unordered_map<std::string, dirlist_cached> dirlist_cache;
+static std::list<std::string> dirlist_lru; // Most recently used first
+// Listings bigger than the whole cache: reading and stat'ing them anew for every request costs far more
+static std::list<std::string> dirlist_large_lru;
+static std::unordered_map<int, dirlist_watch> dirlist_watches;
+static size_t dirlist_cache_bytes = 0, dirlist_large_bytes = 0;
+static unsigned long long dirlist_overflows = 0; // Queue overflows: every listing may be stale after one
+static int dirlist_inotify = -2; // -2 - not initialized yet, -1 - unavailable
+// Workers share the cache
+static pthread_mutex_t dirlist_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics
+static std::atomic<unsigned long long> dirlist_hits{0}, dirlist_misses{0}, dirlist_invalidations{0}, dirlist_evictions{0};
+
+
+/// Apply queued inotify events. Caller holds dirlist_mutex
+static void dirlist_drain_events_locked()
+{
+    if (dirlist_inotify < 0) return;
+
+    alignas(struct inotify_event) char buf[16384];
+    ssize_t n;
+    while ((n = read(dirlist_inotify, buf, sizeof(buf))) > 0)
+    {
+        for (char* p = buf; p < buf + n;)
+        {
+            auto* event = reinterpret_cast<struct inotify_event*>(p);
+            if (event->mask & IN_Q_OVERFLOW) ++dirlist_overflows;
+            else if (auto w = dirlist_watches.find(event->wd); w != dirlist_watches.end()) ++w->second.version;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+/// Start watching the directory (or join the existing watch). Caller holds dirlist_mutex
+static int dirlist_watch_locked(const std::string& path)
+{
+    if (dirlist_inotify == -2)
+    {
+        dirlist_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (dirlist_inotify < 0)
+            MG_INFO(("[DIRLIST] inotify is not available (%s): listings are validated by mtime only", strerror(errno)));
+    }
+    if (dirlist_inotify < 0) return -1;
+
+    int wd = inotify_add_watch(dirlist_inotify, path.c_str(), DIRLIST_WATCH_MASK);
+    if (wd < 0)
+    {
+        MG_DEBUG(("[DIRLIST] Can't watch [%s]: %s", path.c_str(), strerror(errno)));
+        return -1;
+    }
+    dirlist_watches.try_emplace(wd, dirlist_watch{.version = 0, .users = 0});
+    return wd;
+}
+
+/// Stop watching if nothing uses the watch anymore. Caller holds dirlist_mutex
+static void dirlist_unwatch_locked(int wd)
+{
+    auto w = dirlist_watches.find(wd);
+    if (w == dirlist_watches.end() || w->second.users > 0) return;
+    inotify_rm_watch(dirlist_inotify, wd);
+    dirlist_watches.erase(w);
+}
+
+/// Drop cached listing. Caller holds dirlist_mutex
+static void dirlist_erase_locked(std::unordered_map<std::string, dirlist_cached>::iterator it)
+{
+    int wd = it->second.wd;
+    (it->second.large ? dirlist_large_bytes : dirlist_cache_bytes) -= it->second.bytes;
+    (it->second.large ? dirlist_large_lru : dirlist_lru).erase(it->second.lru);
+    dirlist_cache.erase(it);
+
+    if (wd >= 0)
+    {
+        --dirlist_watches[wd].users;
+        dirlist_unwatch_locked(wd);
+    }
+}
+
+/// Read and stat every entry of the directory
+static std::shared_ptr<dir_listing> dirlist_read(const std::string& path)
+{
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) return nullptr;
+
+    auto listing = std::make_shared<dir_listing>();
+    listing->path = path;
+
+    // mtime goes first: if the directory changes while it is being read, the next check catches it
+    struct stat st{ };
+    if (fstat(dirfd(dir), &st) == 0) listing->mtime = st.st_mtim;
+    listing->modified = listing->mtime.tv_sec;
+
+    while (struct dirent* de = readdir(dir))
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (fstatat(dirfd(dir), de->d_name, &st, 0) != 0) continue; // Gone already or a dangling link
+
+        bool is_dir = S_ISDIR(st.st_mode);
+        listing->entries.push_back(
+            dir_entry{
+                .name = de->d_name,
+                .size = is_dir ? 0 : static_cast<unsigned long long>(st.st_size),
+                .mtime = st.st_mtime,
+                .is_dir = is_dir
+            }
+        );
+        listing->modified = std::max(listing->modified, st.st_mtime);
+    }
+    closedir(dir);
+    return listing;
+}
+
+/// Approximate memory taken by the listing
+static size_t dirlist_bytes(const dir_listing& listing)
+{
+    size_t bytes = sizeof(dir_listing) + listing.path.capacity() + listing.entries.capacity() * sizeof(dir_entry);
+    for (auto& e : listing.entries) bytes += e.name.capacity();
+    bytes += DIR_SORT_COUNT * listing.entries.size() * sizeof(uint32_t); // Sort orders, once built
+    return bytes;
+}
+
+static bool same_mtime(const struct timespec& a, const struct timespec& b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+
+std::shared_ptr<const dir_listing> dirlist_get(const std::string& dir)
+{
+    std::string path(dir);
+    while (path.size() > 1 && path.ends_with('/')) path.pop_back(); // One key per directory
+
+    if (dir_cache_size == 0) // Cache is disabled
+    {
+        ++dirlist_misses;
+        return dirlist_read(path);
+    }
+
+    struct stat st{ };
+    if (::stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) return nullptr;
+
+    int wd;
+    unsigned long long version, overflows;
+    {
+        mutex_locker l(&dirlist_mutex);
+        dirlist_drain_events_locked();
+
+        if (auto it = dirlist_cache.find(path); it != dirlist_cache.end())
+        {
+            auto& cached = it->second;
+            if (same_mtime(cached.listing->mtime, st.st_mtim) && cached.overflows == dirlist_overflows &&
+                (cached.wd < 0 || cached.version == dirlist_watches[cached.wd].version))
+            {
+                auto& lru = cached.large ? dirlist_large_lru : dirlist_lru;
+                lru.splice(lru.begin(), lru, cached.lru);
+                ++dirlist_hits;
+                return cached.listing;
+            }
+
+            ++dirlist_invalidations;
+            dirlist_erase_locked(it);
+        }
+
+        // Watch before reading, so changes made while reading aren't lost
+        wd = dirlist_watch_locked(path);
+        version = wd >= 0 ? dirlist_watches[wd].version : 0;
+        overflows = dirlist_overflows;
+    }
+
+    ++dirlist_misses;
+    std::shared_ptr<const dir_listing> listing = dirlist_read(path);
+    size_t bytes = listing ? dirlist_bytes(*listing) : 0;
+
+    mutex_locker l(&dirlist_mutex);
+    dirlist_drain_events_locked();
+
+    bool changed = overflows != dirlist_overflows || (wd >= 0 && version != dirlist_watches[wd].version);
+    if (listing == nullptr || changed)
+    {
+        // Serve it this time, but don't keep it
+        if (wd >= 0) dirlist_unwatch_locked(wd);
+        return listing;
+    }
+
+    if (wd >= 0) ++dirlist_watches[wd].users; // Before the old entry (if any) releases the same watch
+    if (auto it = dirlist_cache.find(path); it != dirlist_cache.end()) dirlist_erase_locked(it); // Another worker was faster
+
+    // A listing too big for the cache takes room from other big ones. One bigger than all of that room is kept
+    // alone, so there is a single listing over DIR_CACHE_LARGE_SIZE at most
+    bool large = bytes > dir_cache_size;
+    auto& lru = large ? dirlist_large_lru : dirlist_lru;
+    while (!lru.empty() &&
+           (large ? dirlist_large_bytes + bytes > DIR_CACHE_LARGE_SIZE : dirlist_cache_bytes + bytes > dir_cache_size))
+    {
+        ++dirlist_evictions;
+        dirlist_erase_locked(dirlist_cache.find(lru.back()));
+    }
+
+    lru.push_front(path);
+    dirlist_cache.emplace(
+        path, dirlist_cached{
+            .listing = listing,
+            .wd = wd,
+            .version = version,
+            .overflows = overflows,
+            .bytes = bytes,
+            .large = large,
+            .lru = lru.begin()
+        }
+    );
+    (large ? dirlist_large_bytes : dirlist_cache_bytes) += bytes;
+    return listing;
+}
+
+const std::vector<uint32_t>& dirlist_order(const dir_listing& listing, dir_sort key)
+{
+    std::call_once(
+        listing.order_once[key], [&]
+        {
+            auto& order = listing.order[key];
+            order.resize(listing.entries.size());
+            for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+
+            auto& entries = listing.entries;
+            std::stable_sort(
+                order.begin(), order.end(), [&](uint32_t ia, uint32_t ib)
+                {
+                    const dir_entry& a = entries[ia];
+                    const dir_entry& b = entries[ib];
+                    if (key == DIR_SORT_BYTES) return a.name < b.name;
+                    if (a.is_dir != b.is_dir) return a.is_dir; // Directories go first
+                    switch (key)
+                    {
+                        case DIR_SORT_MTIME:
+                            if (a.mtime != b.mtime) return a.mtime < b.mtime;
+                            break;
+                        case DIR_SORT_SIZE:
+                            if (a.size != b.size) return a.size < b.size;
+                            break;
+                        default:
+                            break;
+                    }
+                    int cmp = strcasecmp(a.name.c_str(), b.name.c_str());
+                    return cmp != 0 ? cmp < 0 : a.name < b.name;
+                }
+            );
+        }
+    );
+    return listing.order[key];
+}
+
+void dirlist_metrics(std::string& out)
+{
+    append_metric(out, "dir_cache_hits", dirlist_hits);
+    append_metric(out, "dir_cache_misses", dirlist_misses);
+    append_metric(out, "dir_cache_invalidations", dirlist_invalidations);
+    append_metric(out, "dir_cache_evictions", dirlist_evictions);
+
+    mutex_locker l(&dirlist_mutex);
+    append_metric(out, "dir_cache_listings", dirlist_cache.size());
+    append_metric(out, "dir_cache_bytes", dirlist_cache_bytes);
+    append_metric(out, "dir_cache_large_listings", dirlist_large_lru.size());
+    append_metric(out, "dir_cache_large_bytes", dirlist_large_bytes);
+}
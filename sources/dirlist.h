@@ -0,0 +1,60 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Directory listing cache. Entries of a directory are read and stat'ed once,
+/// then reused by every /dir/ request until inotify reports a change.
+/// Listings too big for the cache are kept aside, within DIR_CACHE_LARGE_SIZE
+
+#ifndef WEBSERVER_DIRLIST_H
+#define WEBSERVER_DIRLIST_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+
+
+typedef struct
+{
+    std::string name;
+    unsigned long long size; // 0 for directories
+    time_t mtime;
+    bool is_dir;
+} dir_entry;
+
+enum dir_sort
+{
+    DIR_SORT_NAME,
+    DIR_SORT_MTIME,
+    DIR_SORT_SIZE,
+    DIR_SORT_BYTES, // Names in byte order, directories mixed in: a stable key for cursors
+    DIR_SORT_COUNT
+};
+
+/// Snapshot of a directory. Never changes once published, so it is shared without locking
+typedef struct
+{
+    std::string path;
+    struct timespec mtime; // Of the directory itself
+    time_t modified;       // Latest mtime of the directory and its entries
+    std::vector<dir_entry> entries; // In readdir() order
+
+    // Entry indexes in ascending order for every sort key, built on first use and shared by all requests
+    mutable std::once_flag order_once[DIR_SORT_COUNT];
+    mutable std::vector<uint32_t> order[DIR_SORT_COUNT];
+} dir_listing;
+
+
+/// Get entries of directory at path (cached or freshly read). Returns nullptr if it can't be read
+extern std::shared_ptr<const dir_listing> dirlist_get(const std::string& path);
+
+/// Get entry indexes of the listing sorted by key, directories first unless sorted by bytes
+/// (read backwards for descending order)
+extern const std::vector<uint32_t>& dirlist_order(const dir_listing& listing, dir_sort key);
+
+/// Append listing cache counters to metrics
+extern void dirlist_metrics(std::string& out);
+
+#endif //WEBSERVER_DIRLIST_H
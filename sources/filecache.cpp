@@ -0,0 +1,214 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "filecache.h"
+
+#include "constants.h"
+#include "server.h"
+#include "tools.h"
+
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+
+/// Cached file and its place in the LRU list
+typedef struct
+{
+    std::shared_ptr<const cached_file> file;
+    size_t bytes;
+    std::list<std::string>::iterator lru;
+} filecache_entry;
+
+/// File being opened by some worker. Others asking for the same path wait for it instead of reading it again
+typedef struct
+{
+    bool done;
+    std::shared_ptr<const cached_file> file;
+} filecache_load;
+
+static std::unordered_map<std::string, filecache_entry> filecache;
+static std::list<std::string> filecache_lru; // Most recently used first
+static std::unordered_map<std::string, std::shared_ptr<filecache_load>> filecache_loads;
+static size_t filecache_bytes = 0, filecache_fds = 0;
+// Workers share the cache
+static pthread_mutex_t filecache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t filecache_loaded = PTHREAD_COND_INITIALIZER;
+
+// Statistics
+static std::atomic<unsigned long long> filecache_hits{0}, filecache_misses{0}, filecache_waits{0},
+    filecache_invalidations{0}, filecache_evictions{0};
+
+
+/// Check if both describe the same version of the same file
+static bool same_file(const struct stat& a, const struct stat& b)
+{
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size &&
+           a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+/// Wrap file's descriptor (or contents) so the descriptor gets closed with the last reference
+static std::shared_ptr<cached_file> filecache_make(const std::string& path, const struct stat& st, int fd, std::string data)
+{
+    return std::shared_ptr<cached_file>(
+        new cached_file{.path = path, .st = st, .data = std::move(data), .fd = fd}, [](cached_file* f)
+        {
+            if (f->fd >= 0) close(f->fd); // Only when the last transfer using it is over
+            delete f;
+        }
+    );
+}
+
+/// Open the file and read it whole if it is small and read_small is set
+static std::shared_ptr<const cached_file> filecache_open(const std::string& path, bool read_small)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+
+    std::shared_ptr<cached_file> file = filecache_make(path, { }, fd, { });
+    if (fstat(fd, &file->st) != 0 || !S_ISREG(file->st.st_mode)) return nullptr;
+
+    size_t size = static_cast<size_t>(file->st.st_size);
+    if (read_small && size <= FILE_CACHE_MAX_FILE_SIZE)
+    {
+        file->data.resize(size);
+        size_t got = 0;
+        ssize_t n;
+        while (got < size && (n = pread(fd, file->data.data() + got, size - got, static_cast<off_t>(got))) > 0)
+            got += static_cast<size_t>(n);
+
+        if (got == size)
+        {
+            close(fd);
+            file->fd = -1;
+        }
+        else file->data.clear(); // Truncated meanwhile: the descriptor will do
+    }
+    return file;
+}
+
+/// Drop cached file. Caller holds filecache_mutex
+static void filecache_erase_locked(std::unordered_map<std::string, filecache_entry>::iterator it)
+{
+    filecache_bytes -= it->second.bytes;
+    if (it->second.file->fd >= 0) --filecache_fds;
+    filecache_lru.erase(it->second.lru);
+    filecache.erase(it);
+}
+
+/// Keep freshly opened file, evicting the least recently used ones to make room. Caller holds filecache_mutex
+static void filecache_insert_locked(const std::string& path, const std::shared_ptr<const cached_file>& file)
+{
+    size_t bytes = sizeof(cached_file) + path.capacity() + file->data.capacity();
+    if (bytes > file_cache_size) return; // Serve it this time, but don't keep it
+    if (auto it = filecache.find(path); it != filecache.end()) filecache_erase_locked(it);
+
+    bool uses_fd = file->fd >= 0;
+    while (!filecache_lru.empty() &&
+           (filecache_bytes + bytes > file_cache_size || (uses_fd && filecache_fds >= FILE_CACHE_MAX_FDS)))
+    {
+        ++filecache_evictions;
+        filecache_erase_locked(filecache.find(filecache_lru.back()));
+    }
+
+    filecache_lru.push_front(path);
+    filecache.emplace(path, filecache_entry{.file = file, .bytes = bytes, .lru = filecache_lru.begin()});
+    filecache_bytes += bytes;
+    if (uses_fd) ++filecache_fds;
+}
+
+/// Find cached file that is still what st describes. Drops it if it is not. Caller holds filecache_mutex
+static std::shared_ptr<const cached_file> filecache_find_locked(const std::string& path, const struct stat& st)
+{
+    auto it = filecache.find(path);
+    if (it == filecache.end()) return nullptr;
+
+    if (same_file(it->second.file->st, st))
+    {
+        filecache_lru.splice(filecache_lru.begin(), filecache_lru, it->second.lru);
+        ++filecache_hits;
+        return it->second.file;
+    }
+
+    ++filecache_invalidations;
+    filecache_erase_locked(it);
+    return nullptr;
+}
+
+
+std::shared_ptr<const cached_file> filecache_get(const std::string& path)
+{
+    if (file_cache_size == 0) // Cache is disabled
+    {
+        ++filecache_misses;
+        return filecache_open(path, false);
+    }
+
+    struct stat st{ };
+    if (::stat(path.c_str(), &st) != 0) return nullptr;
+
+    std::shared_ptr<filecache_load> load;
+    {
+        mutex_locker l(&filecache_mutex);
+        if (auto file = filecache_find_locked(path, st)) return file;
+
+        if (auto it = filecache_loads.find(path); it != filecache_loads.end())
+        {
+            // Somebody is reading it right now, take their result
+            std::shared_ptr<filecache_load> pending = it->second;
+            ++filecache_waits;
+            while (!pending->done) pthread_cond_wait(&filecache_loaded, &filecache_mutex);
+            return pending->file;
+        }
+
+        load = std::make_shared<filecache_load>();
+        filecache_loads[path] = load;
+    }
+
+    ++filecache_misses;
+    std::shared_ptr<const cached_file> file = filecache_open(path, true);
+
+    mutex_locker l(&filecache_mutex);
+    load->done = true;
+    load->file = file;
+    filecache_loads.erase(path);
+    pthread_cond_broadcast(&filecache_loaded);
+
+    if (file != nullptr) filecache_insert_locked(path, file);
+    return file;
+}
+
+std::shared_ptr<const cached_file> filecache_find(const std::string& path, const struct stat& st)
+{
+    if (file_cache_size == 0) return nullptr;
+    mutex_locker l(&filecache_mutex);
+    return filecache_find_locked(path, st);
+}
+
+std::shared_ptr<const cached_file> filecache_put(const std::string& path, const struct stat& st, int fd, std::string data)
+{
+    ++filecache_misses;
+    std::shared_ptr<const cached_file> file = filecache_make(path, st, fd, std::move(data));
+    if (file_cache_size == 0) return file;
+
+    mutex_locker l(&filecache_mutex);
+    filecache_insert_locked(path, file);
+    return file;
+}
+
+void filecache_metrics(std::string& out)
+{
+    append_metric(out, "file_cache_hits", filecache_hits);
+    append_metric(out, "file_cache_misses", filecache_misses);
+    append_metric(out, "file_cache_waits", filecache_waits);
+    append_metric(out, "file_cache_invalidations", filecache_invalidations);
+    append_metric(out, "file_cache_evictions", filecache_evictions);
+
+    mutex_locker l(&filecache_mutex);
+    append_metric(out, "file_cache_files", filecache.size());
+    append_metric(out, "file_cache_bytes", filecache_bytes);
+    append_metric(out, "file_cache_fds", filecache_fds);
+}
@@ -0,0 +1,41 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Hot file cache for /dir/. Small files are kept in memory, bigger ones keep their descriptor open,
+/// both are checked against the file's inode, size and mtime on every use
+
+#ifndef WEBSERVER_FILECACHE_H
+#define WEBSERVER_FILECACHE_H
+
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+
+
+/// Opened regular file. Never changes once published, so it is shared without locking
+typedef struct
+{
+    std::string path;
+    struct stat st;
+    std::string data; // Whole contents of small files, empty otherwise
+    int fd;           // Open descriptor when there is no data (read it with offsets only), -1 otherwise
+} cached_file;
+
+
+/// Get the regular file at path (cached or freshly opened).
+/// Returns nullptr if it can't be opened or is not a regular file
+extern std::shared_ptr<const cached_file> filecache_get(const std::string& path);
+
+/// Get the cached file at path if it is still what st describes, without touching the disk
+extern std::shared_ptr<const cached_file> filecache_find(const std::string& path, const struct stat& st);
+
+/// Cache the file opened elsewhere: its descriptor (owned by the cache from now on, -1 if there is none)
+/// or its whole contents in data
+extern std::shared_ptr<const cached_file> filecache_put(
+        const std::string& path, const struct stat& st, int fd, std::string data
+    );
+
+/// Append file cache counters to metrics
+extern void filecache_metrics(std::string& out);
+
+#endif //WEBSERVER_FILECACHE_H
@@ -0,0 +1,36 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "fsrequest.h"
+
+#include <cstring>
+
+
+std::string_view uri_tail(const struct mg_http_message* msg, std::string_view prefix)
+{
+    std::string_view uri(msg->uri.buf, msg->uri.len);
+    return uri.starts_with(prefix) ? uri.substr(prefix.size()) : std::string_view();
+}
+
+bool fs_request_parse(fs_request& r, const struct mg_http_message* msg, std::string_view prefix)
+{
+    std::string_view tail = uri_tail(msg, prefix);
+    bool slash = !tail.starts_with('/'); // Make always start with a '/'
+    if (tail.size() + slash + 2 > sizeof(r.path)) return false; // Room for the '/'s and '\0'
+    r.path[0] = '/';
+    memcpy(r.path + slash, tail.data(), tail.size());
+    r.path_len = tail.size() + slash;
+    r.path[r.path_len] = 0;
+
+    // Decode %XX encoded characters: '..' is looked for after that, so it can't sneak in encoded
+    int decoded = mg_url_decode(r.path, r.path_len, r.decoded_path, sizeof(r.decoded_path), 0);
+    r.st = { };
+    if (decoded < 0 || !mg_path_is_sane(mg_str_n(r.decoded_path, static_cast<size_t>(decoded))) ||
+        ::stat(r.decoded_path[1] ? r.decoded_path + 1 : ".", &r.st) != 0) // Relative to the working directory
+        return false;
+
+    // serve_dir() and uri_to_path() only look at the uri
+    r.msg = *msg;
+    r.msg.uri = mg_str_n(r.path, r.path_len);
+    return true;
+}
@@ -0,0 +1,36 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Requests for something under the working directory. Every filesystem handler resolves
+/// paths through fs_request_parse(), so they are all confined the same way. Nothing here
+/// allocates: paths live in fs_request's buffers, the rest are views of the request
+
+#ifndef WEBSERVER_FSREQUEST_H
+#define WEBSERVER_FSREQUEST_H
+
+#include "../mongoose/mongoose.h"
+
+#include <string_view>
+#include <sys/stat.h>
+
+
+typedef struct
+{
+    char path[MG_PATH_MAX];         // Path relative to the root (still %XX encoded), starts with '/'
+    size_t path_len;
+    char decoded_path[MG_PATH_MAX]; // The same path, decoded
+    struct stat st;
+    struct mg_http_message msg;     // The request, but with path as uri. Everything else still points into the original
+    struct mg_http_serve_opts opts;
+} fs_request;
+
+
+/// Part of request's uri after prefix (empty if there is nothing after it). A view into the request, nothing is copied
+extern std::string_view uri_tail(const struct mg_http_message* msg, std::string_view prefix);
+
+/// Take the path after prefix from request's uri, decode it and stat it relative to the working directory.
+/// Returns false if the path is too long, leaves the working directory or there is nothing there.
+/// r.opts is left for the caller
+extern bool fs_request_parse(fs_request& r, const struct mg_http_message* msg, std::string_view prefix);
+
+#endif //WEBSERVER_FSREQUEST_H
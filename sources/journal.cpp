@@ -0,0 +1,279 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "journal.h"
+
+#include "constants.h"
+#include "tools.h"
+#include "../mongoose/mongoose.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vector>
+#include <zlib.h>
+
+
+/// On-disk header of every record, followed by size bytes of the record itself
+typedef struct
+{
+    uint32_t size;
+    uint32_t crc; // CRC32 of the record
+} journal_header;
+
+static std::string journal_path;
+static int journal_fd = -1;
+static off_t journal_end = 0; // Size of the intact part
+static bool journal_dirty = false;
+static std::vector<std::function<void(bool)>> journal_waiters; // Of records the next sync covers
+static std::function<bool(uint64_t&)> journal_snapshot;
+// Appends come from every worker
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t journal_thread;
+static std::atomic<bool> journal_running{false};
+
+// Statistics
+static std::atomic<unsigned long long> journal_records{0}, journal_syncs{0}, journal_compactions{0},
+    journal_torn{0}, journal_failures{0};
+
+
+/// Apply every intact record of data. Returns the size of the intact part
+static size_t journal_replay(std::string_view data, const std::function<void(std::string_view)>& apply)
+{
+    size_t pos = 0;
+    journal_header header;
+    while (data.size() - pos >= sizeof(header))
+    {
+        memcpy(&header, data.data() + pos, sizeof(header));
+        if (header.size > data.size() - pos - sizeof(header)) break; // Torn write
+
+        std::string_view record = data.substr(pos + sizeof(header), header.size);
+        if (crc32(0, reinterpret_cast<const Bytef*>(record.data()), static_cast<uInt>(record.size())) != header.crc)
+            break; // Garbage: nothing after it can be trusted
+
+        apply(record);
+        pos += sizeof(header) + header.size;
+    }
+    return pos;
+}
+
+/// Keep only records after offset. Caller holds journal_mutex. The drop syncs every record so far:
+/// their waiters are moved to waiters, to be told they are safe once the lock is released
+static bool journal_drop_before_locked(off_t offset, std::vector<std::function<void(bool)>>& waiters)
+{
+    std::string tail(static_cast<size_t>(journal_end - offset), '\0');
+    if (pread(journal_fd, tail.data(), tail.size(), offset) != static_cast<ssize_t>(tail.size())) return false;
+
+    if (fdatasync(journal_fd) != 0 || !FILE_write_atomic(journal_path, tail)) return false;
+    journal_dirty = false;
+    ++journal_syncs;
+    waiters.swap(journal_waiters);
+
+    int fd = open(journal_path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC); // Read by the next compaction
+    close(journal_fd); // Points to the replaced file now
+    journal_fd = fd;
+    if (fd < 0) return false; // Appends fail from here on
+    journal_end = static_cast<off_t>(tail.size());
+    return true;
+}
+
+static void* journal_thread_loop(void*)
+{
+    off_t compact_at = JOURNAL_COMPACT_SIZE;
+    while (true)
+    {
+        off_t end;
+        bool running, synced = false;
+        std::vector<std::function<void(bool)>> waiters;
+        {
+            mutex_locker l(&journal_mutex);
+            if (journal_running)
+            {
+                struct timespec deadline{ };
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += JOURNAL_SYNC_INTERVAL * 1000000L;
+                deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+                deadline.tv_nsec %= 1000000000L;
+                pthread_cond_timedwait(&journal_cond, &journal_mutex, &deadline);
+            }
+
+            // Everything appended until now goes to the disk in one go
+            if (journal_dirty)
+            {
+                synced = fdatasync(journal_fd) == 0;
+                if (synced)
+                {
+                    journal_dirty = false;
+                    ++journal_syncs;
+                }
+                else
+                {
+                    // The kernel may have dropped the pages already: nobody gets told they are safe
+                    MG_ERROR(("[JOURNAL] Can't sync [%s]: %s", journal_path.c_str(), strerror(errno)));
+                    ++journal_failures;
+                }
+                waiters.swap(journal_waiters);
+            }
+            running = journal_running;
+            end = journal_end;
+        }
+
+        for (auto& waiter : waiters) waiter(synced);
+        if (!running) break;
+
+        // The owner tells which records its snapshot covers: those appended after it are kept
+        if (end < compact_at) continue;
+        uint64_t covered = 0;
+        if (!journal_snapshot(covered))
+        {
+            compact_at = end + JOURNAL_COMPACT_SIZE; // Don't retry on every sync
+            continue;
+        }
+        compact_at = JOURNAL_COMPACT_SIZE;
+
+        waiters.clear();
+        {
+            mutex_locker l(&journal_mutex);
+            if (journal_drop_before_locked(static_cast<off_t>(covered), waiters))
+            {
+                ++journal_compactions;
+                MG_DEBUG(("[JOURNAL] Compacted [%s]: %lld bytes left", journal_path.c_str(), (long long) journal_end));
+            }
+            else MG_ERROR(("[JOURNAL] Could not compact [%s]: %s", journal_path.c_str(), strerror(errno)));
+        }
+        for (auto& waiter : waiters) waiter(true); // Records appended while the snapshot was taken
+    }
+    return nullptr;
+}
+
+
+bool journal_open(
+        const char* path, const std::function<void(std::string_view)>& apply,
+        std::function<bool(uint64_t& covered)> snapshot
+    )
+{
+    journal_path = path;
+    journal_snapshot = std::move(snapshot);
+
+    journal_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (journal_fd < 0)
+    {
+        MG_ERROR(("[JOURNAL] Can't open [%s]: %s", path, strerror(errno)));
+        return false;
+    }
+
+    std::string data;
+    struct stat st{ };
+    if (fstat(journal_fd, &st) == 0) data.resize(static_cast<size_t>(st.st_size));
+    if (pread(journal_fd, data.data(), data.size(), 0) != static_cast<ssize_t>(data.size()))
+    {
+        MG_ERROR(("[JOURNAL] Can't read [%s]: %s", path, strerror(errno)));
+        close(journal_fd);
+        journal_fd = -1;
+        return false;
+    }
+
+    journal_end = static_cast<off_t>(journal_replay(data, apply));
+    if (journal_end != st.st_size)
+    {
+        // Left by a crash in the middle of an append: the record never got confirmed
+        ++journal_torn;
+        MG_ERROR(("[JOURNAL] [%s]: dropping %lld bytes of a torn record", path, (long long) (st.st_size - journal_end)));
+        if (ftruncate(journal_fd, journal_end) != 0 || fdatasync(journal_fd) != 0)
+            MG_ERROR(("[JOURNAL] Can't truncate [%s]: %s", path, strerror(errno)));
+    }
+
+    journal_running = true;
+    if (pthread_create(&journal_thread, nullptr, journal_thread_loop, nullptr) != 0)
+    {
+        MG_ERROR(("[JOURNAL] Could not start sync thread: every record is synced right away."));
+        journal_running = false;
+    }
+    return true;
+}
+
+void journal_close()
+{
+    if (journal_running)
+    {
+        {
+            mutex_locker l(&journal_mutex);
+            journal_running = false;
+            pthread_cond_signal(&journal_cond);
+        }
+        pthread_join(journal_thread, nullptr); // Syncs on the way out
+    }
+
+    mutex_locker l(&journal_mutex);
+    if (journal_fd >= 0) close(journal_fd);
+    journal_fd = -1;
+}
+
+bool journal_append(std::string_view record, std::function<void(bool)> synced)
+{
+    std::string buf(sizeof(journal_header), '\0');
+    journal_header header{
+        .size = static_cast<uint32_t>(record.size()),
+        .crc = static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef*>(record.data()), static_cast<uInt>(record.size())))
+    };
+    memcpy(buf.data(), &header, sizeof(header));
+    buf += record;
+
+    bool durable;
+    {
+        mutex_locker l(&journal_mutex);
+        if (journal_fd < 0) return false;
+
+        ssize_t n = write(journal_fd, buf.data(), buf.size());
+        if (n != static_cast<ssize_t>(buf.size()))
+        {
+            MG_ERROR(("[JOURNAL] Can't append to [%s]: %s", journal_path.c_str(), n < 0 ? strerror(errno) : "short write"));
+            if (n > 0 && ftruncate(journal_fd, journal_end) != 0)
+            {
+                // Can't take the torn record back: anything appended after it would be lost on replay
+                close(journal_fd);
+                journal_fd = -1;
+            }
+            ++journal_failures;
+            return false;
+        }
+
+        journal_end += n;
+        ++journal_records;
+        if (journal_running)
+        {
+            journal_dirty = true;
+            if (synced) journal_waiters.push_back(std::move(synced));
+            return true;
+        }
+
+        durable = fdatasync(journal_fd) == 0; // No sync thread
+        if (durable) ++journal_syncs;
+    }
+    if (synced) synced(durable);
+    return true;
+}
+
+uint64_t journal_position()
+{
+    mutex_locker l(&journal_mutex);
+    return static_cast<uint64_t>(journal_end);
+}
+
+void journal_metrics(std::string& out)
+{
+    append_metric(out, "journal_records", journal_records);
+    append_metric(out, "journal_syncs", journal_syncs);
+    append_metric(out, "journal_compactions", journal_compactions);
+    append_metric(out, "journal_torn", journal_torn);
+    append_metric(out, "journal_failures", journal_failures);
+
+    mutex_locker l(&journal_mutex);
+    append_metric(out, "journal_bytes", journal_end);
+}
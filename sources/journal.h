@@ -0,0 +1,40 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Append-only journal of changes to on-disk state. Records are appended with a single write()
+/// and fsync'ed in batches by a background thread, which tells the writers once their records are safe. Every record carries its size and CRC32,
+/// so a torn write at the end (crash, full disk) is detected and cut off on the next start.
+/// Once the journal grows big, the owner writes a snapshot and the journal drops what it covers
+
+#ifndef WEBSERVER_JOURNAL_H
+#define WEBSERVER_JOURNAL_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+
+/// Open (or create) the journal at path, pass every intact record to apply in order and start the sync thread.
+/// snapshot is called from that thread when the journal gets big: it must persist the owner's state, set covered
+/// to journal_position() read together with that state (under the lock appends are made under) and return true.
+/// Then the journal forgets the records before covered. Records after it must be harmless to apply twice
+extern bool journal_open(
+        const char* path, const std::function<void(std::string_view)>& apply,
+        std::function<bool(uint64_t& covered)> snapshot
+    );
+
+/// Sync what is pending, stop the sync thread and close the journal
+extern void journal_close();
+
+/// Append record. It reaches the disk within JOURNAL_SYNC_INTERVAL: then synced (if given) is called
+/// from the sync thread, with false if the disk refused it. Returns false, not calling synced, if nothing was appended
+extern bool journal_append(std::string_view record, std::function<void(bool)> synced = nullptr);
+
+/// Where the next record goes: everything appended so far is before it
+extern uint64_t journal_position();
+
+/// Append journal counters to metrics
+extern void journal_metrics(std::string& out);
+
+#endif //WEBSERVER_JOURNAL_H
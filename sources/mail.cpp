@@ -0,0 +1,278 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "mail.h"
+
+#include "constants.h"
+#include "tools.h"
+#include "../mongoose/mongoose.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <pthread.h>
+#include <curl/curl.h>
+
+
+/// One message and the state of its delivery
+typedef struct
+{
+    std::string to;
+    std::string message; // Headers and body
+    size_t pos;          // Upload position in message
+    int attempts;
+    uint64_t next_attempt; // ms
+    CURL* curl;
+    struct curl_slist* recipients;
+} mail_job;
+
+// Messages waiting to be picked up by the mail thread
+static std::deque<mail_job*> mail_queue;
+static pthread_mutex_t mail_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Account the messages are sent from
+static std::string mail_server, mail_from, mail_password;
+
+static pthread_t mail_thread;
+static CURLM* mail_multi = nullptr;
+static std::atomic<bool> mail_running{false};
+
+// Statistics
+static std::atomic<unsigned long long> mails_queued{0}, mails_sent{0}, mails_retried{0}, mails_failed{0}, mails_rejected{0};
+static std::atomic<unsigned long long> mails_pending{0};
+
+
+// Callback function that provides the data for the email message
+static size_t curl_read_callback_email_data(void* buffer, size_t size, size_t nmemb, void* instream)
+{
+    auto* upload = static_cast<mail_job*>(instream);
+
+    if ((size == 0) || (nmemb == 0) || ((size * nmemb) < 1) || upload->pos >= upload->message.size()) return 0;
+
+    size_t len = std::min(upload->message.size() - upload->pos, size * nmemb);
+
+    memcpy(buffer, upload->message.c_str() + upload->pos, len);
+    upload->pos += len;
+
+    return len;
+}
+
+/// Set up a curl handle for the job and hand it to the multi handle
+static bool mail_job_start(mail_job* job)
+{
+    job->curl = curl_easy_init();
+    if (!job->curl)
+    {
+        MG_ERROR(("[Mail] Unable to initialize curl."));
+        return false;
+    }
+    job->pos = 0;
+
+    // Set the SMTP server and port
+    curl_easy_setopt(job->curl, CURLOPT_URL, mail_server.c_str());
+
+    // Set the username and password for authentication
+    curl_easy_setopt(job->curl, CURLOPT_USERNAME, mail_from.c_str());
+    curl_easy_setopt(job->curl, CURLOPT_PASSWORD, mail_password.c_str());
+
+    curl_easy_setopt(job->curl, CURLOPT_MAIL_FROM, mail_from.c_str());
+    job->recipients = curl_slist_append(nullptr, job->to.c_str());
+    curl_easy_setopt(job->curl, CURLOPT_MAIL_RCPT, job->recipients);
+
+    curl_easy_setopt(job->curl, CURLOPT_READFUNCTION, curl_read_callback_email_data);
+    curl_easy_setopt(job->curl, CURLOPT_READDATA, job);
+    curl_easy_setopt(job->curl, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(job->curl, CURLOPT_PRIVATE, job);
+    curl_easy_setopt(job->curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(job->curl, CURLOPT_CONNECTTIMEOUT, static_cast<long>(MAIL_CONNECT_TIMEOUT));
+    curl_easy_setopt(job->curl, CURLOPT_TIMEOUT, static_cast<long>(MAIL_TRANSFER_TIMEOUT));
+    curl_easy_setopt(job->curl, CURLOPT_VERBOSE, mg_log_level >= MG_LL_VERBOSE ? 1L : 0L);
+
+    curl_multi_add_handle(mail_multi, job->curl);
+    return true;
+}
+
+/// Release the curl handle of the finished attempt
+static void mail_job_finish(mail_job* job)
+{
+    if (job->curl)
+    {
+        curl_multi_remove_handle(mail_multi, job->curl);
+        curl_easy_cleanup(job->curl);
+        job->curl = nullptr;
+    }
+    curl_slist_free_all(job->recipients);
+    job->recipients = nullptr;
+}
+
+/// Schedule another attempt with exponential backoff, or give up
+static bool mail_job_retry(mail_job* job, const char* error)
+{
+    if (++job->attempts >= MAIL_MAX_ATTEMPTS)
+    {
+        ++mails_failed;
+        MG_ERROR(("[Mail] Giving up on message to [%s] after %d attempts: %s", job->to.c_str(), job->attempts, error));
+        return false;
+    }
+
+    uint64_t delay = static_cast<uint64_t>(MAIL_RETRY_DELAY) << (job->attempts - 1);
+    job->next_attempt = mg_millis() + delay;
+    ++mails_retried;
+    MG_ERROR(("[Mail] Sending to [%s] failed: %s. Retrying in %llu ms...", job->to.c_str(), error, delay));
+    return true;
+}
+
+/// Mail thread: drain the queue and drive all transfers with one multi handle
+static void* mail_thread_loop(void*)
+{
+    std::list<mail_job*> jobs; // Waiting for retry or in flight
+
+    while (mail_running)
+    {
+        {
+            mutex_locker l(&mail_queue_mutex);
+            while (!mail_queue.empty())
+            {
+                jobs.push_back(mail_queue.front());
+                mail_queue.pop_front();
+            }
+        }
+
+        // Start whatever is due
+        uint64_t now = mg_millis(), wait = 1000;
+        int active = 0;
+        for (auto* job : jobs)
+        {
+            if (job->curl == nullptr && job->next_attempt <= now && active < MAIL_MAX_PARALLEL_TRANSFERS)
+                if (!mail_job_start(job))
+                    job->next_attempt = now + MAIL_RETRY_DELAY;
+            if (job->curl) ++active;
+            else if (job->next_attempt > now) wait = std::min(wait, job->next_attempt - now);
+        }
+
+        int running = 0;
+        curl_multi_perform(mail_multi, &running);
+
+        // Collect finished transfers
+        CURLMsg* msg;
+        int left = 0;
+        while ((msg = curl_multi_info_read(mail_multi, &left)) != nullptr)
+        {
+            if (msg->msg != CURLMSG_DONE) continue;
+
+            mail_job* job = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char**>(&job));
+            CURLcode res = msg->data.result;
+            mail_job_finish(job);
+
+            if (res == CURLE_OK)
+            {
+                ++mails_sent;
+                MG_DEBUG(("[Mail] Sent message to [%s]", job->to.c_str()));
+            }
+            else if (mail_job_retry(job, curl_easy_strerror(res))) continue;
+
+            jobs.remove(job);
+            delete job;
+            --mails_pending;
+        }
+
+        // Sleep until there is network activity, a retry is due or a new message is queued
+        curl_multi_poll(mail_multi, nullptr, 0, static_cast<int>(wait), nullptr);
+    }
+
+    for (auto* job : jobs)
+    {
+        mail_job_finish(job);
+        delete job;
+    }
+    return nullptr;
+}
+
+
+bool mail_queue_start(const char* smtp_server, const char* from, const char* password)
+{
+    mail_server = smtp_server;
+    mail_from = from;
+    mail_password = password == nullptr ? "" : password;
+
+    if (!(mail_multi = curl_multi_init()))
+    {
+        MG_ERROR(("[Mail] Unable to initialize curl."));
+        return false;
+    }
+
+    mail_running = true;
+    if (pthread_create(&mail_thread, nullptr, mail_thread_loop, nullptr) != 0)
+    {
+        MG_ERROR(("[Mail] Could not start mail thread."));
+        mail_running = false;
+        curl_multi_cleanup(mail_multi);
+        mail_multi = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void mail_queue_stop()
+{
+    if (!mail_running) return;
+
+    mail_running = false;
+    curl_multi_wakeup(mail_multi);
+    pthread_join(mail_thread, nullptr);
+
+    curl_multi_cleanup(mail_multi);
+    mail_multi = nullptr;
+
+    mutex_locker l(&mail_queue_mutex);
+    for (auto* job : mail_queue) delete job;
+    mail_queue.clear();
+}
+
+bool mail_enqueue(const std::string& to, const std::string& subject, const std::string& text)
+{
+    if (!mail_running) return false;
+
+    if (mails_pending >= MAIL_QUEUE_MAX_SIZE)
+    {
+        ++mails_rejected;
+        MG_ERROR(("[Mail] Queue is full. Dropping message to [%s]", to.c_str()));
+        return false;
+    }
+
+    auto* job = new mail_job{
+        .to = to,
+        .message = "To: " + to + "\r\n" +
+            "From: " + mail_from + "\r\n" +
+            "Subject: " + subject + "\r\n"
+            "\r\n" + text,
+        .pos = 0,
+        .attempts = 0,
+        .next_attempt = 0,
+        .curl = nullptr,
+        .recipients = nullptr
+    };
+
+    {
+        mutex_locker l(&mail_queue_mutex);
+        mail_queue.push_back(job);
+    }
+    ++mails_pending;
+    ++mails_queued;
+
+    curl_multi_wakeup(mail_multi); // Don't wait for the poll timeout
+    return true;
+}
+
+void mail_metrics(std::string& out)
+{
+    append_metric(out, "mail_queued", mails_queued);
+    append_metric(out, "mail_sent", mails_sent);
+    append_metric(out, "mail_retried", mails_retried);
+    append_metric(out, "mail_failed", mails_failed);
+    append_metric(out, "mail_rejected", mails_rejected);
+    append_metric(out, "mail_pending", mails_pending);
+}
@@ -0,0 +1,27 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Outgoing email queue. Messages are sent by a background thread,
+/// so http handlers never wait for the SMTP server
+
+#ifndef WEBSERVER_MAIL_H
+#define WEBSERVER_MAIL_H
+
+#include <string>
+
+
+/// Start the mail thread, sending as from through smtp_server (curl URL, e.g. "smtps://smtp.gmail.com:465"),
+/// logged in with from and password. Call after curl_global_init()
+extern bool mail_queue_start(const char* smtp_server, const char* from, const char* password);
+
+/// Stop the mail thread. Unsent messages are dropped
+extern void mail_queue_stop();
+
+/// Queue a message to given address.
+/// Returns false if the queue is full or not running
+extern bool mail_enqueue(const std::string& to, const std::string& subject, const std::string& text);
+
+/// Append mail queue counters to metrics
+extern void mail_metrics(std::string& out);
+
+#endif //WEBSERVER_MAIL_H
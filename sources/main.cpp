@@ -6,7 +6,7 @@
 #include <getopt.h>
 
 
-static constexpr const char* short_args = "t:l:m:M:s:Hvh";
+static constexpr const char* short_args = "t:l:m:M:s:w:Hvh";
 static constexpr struct option long_args[] = {
     { "http_address",   required_argument, nullptr, 10 },
     { "https_address",  required_argument, nullptr, 11 },
@@ -15,6 +15,19 @@ static constexpr struct option long_args[] = {
     { "email",          required_argument, nullptr, 'm' },
     { "email-password", required_argument, nullptr, 'M' },
     { "smtp-server",    required_argument, nullptr, 's' },
+    { "workers",        required_argument, nullptr, 'w' },
+    { "pin-workers",    no_argument,       nullptr, 12 },
+    { "tls-ticket-rotation", required_argument, nullptr, 13 },
+    { "no-ktls",        no_argument,       nullptr, 14 },
+    { "dir-cache-size", required_argument, nullptr, 15 },
+    { "compress-cache", required_argument, nullptr, 16 },
+    { "file-cache-size", required_argument, nullptr, 17 },
+    { "fs",             required_argument, nullptr, 18 },
+    { "scrypt",         required_argument, nullptr, 19 },
+    { "hash-threads",   required_argument, nullptr, 20 },
+    { "pending-ttl",    required_argument, nullptr, 21 },
+    { "rate-register",  required_argument, nullptr, 22 },
+    { "rate-verify",    required_argument, nullptr, 23 },
     { "hexdump",        no_argument,       nullptr, 'H' },
     { "version",        no_argument,       nullptr, 'v' },
     { "help",           no_argument,       nullptr, 'h' },
@@ -35,6 +48,21 @@ static void help()
     ::printf("*  --email           | m  <email>       Send a verification link to a newly registered user from this email.\n");
     ::printf("*  --email-password  | M  <password>    Password for your email account (auth token).\n");
     ::printf("   --smtp-server     | s  <ip address>  SMTP server api address.\n");
+    ::printf("   --workers         | w  <count>       Number of http(s) event loops sharing the ports (0 - one per cpu). Default: %d\n", workers_count);
+    ::printf("   --pin-workers     |                  Pin every event loop to its own cpu.\n");
+    ::printf("   --tls-ticket-rotation | <seconds>    Make a new TLS session ticket key this often. Default: %ld\n", tls_ticket_rotation_interval);
+    ::printf("   --no-ktls         |                  Don't hand TLS encryption over to the kernel (kTLS).\n");
+    ::printf("   --dir-cache-size  |    <bytes>       Memory for cached directory listings (0 - no cache). Default: %llu\n", dir_cache_size);
+    ::printf("   --compress-cache  |    <path>        Directory for compressed copies of text files ('' - don't compress). Default: %s\n", compress_cache_dir);
+    ::printf("   --file-cache-size |    <bytes>       Memory for cached small files under /dir/ (0 - no cache). Default: %llu\n", file_cache_size);
+    ::printf("   --fs              |    <posix|uring> How files under /dir/ are opened (uring - in the background with io_uring). Default: %s\n", fs_backend);
+    ::printf("   --scrypt          |    <N:r:p>       Cost of new password hashes. Default: %llu:%lu:%lu\n", scrypt_n, scrypt_r, scrypt_p);
+    ::printf("   --hash-threads    |    <count>       Threads hashing and checking passwords. Default: %d\n", hash_threads);
+    ::printf("   --pending-ttl     |    <seconds>     How long a verification link stays valid. Default: %ld\n", pending_ttl);
+    ::printf("   --rate-register   |    <n:burst:all> Registrations per minute a client (and all together) may make. Default: %g:%g:%g\n",
+             rate_limits[RATE_REGISTER].per_minute, rate_limits[RATE_REGISTER].burst, rate_limits[RATE_REGISTER].global_per_minute);
+    ::printf("   --rate-verify     |    <n:burst:all> Verification attempts per minute a client (and all together) may make. Default: %g:%g:%g\n",
+             rate_limits[RATE_VERIFY].per_minute, rate_limits[RATE_VERIFY].burst, rate_limits[RATE_VERIFY].global_per_minute);
     ::printf("   --hexdump         | H                Enable hex dump.\n");
     ::printf("   --version         | v                Show version information.\n");
     ::printf("   --help            | h                Show this help message.\n\n");
@@ -76,6 +104,34 @@ int main(int argc, char** argv)
                 break;
             case 's': server_verification_smtp_server = strdup(optarg);
                 break;
+            case 'w': workers_count = static_cast<int>(::strtol(optarg, nullptr, 10));
+                break;
+            case 12: pin_workers = 1;
+                break;
+            case 13: tls_ticket_rotation_interval = ::strtol(optarg, nullptr, 10);
+                break;
+            case 14: tls_ktls = 0;
+                break;
+            case 15: dir_cache_size = ::strtoull(optarg, nullptr, 10);
+                break;
+            case 16: compress_cache_dir = optarg;
+                break;
+            case 17: file_cache_size = ::strtoull(optarg, nullptr, 10);
+                break;
+            case 18: fs_backend = optarg;
+                break;
+            case 19: ::sscanf(optarg, "%llu:%lu:%lu", &scrypt_n, &scrypt_r, &scrypt_p);
+                break;
+            case 20: hash_threads = static_cast<int>(::strtol(optarg, nullptr, 10));
+                break;
+            case 21: pending_ttl = ::strtol(optarg, nullptr, 10);
+                break;
+            case 22: ::sscanf(optarg, "%lf:%lf:%lf", &rate_limits[RATE_REGISTER].per_minute,
+                              &rate_limits[RATE_REGISTER].burst, &rate_limits[RATE_REGISTER].global_per_minute);
+                break;
+            case 23: ::sscanf(optarg, "%lf:%lf:%lf", &rate_limits[RATE_VERIFY].per_minute,
+                              &rate_limits[RATE_VERIFY].burst, &rate_limits[RATE_VERIFY].global_per_minute);
+                break;
             case 'H': hexdump = 1;
                 break;
             case 'v': ::printf(APPNAME "version: " VERSION "\n");
@@ -0,0 +1,132 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "passwd.h"
+
+#include "constants.h"
+#include "tools.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <bits/local_lim.h>
+
+
+/// Header of passwd.bin: the same users as passwd, but ready to be mapped into memory and walked without parsing.
+/// Followed by count records: sizes of login, email and password (uint16_t each), then the strings themselves
+typedef struct
+{
+    char magic[8];
+    // passwd it was made from. If passwd looks different now, the snapshot is out of date
+    uint64_t source_size;
+    int64_t source_mtime_sec, source_mtime_nsec;
+    uint64_t count;
+    uint64_t size; // Of the records
+    uint32_t crc;  // CRC32 of the records
+    uint32_t reserved;
+} users_snapshot_header;
+
+#define USERS_SNAPSHOT_MAGIC "WSUSERS1"
+
+
+bool passwd_read(const char* path, std::vector<user_entry>& users)
+{
+    FILE* file = ::fopen(path, "rb"); // Open users file
+    if (file == nullptr) return false;
+    while (!::feof(file))
+    {
+        char username[HOST_NAME_MAX + 1]{};
+        char email[HOST_NAME_MAX + 1]{};
+        char password[PASSWORD_HASH_MAX_SIZE + 1]{};
+        if (::fscanf(file, "%64s : %64s : %255s\n", username, email, password) == 3) // Scan line in format "<user> : <email> : <password>\n"
+            users.push_back({username, {email, password}});
+    }
+    ::fclose(file);
+    return true;
+}
+
+bool passwd_snapshot_append(std::string& out, const user_entry& user)
+{
+    const std::string* fields[] = {&user.first, &user.second.first, &user.second.second};
+    for (auto* field : fields)
+    {
+        if (field->size() > UINT16_MAX) return false;
+        auto size = static_cast<uint16_t>(field->size());
+        out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    }
+    for (auto* field : fields) out += *field;
+    return true;
+}
+
+bool passwd_snapshot_write(const char* path, std::string records, uint64_t count, const struct stat& source)
+{
+    users_snapshot_header header{
+        .magic = { },
+        .source_size = static_cast<uint64_t>(source.st_size),
+        .source_mtime_sec = source.st_mtim.tv_sec,
+        .source_mtime_nsec = source.st_mtim.tv_nsec,
+        .count = count,
+        .size = records.size(),
+        .crc = static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef*>(records.data()), static_cast<uInt>(records.size()))),
+        .reserved = 0
+    };
+    memcpy(header.magic, USERS_SNAPSHOT_MAGIC, sizeof(header.magic));
+    records.insert(0, reinterpret_cast<const char*>(&header), sizeof(header));
+    return FILE_write_atomic(path, records);
+}
+
+bool passwd_snapshot_read(const char* path, const struct stat& source, std::vector<user_entry>& users)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat bst{ };
+    if (fstat(fd, &bst) != 0 || static_cast<size_t>(bst.st_size) < sizeof(users_snapshot_header))
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = static_cast<size_t>(bst.st_size);
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    users_snapshot_header header;
+    memcpy(&header, map, sizeof(header));
+    const char* records = static_cast<const char*>(map) + sizeof(header);
+    bool valid = memcmp(header.magic, USERS_SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.source_size == static_cast<uint64_t>(source.st_size) &&
+                 header.source_mtime_sec == source.st_mtim.tv_sec && header.source_mtime_nsec == source.st_mtim.tv_nsec &&
+                 header.size == size - sizeof(header) &&
+                 crc32(0, reinterpret_cast<const Bytef*>(records), static_cast<uInt>(header.size)) == header.crc;
+
+    users.clear();
+    users.reserve(valid ? header.count : 0);
+    const char* p = records;
+    const char* end = records + header.size;
+    for (uint64_t i = 0; valid && i < header.count; ++i)
+    {
+        uint16_t sizes[3];
+        if (end - p < static_cast<ptrdiff_t>(sizeof(sizes))) valid = false;
+        else
+        {
+            memcpy(sizes, p, sizeof(sizes));
+            p += sizeof(sizes);
+            if (end - p < static_cast<ptrdiff_t>(sizes[0] + sizes[1] + sizes[2])) valid = false;
+            else
+            {
+                users.emplace_back(
+                    std::string(p, sizes[0]),
+                    std::make_pair(std::string(p + sizes[0], sizes[1]), std::string(p + sizes[0] + sizes[1], sizes[2]))
+                );
+                p += sizes[0] + sizes[1] + sizes[2];
+            }
+        }
+    }
+    munmap(map, size);
+    return valid && p == end;
+}
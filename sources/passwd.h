@@ -0,0 +1,32 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Files registered users are kept in: passwd, lines of "<login> : <email> : <password>",
+/// and its binary snapshot passwd.bin, which is mapped into memory and walked without parsing
+
+#ifndef WEBSERVER_PASSWD_H
+#define WEBSERVER_PASSWD_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+
+
+typedef std::pair<std::string, std::pair<std::string, std::string>> user_entry; // login, {email, password}
+
+
+/// Parse passwd at path into users. Returns false if it can't be opened
+extern bool passwd_read(const char* path, std::vector<user_entry>& users);
+
+/// Append user's record of the snapshot to out. Returns false if it doesn't fit the format
+extern bool passwd_snapshot_append(std::string& out, const user_entry& user);
+
+/// Write snapshot at path (atomically): count records made of users of passwd described by source
+extern bool passwd_snapshot_write(const char* path, std::string records, uint64_t count, const struct stat& source);
+
+/// Read snapshot at path into users if it is intact and made from passwd described by source
+extern bool passwd_snapshot_read(const char* path, const struct stat& source, std::vector<user_entry>& users);
+
+#endif //WEBSERVER_PASSWD_H
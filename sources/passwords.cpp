@@ -0,0 +1,254 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "passwords.h"
+
+#include "constants.h"
+#include "server.h"
+#include "tools.h"
+
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include <pthread.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+
+static std::deque<std::shared_ptr<password_job>> passwords_queue;
+static pthread_mutex_t passwords_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t passwords_cond = PTHREAD_COND_INITIALIZER;      // Jobs were queued
+static pthread_cond_t passwords_done_cond = PTHREAD_COND_INITIALIZER; // Jobs somebody waits for were done
+
+static std::vector<pthread_t> passwords_threads;
+static std::atomic<bool> passwords_running{false};
+
+// Statistics
+static std::atomic<unsigned long long> passwords_hashed{0}, passwords_verified{0}, passwords_mismatches{0},
+    passwords_failed{0}, passwords_rejected{0}, passwords_work_us{0}, passwords_wait_us{0};
+
+
+static std::string to_hex(const unsigned char* data, size_t size)
+{
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string hex(size * 2, '0');
+    for (size_t i = 0; i < size; ++i)
+    {
+        hex[i * 2] = digits[data[i] >> 4];
+        hex[i * 2 + 1] = digits[data[i] & 0xf];
+    }
+    return hex;
+}
+
+static bool from_hex(std::string_view hex, std::vector<unsigned char>& data)
+{
+    if (hex.empty() || hex.size() % 2 != 0) return false;
+    data.resize(hex.size() / 2);
+    for (size_t i = 0; i < hex.size(); ++i)
+    {
+        char ch = hex[i];
+        int digit = ch >= '0' && ch <= '9' ? ch - '0' : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : -1;
+        if (digit < 0) return false;
+        data[i / 2] = static_cast<unsigned char>(i % 2 == 0 ? digit << 4 : data[i / 2] | digit);
+    }
+    return true;
+}
+
+/// Derive key from password with scrypt. Refuses costs needing more than SCRYPT_MAX_MEMORY
+static bool scrypt(
+        const std::string& password, const unsigned char* salt, size_t salt_size,
+        uint64_t n, uint64_t r, uint64_t p, unsigned char* key, size_t key_size
+    )
+{
+    if (r == 0 || p == 0 || n > SCRYPT_MAX_MEMORY / 128 / r || p > SCRYPT_MAX_MEMORY / 128 / r) return false;
+    uint64_t memory = 128 * r * (n + p + 2); // What OpenSSL allocates for these costs
+    if (memory > SCRYPT_MAX_MEMORY) return false;
+    return EVP_PBE_scrypt(password.data(), password.size(), salt, salt_size, n, r, p, memory, key, key_size) == 1;
+}
+
+/// Make a new hash of password with current costs. Empty on failure
+static std::string password_hash_now(const std::string& password)
+{
+    unsigned char salt[SCRYPT_SALT_SIZE], key[SCRYPT_KEY_SIZE];
+    if (RAND_bytes(salt, sizeof(salt)) != 1 ||
+        !scrypt(password, salt, sizeof(salt), scrypt_n, scrypt_r, scrypt_p, key, sizeof(key)))
+        return { };
+
+    std::string hash = string_format("$scrypt$%llu$%lu$%lu$", scrypt_n, scrypt_r, scrypt_p);
+    hash += to_hex(salt, sizeof(salt));
+    hash += '$';
+    hash += to_hex(key, sizeof(key));
+    OPENSSL_cleanse(key, sizeof(key));
+    return hash;
+}
+
+/// Check password against stored hash (or against a password stored as is)
+static bool password_verify_now(const std::string& stored, const std::string& password)
+{
+    if (!stored.starts_with("$scrypt$"))
+        return stored.size() == password.size() && CRYPTO_memcmp(stored.data(), password.data(), stored.size()) == 0;
+
+    unsigned long long n, r, p;
+    int fields = 0;
+    if (sscanf(stored.c_str(), "$scrypt$%llu$%llu$%llu$%n", &n, &r, &p, &fields) != 3 || fields == 0) return false;
+
+    std::string_view rest(stored.c_str() + fields);
+    size_t separator = rest.find('$');
+    std::vector<unsigned char> salt, expected;
+    if (separator == std::string_view::npos ||
+        !from_hex(rest.substr(0, separator), salt) || !from_hex(rest.substr(separator + 1), expected))
+        return false;
+
+    std::vector<unsigned char> key(expected.size());
+    bool verified = scrypt(password, salt.data(), salt.size(), n, r, p, key.data(), key.size()) &&
+        CRYPTO_memcmp(key.data(), expected.data(), key.size()) == 0;
+    OPENSSL_cleanse(key.data(), key.size());
+    return verified;
+}
+
+static void password_run(password_job& job)
+{
+    auto started = std::chrono::steady_clock::now();
+    if (job.stored.empty())
+    {
+        job.hash = password_hash_now(job.password);
+        if (job.hash.empty())
+        {
+            MG_ERROR(("[Passwords] Could not hash a password with scrypt N=%llu r=%lu p=%lu", scrypt_n, scrypt_r, scrypt_p));
+            ++passwords_failed;
+        }
+        else ++passwords_hashed;
+    }
+    else
+    {
+        job.verified = password_verify_now(job.stored, job.password);
+        ++passwords_verified;
+        if (!job.verified) ++passwords_mismatches;
+    }
+    OPENSSL_cleanse(job.password.data(), job.password.size());
+    job.password.clear();
+
+    passwords_work_us += static_cast<unsigned long long>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count()
+    );
+}
+
+static void* passwords_thread_loop(void*)
+{
+    while (true)
+    {
+        std::shared_ptr<password_job> job;
+        {
+            mutex_locker l(&passwords_mutex);
+            while (passwords_running && passwords_queue.empty()) pthread_cond_wait(&passwords_cond, &passwords_mutex);
+            if (!passwords_running) break;
+            job = std::move(passwords_queue.front());
+            passwords_queue.pop_front();
+        }
+
+        password_run(*job);
+
+        if (job->completed)
+        {
+            job->done.store(true, std::memory_order_release);
+            job->completed(*job);
+        }
+        else
+        {
+            mutex_locker l(&passwords_mutex);
+            job->done.store(true, std::memory_order_release);
+            pthread_cond_broadcast(&passwords_done_cond);
+        }
+    }
+    return nullptr;
+}
+
+
+bool passwords_start()
+{
+    // Fail right away on costs scrypt can't do, not on the first registration
+    if (password_hash_now("probe").empty())
+    {
+        MG_ERROR(("[Passwords] scrypt can't work with N=%llu r=%lu p=%lu", scrypt_n, scrypt_r, scrypt_p));
+        return false;
+    }
+
+    int threads = hash_threads > 0 ? hash_threads : 1;
+    passwords_running = true;
+    for (int i = 0; i < threads; ++i)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, passwords_thread_loop, nullptr) != 0)
+        {
+            MG_ERROR(("[Passwords] Could not start hashing thread."));
+            break;
+        }
+        passwords_threads.push_back(thread);
+    }
+    if (passwords_threads.empty()) passwords_running = false;
+    return passwords_running;
+}
+
+void passwords_stop()
+{
+    if (!passwords_running) return;
+    {
+        mutex_locker l(&passwords_mutex);
+        passwords_running = false;
+        passwords_queue.clear();
+        pthread_cond_broadcast(&passwords_cond);
+        pthread_cond_broadcast(&passwords_done_cond);
+    }
+    for (pthread_t thread : passwords_threads) pthread_join(thread, nullptr);
+    passwords_threads.clear();
+}
+
+bool password_submit(const std::shared_ptr<password_job>& job)
+{
+    mutex_locker l(&passwords_mutex);
+    if (!passwords_running || passwords_queue.size() >= PASSWORDS_QUEUE_MAX_SIZE)
+    {
+        ++passwords_rejected;
+        return false;
+    }
+    job->done.store(false, std::memory_order_relaxed);
+    passwords_queue.push_back(job);
+    pthread_cond_signal(&passwords_cond);
+    return true;
+}
+
+bool password_verify(const std::string& stored, const std::string& password)
+{
+    auto job = std::make_shared<password_job>();
+    job->password = password;
+    job->stored = stored;
+
+    auto started = std::chrono::steady_clock::now();
+    if (!password_submit(job)) return false; // Overloaded: the login fails, the client may retry
+
+    {
+        mutex_locker l(&passwords_mutex);
+        while (passwords_running && !job->done.load(std::memory_order_acquire))
+            pthread_cond_wait(&passwords_done_cond, &passwords_mutex);
+    }
+    passwords_wait_us += static_cast<unsigned long long>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count()
+    );
+    return job->done.load(std::memory_order_acquire) && job->verified;
+}
+
+void passwords_metrics(std::string& out)
+{
+    append_metric(out, "passwords_hashed", passwords_hashed);
+    append_metric(out, "passwords_verified", passwords_verified);
+    append_metric(out, "passwords_mismatches", passwords_mismatches);
+    append_metric(out, "passwords_failed", passwords_failed);
+    append_metric(out, "passwords_rejected", passwords_rejected);
+    append_metric(out, "passwords_work_us", passwords_work_us);
+    append_metric(out, "passwords_verify_wait_us", passwords_wait_us);
+
+    mutex_locker l(&passwords_mutex);
+    append_metric(out, "passwords_queue", passwords_queue.size());
+}
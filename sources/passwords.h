@@ -0,0 +1,46 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Password hashing with scrypt. Hashes are made and checked by a small pool of threads,
+/// so a burst of registrations or FTP logins never holds up the event loops.
+/// Stored format: "$scrypt$<N>$<r>$<p>$<salt hex>$<key hex>", every hash keeps its own cost
+
+#ifndef WEBSERVER_PASSWORDS_H
+#define WEBSERVER_PASSWORDS_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+
+
+typedef struct password_job
+{
+    std::string password; // Wiped once the job is done
+    std::string stored;   // Hash to check password against. Empty - make a new hash of password
+    // Called on the hashing thread once the job is done. Empty - somebody waits for the job instead
+    std::function<void(struct password_job&)> completed;
+
+    std::atomic<bool> done;
+    std::string hash;     // Result of hashing (valid once done is set): empty on failure
+    bool verified;        // Result of checking
+} password_job;
+
+
+/// Start the hashing threads
+extern bool passwords_start();
+
+/// Stop the hashing threads. Queued jobs are never completed
+extern void passwords_stop();
+
+/// Queue the job. Returns false if the queue is full (or hashing is not running): try again later then
+extern bool password_submit(const std::shared_ptr<password_job>& job);
+
+/// Check password against stored hash through the pool, waiting for the answer.
+/// Passwords stored before hashing was introduced are compared as they are
+extern bool password_verify(const std::string& stored, const std::string& password);
+
+/// Append hashing counters to metrics
+extern void passwords_metrics(std::string& out);
+
+#endif //WEBSERVER_PASSWORDS_H
@@ -0,0 +1,163 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "ratelimit.h"
+
+#include "constants.h"
+#include "server.h"
+#include "tools.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <pthread.h>
+
+
+#define RATELIMIT_WAYS 4 // Buckets a client may take in the table: one of them gets evicted when all are used
+#define RATELIMIT_SETS (RATELIMIT_TABLE_SIZE / RATELIMIT_WAYS)
+
+static_assert((RATELIMIT_SETS & (RATELIMIT_SETS - 1)) == 0, "RATELIMIT_TABLE_SIZE must be a power of 2");
+
+typedef struct
+{
+    uint64_t key;     // Client and route class. 0 - free
+    uint64_t updated; // When tokens were counted last (ms)
+    double tokens;
+    bool referenced;  // Used since the clock hand passed by
+} rate_bucket;
+
+static rate_bucket rate_table[RATELIMIT_SETS][RATELIMIT_WAYS];
+static unsigned char rate_hands[RATELIMIT_SETS]; // Clock hand of every set
+static rate_bucket rate_global[RATE_CLASS_COUNT];
+// Every http worker admits its own requests
+static pthread_mutex_t rate_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* const rate_class_names[RATE_CLASS_COUNT] = {"register", "verify"};
+
+// Statistics
+static std::atomic<unsigned long long> rate_admitted[RATE_CLASS_COUNT], rate_too_many[RATE_CLASS_COUNT],
+    rate_overloaded[RATE_CLASS_COUNT], rate_evictions{0};
+
+
+static uint64_t rate_now()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+}
+
+/// Client's key. IPv6 clients usually own a whole /64, so that's what counts
+static uint64_t rate_key(const struct mg_addr& client, rate_class cls)
+{
+    uint64_t key = 0;
+    memcpy(&key, client.ip, client.is_ip6 ? 8 : 4);
+    key ^= (static_cast<uint64_t>(cls) + 1) << 56 ^ (client.is_ip6 ? 1ULL << 55 : 0);
+
+    // splitmix64 finalizer: spreads neighbouring addresses over the sets
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key != 0 ? key : 1;
+}
+
+/// Find client's bucket or take one for it, forgetting a client that hasn't shown up lately. Caller holds rate_mutex
+static rate_bucket& rate_bucket_locked(uint64_t key, double burst, uint64_t now)
+{
+    rate_bucket* set = rate_table[key & (RATELIMIT_SETS - 1)];
+    rate_bucket* free = nullptr;
+    for (int i = 0; i < RATELIMIT_WAYS; ++i)
+    {
+        if (set[i].key == key)
+        {
+            set[i].referenced = true;
+            return set[i];
+        }
+        if (set[i].key == 0 && free == nullptr) free = &set[i];
+    }
+
+    double tokens = burst;
+    if (free == nullptr)
+    {
+        unsigned char& hand = rate_hands[key & (RATELIMIT_SETS - 1)];
+        while (set[hand].referenced)
+        {
+            set[hand].referenced = false;
+            hand = (hand + 1) % RATELIMIT_WAYS;
+        }
+        free = &set[hand];
+        hand = (hand + 1) % RATELIMIT_WAYS;
+        ++rate_evictions;
+        // The table is under pressure: whoever comes in now (a returning client too) gets a single request
+        // and earns the rest. Otherwise cycling through addresses would flush buckets and win a burst each time
+        tokens = 1;
+    }
+
+    // A new client starts with a full bucket
+    *free = rate_bucket{.key = key, .updated = now, .tokens = tokens, .referenced = true};
+    return *free;
+}
+
+/// Add tokens earned since the last time, then try to take one. Returns ms to wait for a token, 0 - taken
+static uint64_t rate_take(rate_bucket& bucket, double per_minute, double burst, uint64_t now)
+{
+    bucket.tokens = std::min(burst, bucket.tokens + static_cast<double>(now - bucket.updated) * per_minute / 60000);
+    bucket.updated = now;
+    if (bucket.tokens >= 1)
+    {
+        bucket.tokens -= 1;
+        return 0;
+    }
+    return std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil((1 - bucket.tokens) * 60000 / per_minute)));
+}
+
+
+rate_verdict rate_admit(const struct mg_addr& client, rate_class cls, unsigned* retry_after)
+{
+    const rate_limit& limit = rate_limits[cls];
+    uint64_t now = rate_now();
+    uint64_t wait;
+
+    mutex_locker l(&rate_mutex);
+
+    rate_bucket* bucket = nullptr;
+    if (limit.per_minute > 0)
+    {
+        double burst = std::max(1.0, limit.burst);
+        bucket = &rate_bucket_locked(rate_key(client, cls), burst, now);
+        if ((wait = rate_take(*bucket, limit.per_minute, burst, now)) != 0)
+        {
+            ++rate_too_many[cls];
+            if (retry_after) *retry_after = static_cast<unsigned>((wait + 999) / 1000);
+            return RATE_TOO_MANY;
+        }
+    }
+
+    if (limit.global_per_minute > 0)
+    {
+        rate_bucket& global = rate_global[cls];
+        double burst = std::max(1.0, limit.global_per_minute / 60);
+        if (global.key == 0) global = rate_bucket{.key = 1, .updated = now, .tokens = burst, .referenced = true};
+        if ((wait = rate_take(global, limit.global_per_minute, burst, now)) != 0)
+        {
+            if (bucket) bucket->tokens += 1; // Not this client's fault: give its token back
+            ++rate_overloaded[cls];
+            if (retry_after) *retry_after = static_cast<unsigned>((wait + 999) / 1000);
+            return RATE_OVERLOADED;
+        }
+    }
+
+    ++rate_admitted[cls];
+    return RATE_ADMITTED;
+}
+
+void ratelimit_metrics(std::string& out)
+{
+    for (int cls = 0; cls < RATE_CLASS_COUNT; ++cls)
+    {
+        std::string prefix = std::string("rate_") + rate_class_names[cls];
+        append_metric(out, (prefix + "_admitted").c_str(), rate_admitted[cls]);
+        append_metric(out, (prefix + "_shed_429").c_str(), rate_too_many[cls]);
+        append_metric(out, (prefix + "_shed_503").c_str(), rate_overloaded[cls]);
+    }
+    append_metric(out, "rate_evictions", rate_evictions);
+}
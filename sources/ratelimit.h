@@ -0,0 +1,46 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Admission control for routes that cost the server real work (registration, verification).
+/// Every client address gets a token bucket per route class in a fixed-size table: when the
+/// table is full, the least recently used client of the set is forgotten (clock sweep), and
+/// the one taking its place starts with a single request instead of a burst.
+/// On top of that a bucket per route class limits everybody together
+
+#ifndef WEBSERVER_RATELIMIT_H
+#define WEBSERVER_RATELIMIT_H
+
+#include <string>
+
+
+struct mg_addr;
+
+typedef enum
+{
+    RATE_REGISTER,
+    RATE_VERIFY,
+    RATE_CLASS_COUNT
+} rate_class;
+
+typedef struct
+{
+    double per_minute;        // Requests a client may make (tokens added back per minute). 0 - no limit
+    double burst;             // Requests a client may make at once
+    double global_per_minute; // Requests all clients together may make, burst is a second's worth. 0 - no limit
+} rate_limit;
+
+typedef enum
+{
+    RATE_ADMITTED,
+    RATE_TOO_MANY,  // This client has to slow down: 429
+    RATE_OVERLOADED // Everybody has to: 503
+} rate_verdict;
+
+
+/// Take a token for the client from the class's buckets. retry_after (s) tells when it makes sense to try again
+extern rate_verdict rate_admit(const struct mg_addr& client, rate_class cls, unsigned* retry_after);
+
+/// Append rate limiting counters to metrics
+extern void ratelimit_metrics(std::string& out);
+
+#endif //WEBSERVER_RATELIMIT_H
@@ -0,0 +1,52 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "response.h"
+
+#include "constants.h"
+#include "tools.h"
+#include "../mongoose/mongoose.h"
+#include "../resources.hpp"
+
+#include <map>
+
+
+void http_render_response(std::string& out, int status, const char* headers, const std::string& body)
+{
+    out = string_format(
+        "HTTP/1.1 %d %s\r\n%sContent-Length: %zu\r\n\r\n",
+        status, mg_http_status_code_str(status), headers, body.size()
+    );
+    out += body;
+}
+
+
+void http_send_rendered(struct mg_connection* connection, const std::string& response)
+{
+    mg_send(connection, response.data(), response.size());
+    connection->is_resp = 0; // Complete response is in the send buffer
+}
+
+
+const std::string& error_page(int code, const char* color, const char* msg)
+{
+    // Color follows from the code, so (code, message) identifies the page. Messages are literals:
+    // their address is enough, no key has to be built. The same text at another address just takes one more entry
+    static thread_local std::map<std::pair<int, const char*>, std::string> pages;
+    static thread_local std::string uncached;
+    std::pair<int, const char*> key(code, msg);
+    if (auto page = pages.find(key); page != pages.end()) return page->second;
+
+    std::string response;
+    http_render_response(
+        response, code, "Content-Type: text/html\r\n",
+        string_format(
+            RESOURCE(error_html),
+            color, color, color, color, code, mg_http_status_code_str(code), msg
+        )
+    );
+
+    if (pages.size() >= ERROR_PAGE_CACHE_SIZE) // Messages are fixed strings, but keep the table bounded anyway
+        return uncached = std::move(response);
+    return pages.emplace(key, std::move(response)).first->second;
+}
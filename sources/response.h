@@ -0,0 +1,33 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Responses rendered ahead of time: complete HTTP responses sent with a single buffer append,
+/// and the error pages kept that way
+
+#ifndef WEBSERVER_RESPONSE_H
+#define WEBSERVER_RESPONSE_H
+
+#include <string>
+
+
+struct mg_connection;
+
+/// Complete HTTP response rendered ahead of time.
+/// Owners keep one per worker (thread_local) and re-render it when version falls behind the source
+typedef struct
+{
+    unsigned long long version;
+    std::string response;
+} rendered_response;
+
+/// Render status line, headers, Content-Length and body into out, the same way mg_http_reply() does
+extern void http_render_response(std::string& out, int status, const char* headers, const std::string& body);
+
+/// Send a response produced by http_render_response() with a single buffer append
+extern void http_send_rendered(struct mg_connection* connection, const std::string& response);
+
+/// Error page for code, in color, saying msg, rendered once per worker. msg must be a fixed string:
+/// the page is cached by its address
+extern const std::string& error_page(int code, const char* color, const char* msg);
+
+#endif //WEBSERVER_RESPONSE_H
@@ -0,0 +1,161 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "router.h"
+
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+
+/// Handler for a set of methods
+typedef struct
+{
+    unsigned methods;
+    path_handler_function fn;
+} route_endpoint;
+
+/// Hash that lets the map be searched with string views of the request buffer
+struct route_segment_hash
+{
+    using is_transparent = void;
+
+    size_t operator()(std::string_view segment) const { return std::hash<std::string_view>{ }(segment); }
+};
+
+/// A segment of the uri
+struct route_node
+{
+    std::unordered_map<std::string, route_node*, route_segment_hash, std::equal_to<>> literals;
+    route_node* wildcard = nullptr;      // '*'
+    std::vector<route_endpoint> rest;    // '#' - the rest of the uri
+    std::vector<route_endpoint> here;    // The uri ends on this segment
+};
+
+/// A route with globs inside segments: can't go to the tree
+typedef struct
+{
+    std::string pattern;
+    route_endpoint endpoint;
+} route_glob;
+
+static route_node router_root;
+static std::vector<route_glob> router_globs;
+
+
+/// Get next segment of path (after '/' at pos) and move pos to the following '/' or to the end
+static std::string_view next_segment(std::string_view path, size_t& pos)
+{
+    size_t start = pos + 1, end = path.find('/', start);
+    if (end == std::string_view::npos) end = path.size();
+    pos = end;
+    return path.substr(start, end - start);
+}
+
+static bool has_globs(std::string_view segment)
+{
+    return segment.find_first_of("*#?") != std::string_view::npos;
+}
+
+static unsigned method_mask(struct mg_str method)
+{
+    std::string_view m(method.buf, method.len);
+    if (m == "GET") return ROUTE_GET;
+    if (m == "HEAD") return ROUTE_HEAD;
+    if (m == "POST") return ROUTE_POST;
+    if (m == "PUT") return ROUTE_PUT;
+    if (m == "DELETE") return ROUTE_DELETE;
+    if (m == "PATCH") return ROUTE_PATCH;
+    if (m == "OPTIONS") return ROUTE_OPTIONS;
+    return ROUTE_OTHER;
+}
+
+/// Pick the endpoint for the method. Sets allowed if some endpoint exists, but for other methods
+static path_handler_function find_endpoint(const std::vector<route_endpoint>& endpoints, unsigned method, bool& allowed)
+{
+    for (const auto& e : endpoints)
+    {
+        if (e.methods == ROUTE_ANY || (e.methods & method)) return e.fn;
+        allowed = false;
+    }
+    return nullptr;
+}
+
+/// Walk the tree from node with the rest of path after pos
+static path_handler_function find_in_tree(
+        const route_node* node, std::string_view path, size_t pos, unsigned method, bool& allowed
+    )
+{
+    if (pos >= path.size()) return find_endpoint(node->here, method, allowed);
+
+    size_t next = pos;
+    std::string_view segment = next_segment(path, next);
+
+    if (auto it = node->literals.find(segment); it != node->literals.end())
+        if (auto fn = find_in_tree(it->second, path, next, method, allowed)) return fn;
+
+    if (node->wildcard)
+        if (auto fn = find_in_tree(node->wildcard, path, next, method, allowed)) return fn;
+
+    return find_endpoint(node->rest, method, allowed);
+}
+
+
+void router_add(const std::string& pattern, unsigned methods, path_handler_function fn)
+{
+    std::string_view p(pattern);
+    route_endpoint endpoint{.methods = methods, .fn = fn};
+
+    bool tree = p.starts_with('/');
+    for (size_t pos = 0; tree && pos < p.size();)
+    {
+        std::string_view segment = next_segment(p, pos);
+        if (segment == "#") tree = pos == p.size(); // Only the last one
+        else if (segment != "*") tree = !has_globs(segment);
+    }
+
+    if (!tree)
+    {
+        router_globs.push_back({.pattern = pattern, .endpoint = endpoint});
+        return;
+    }
+
+    route_node* node = &router_root;
+    for (size_t pos = 0; pos < p.size();)
+    {
+        std::string_view segment = next_segment(p, pos);
+        if (segment == "#")
+        {
+            node->rest.push_back(endpoint);
+            return;
+        }
+
+        route_node*& child = segment == "*" ? node->wildcard : node->literals[std::string(segment)];
+        if (!child) child = new route_node;
+        node = child;
+    }
+    node->here.push_back(endpoint);
+}
+
+route_result router_find(struct mg_str uri, struct mg_str method, path_handler_function* fn)
+{
+    unsigned mask = method_mask(method);
+    bool allowed = true;
+
+    std::string_view path(uri.buf, uri.len);
+    if (path.starts_with('/') && (*fn = find_in_tree(&router_root, path, 0, mask, allowed)))
+        return ROUTE_FOUND;
+
+    for (const auto& glob : router_globs)
+        if (mg_match(uri, mg_str_n(glob.pattern.data(), glob.pattern.size()), nullptr))
+        {
+            if (glob.endpoint.methods == ROUTE_ANY || (glob.endpoint.methods & mask))
+            {
+                *fn = glob.endpoint.fn;
+                return ROUTE_FOUND;
+            }
+            allowed = false;
+        }
+
+    return allowed ? ROUTE_NOT_FOUND : ROUTE_METHOD_NOT_ALLOWED;
+}
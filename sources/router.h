@@ -0,0 +1,46 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Request router: a tree of uri segments built once before the server starts.
+/// Lookup cost depends on the length of the uri, not on the number of routes
+
+#ifndef WEBSERVER_ROUTER_H
+#define WEBSERVER_ROUTER_H
+
+#include <string>
+#include "../mongoose/mongoose.h"
+
+
+typedef void (*path_handler_function)(struct mg_connection* connection, struct mg_http_message* msg);
+
+/// Request methods a route answers to (bit mask)
+enum
+{
+    ROUTE_ANY = 0,
+    ROUTE_GET = 1 << 0,
+    ROUTE_HEAD = 1 << 1,
+    ROUTE_POST = 1 << 2,
+    ROUTE_PUT = 1 << 3,
+    ROUTE_DELETE = 1 << 4,
+    ROUTE_PATCH = 1 << 5,
+    ROUTE_OPTIONS = 1 << 6,
+    ROUTE_OTHER = 1 << 7
+};
+
+typedef enum
+{
+    ROUTE_FOUND,
+    ROUTE_NOT_FOUND,
+    ROUTE_METHOD_NOT_ALLOWED
+} route_result;
+
+/// Add a route. pattern is a mg_match() glob where every segment is either a literal,
+/// '*' (any single segment) or a final '#' (the rest of the uri).
+/// Other globs (like "/files/*.txt") are supported too, but they are matched one by one.
+/// The first route added for a pattern and method wins. Not thread safe: call before serving
+extern void router_add(const std::string& pattern, unsigned methods, path_handler_function fn);
+
+/// Find a handler for the request: literal segments win over '*', '*' wins over '#'
+extern route_result router_find(struct mg_str uri, struct mg_str method, path_handler_function* fn);
+
+#endif //WEBSERVER_ROUTER_H
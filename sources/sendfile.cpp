@@ -0,0 +1,47 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "sendfile.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+
+ssize_t sendfile_socket(void* socket, int fd, off_t offset, size_t size)
+{
+    ssize_t sent = sendfile(static_cast<int>(reinterpret_cast<intptr_t>(socket)), fd, &offset, size);
+    if (sent < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    return sent == 0 ? -1 : sent; // Nothing to send: the file got shorter
+}
+
+sendfile_state sendfile_step(
+        file_range& range, sendfile_fn send, void* socket, size_t chunk, char* buf, size_t* len, size_t size
+    )
+{
+    if (send != nullptr)
+    {
+        if (*len > 0) return SENDFILE_MORE; // Waiting for the socket to take the buffer
+
+        ssize_t sent = send(socket, range.fd, range.offset, std::min(chunk, range.left));
+        if (sent < 0) return SENDFILE_FAILED;
+        range.offset += sent;
+        range.left -= static_cast<size_t>(sent);
+    }
+
+    // Keep the loop waiting for the socket, or copy the whole thing without send
+    size_t room = std::min(range.left, size - std::min(size, *len));
+    if (room > 0)
+    {
+        ssize_t n;
+        do n = pread(range.fd, buf + *len, room, range.offset);
+        while (n < 0 && errno == EINTR);
+        if (n <= 0) return SENDFILE_FAILED;
+        *len += static_cast<size_t>(n);
+        range.offset += n;
+        range.left -= static_cast<size_t>(n);
+    }
+    return range.left == 0 ? SENDFILE_DONE : SENDFILE_MORE;
+}
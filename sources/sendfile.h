@@ -0,0 +1,43 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Response bodies sent straight from files. The event loop waits for a socket to become writable
+/// only while its connection has something buffered, and a full socket leaves the buffer empty
+/// after sendfile(). So whenever the file isn't done, the bytes that follow are read into the
+/// connection's buffer: once the socket takes them, the loop comes back and sendfile() goes on
+
+#ifndef WEBSERVER_SENDFILE_H
+#define WEBSERVER_SENDFILE_H
+
+#include <cstddef>
+#include <sys/types.h>
+
+
+typedef struct
+{
+    int fd;       // File
+    off_t offset; // Next byte to send
+    size_t left;  // Bytes to send
+} file_range;
+
+typedef enum
+{
+    SENDFILE_MORE,  // Call again on the next write (or poll) event
+    SENDFILE_DONE,  // Everything is sent or buffered
+    SENDFILE_FAILED // The file got truncated or the peer is gone: the connection has to be closed
+} sendfile_state;
+
+/// Send size bytes of fd at offset to socket without copying. Returns bytes taken, 0 if the socket is full, -1 on error
+typedef ssize_t (*sendfile_fn)(void* socket, int fd, off_t offset, size_t size);
+
+/// sendfile_fn for a plain socket: socket is its descriptor
+extern ssize_t sendfile_socket(void* socket, int fd, off_t offset, size_t size);
+
+/// Move the next piece of range towards the peer: up to chunk bytes with send (once the buffer is empty,
+/// so that its contents go first), then what follows into the buffer (len of size bytes are used).
+/// Without send everything goes through the buffer
+extern sendfile_state sendfile_step(
+        file_range& range, sendfile_fn send, void* socket, size_t chunk, char* buf, size_t* len, size_t size
+    );
+
+#endif //WEBSERVER_SENDFILE_H
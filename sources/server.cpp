@@ -10,7 +10,18 @@
 #include "../strscan/strscan.c"
 #include "../resources.hpp"
 #include "tools.h"
+#include "tls.h"
+#include "mail.h"
+#include "dirlist.h"
+#include "compress.h"
+#include "filecache.h"
+#include "fsrequest.h"
+#include "uring.h"
 #include "users.h"
+#include "validate.h"
+#include "journal.h"
+#include "passwords.h"
+#include "sendfile.h"
 
 
 #ifdef ENABLE_FILESYSTEM_ACCESS
@@ -18,9 +29,15 @@
 #endif
 
 
+#include <atomic>
+#include <charconv>
+#include <fcntl.h>
 #include <ftw.h>
-#include <regex>
+#include <unordered_map>
 #include <curl/curl.h>
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
 
 
 //// Default Values for CLI Parameters ////
@@ -31,24 +48,45 @@ const char* server_verification_email = nullptr;
 const char* server_verification_email_password = nullptr;
 const char* server_verification_smtp_server = "smtps://smtp.gmail.com:465";
 int log_level = 2, hexdump = 0;
+int workers_count = 1, pin_workers = 0;
+long tls_ticket_rotation_interval = DEFAULT_TLS_TICKET_ROTATION_INTERVAL;
+int tls_ktls = 1;
+unsigned long long dir_cache_size = DEFAULT_DIR_CACHE_SIZE;
+const char* compress_cache_dir = DEFAULT_COMPRESS_CACHE_DIR;
+unsigned long long file_cache_size = DEFAULT_FILE_CACHE_SIZE;
+const char* fs_backend = DEFAULT_FS_BACKEND;
+unsigned long long scrypt_n = DEFAULT_SCRYPT_N;
+unsigned long scrypt_r = DEFAULT_SCRYPT_R, scrypt_p = DEFAULT_SCRYPT_P;
+int hash_threads = DEFAULT_HASH_THREADS;
+long pending_ttl = DEFAULT_PENDING_TTL;
+rate_limit rate_limits[RATE_CLASS_COUNT] = {DEFAULT_RATE_REGISTER, DEFAULT_RATE_VERIFY};
 //// ////
 
 #ifdef ENABLE_FILESYSTEM_ACCESS
 pthread_mutex_t ftp_callback_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
-// Server Connection Manager
-static struct mg_mgr manager{ };
-// The connection itself
-static struct mg_connection *http_server_connection = nullptr, *https_server_connection = nullptr;
+/// One http(s) event loop with its own connection manager and listeners
+typedef struct
+{
+    int index;
+    pthread_t thread;
+    // Server Connection Manager
+    struct mg_mgr manager;
+    // The listening connections
+    struct mg_connection *http_server_connection, *https_server_connection;
+} server_worker;
+
+// All event loops. Worker 0 runs on the main thread
+static server_worker* workers = nullptr;
 
 #ifdef ENABLE_FILESYSTEM_ACCESS
 // FTP Server Instance
 static fineftp::FtpServer ftp_server;
 #endif
 
-// Handle interrupts, like Ctrl-C
-static int s_signo = 0;
+// Handle interrupts, like Ctrl-C (observed by every worker)
+static volatile sig_atomic_t s_signo = 0;
 
 /// Print detailed info about the signals and handle them as usual
 static void signal_handle_print_details(int signo)
@@ -68,6 +106,9 @@ typedef struct registered_path_handlers
 
 static registered_path_handlers* handlers_start = nullptr;
 static registered_path_handlers* handlers_head = nullptr;
+// Set once workers start: from then on the list is read concurrently and must not change
+static bool handlers_sealed = false;
+static std::atomic<unsigned long long> handlers_version = 1; // Bumped on every registration
 
 
 /// Create /etc/webserver directory if does not exist
@@ -76,11 +117,11 @@ inline void init_config_dir();
 
 /// Send icon resource string as regular file over http
 inline void http_send_resource(
-        struct mg_connection* connection, struct mg_http_message* msg, const char* rcdata, size_t rcsize,
+        struct mg_connection* connection, struct mg_http_message* msg, const embedded_resource& rc,
         const char* mime_type
     );
 
-/// Send error page over http
+/// Send error page over http. msg must be a fixed string: the rendered page is cached by its address
 inline void send_error_html(struct mg_connection* connection, int code, const char* color, const char* msg);
 
 
@@ -95,6 +136,9 @@ inline void handle_favicon_ico(struct mg_connection* connection, struct mg_http_
 /// Handle filesystem access (mongoose default serve directory)
 inline void handle_dir_html(struct mg_connection* connection, struct mg_http_message* msg);
 
+/// Handle JSON directory listing requests
+inline void handle_api_dir(struct mg_connection* connection, struct mg_http_message* msg);
+
 #endif
 
 /// Handle user registration form GET access
@@ -104,15 +148,27 @@ inline void handle_register_form_html(struct mg_connection* connection, struct m
 inline void handle_register_html(struct mg_connection* connection, struct mg_http_message* msg);
 
 /// Handle user email verification request
-inline void handle_verify_html(struct mg_connection* connection, const struct mg_http_message* msg);
+inline void handle_verify_html(struct mg_connection* connection, struct mg_http_message* msg);
 
 /// Handle other resources request
 inline void handle_resources_html(struct mg_connection* connection, struct mg_http_message* msg);
 
+/// Handle server statistics request
+inline void handle_metrics(struct mg_connection* connection, struct mg_http_message* msg);
+
 /// Add path handler to global linked list
-void register_path_handler(const std::string& path, const std::string& description, path_handler_function fn)
+void register_path_handler(
+        const std::string& path, const std::string& description, path_handler_function fn, unsigned methods
+    )
 {
+    if (handlers_sealed)
+    {
+        MG_ERROR(("Can't register '%s' => '%s' path: the server is already running", description.c_str(), path.c_str()));
+        return;
+    }
+
     MG_DEBUG(("Registering '%s' => '%s' path...", description.c_str(), path.c_str()));
+    ++handlers_version; // Index page lists handlers
     if (!handlers_head)
     {
         // If no entries - create one
@@ -120,7 +176,8 @@ void register_path_handler(const std::string& path, const std::string& descripti
             .data = new registered_path_handler{
                 .path_regex = path,
                 .description = description,
-                .fn = fn
+                .fn = fn,
+                .methods = methods
             },
             .next = nullptr
         };
@@ -133,7 +190,8 @@ void register_path_handler(const std::string& path, const std::string& descripti
             .data = new registered_path_handler{
                 .path_regex = path,
                 .description = description,
-                .fn = fn
+                .fn = fn,
+                .methods = methods
             },
             .next = nullptr
         };
@@ -142,81 +200,91 @@ void register_path_handler(const std::string& path, const std::string& descripti
     }
 }
 
-/// Iterate through registered handlers_start and try handle them
-inline void handle_registered_paths(struct mg_connection* connection, struct mg_http_message* msg)
+/// Fill the router: built-in paths first, then the ones registered in [settings.cpp]
+static void build_routes()
 {
-    MG_DEBUG(("Handling non-builtin registered paths..."));
-    registered_path_handlers* root = handlers_start;
+    router_add("/", ROUTE_ANY, handle_index_html);           // Serve index.html resource on '/', '/index.html'
+    router_add("/index.html", ROUTE_ANY, handle_index_html);
+    router_add("/favicon.ico", ROUTE_ANY, handle_favicon_ico); // Serve favicon.ico resource on '/favicon.ico'
+#ifdef ENABLE_FILESYSTEM_ACCESS // If FS access is enabled...
+    router_add("/dir/#", ROUTE_ANY, handle_dir_html); // Let the user browse directories on '/dir/...'
+    router_add("/api/dir/#", ROUTE_GET | ROUTE_HEAD, handle_api_dir); // Same directories for scripts, as JSON
+#endif
+    router_add("/register-form", ROUTE_ANY, handle_register_form_html); // Serve register.html on '/register-form'
+    router_add("/register", ROUTE_POST, handle_register_html);        // Receive data from registration form
+    router_add("/verify/*", ROUTE_GET, handle_verify_html);           // Verify email address and serve verify.html
+    router_add("/resources/#", ROUTE_ANY, handle_resources_html);     // Serve built-in resource files
+    router_add("/metrics", ROUTE_ANY, handle_metrics);                // Plain text counters
 
-    while (root && root->data)
+    // Handle other paths registered in [settings.cpp]
+    for (auto* i = handlers_start; i != nullptr && i->data != nullptr; i = i->next)
+        router_add(i->data->path_regex, i->data->methods, i->data->fn);
+}
+
+// Serve appropriate resources and perform actions upon client's request
+inline void handle_http_message(struct mg_connection* connection, struct mg_http_message* msg)
+{
+    path_handler_function fn = nullptr;
+    switch (router_find(msg->uri, msg->method, &fn))
     {
-        if (mg_match(msg->uri, mg_str(root->data->path_regex.c_str()), nullptr)) break; // This is the one
-        root = root->next;
+        case ROUTE_FOUND: return fn(connection, msg);
+        case ROUTE_METHOD_NOT_ALLOWED:
+            MG_DEBUG(("Method [%.*s] is not allowed for [%.*s]", _PRINT(msg->method), _PRINT(msg->uri)));
+            return send_error_html(connection, COLORED_ERROR(405), "");
+        default: return send_error_html(connection, COLORED_ERROR(404), "");
     }
+}
 
-    if (root && root->data) // If found one
+
+/// Swap the SSL object mongoose created on a blank per-connection context
+/// for one created from the shared context with the keypair already parsed
+static void tls_use_shared_context(struct mg_connection* connection)
+{
+    auto* tls = static_cast<struct mg_tls*>(connection->tls);
+    if (tls == nullptr) return; // mg_tls_init() has failed and reported it already
+
+    SSL_CTX* ctx = tls_context_acquire();
+    SSL* ssl = ctx ? SSL_new(ctx) : nullptr;
+    if (ssl == nullptr)
     {
-        MG_DEBUG(("Handling '%s' => '%s' path for IP %M...", root->data->description.c_str(), root->data->path_regex.c_str(),
-            mg_print_ip, &connection->rem));
-        return root->data->fn(connection, msg); // Run the handler and quit after
+        if (ctx) SSL_CTX_free(ctx);
+        mg_error(connection, "TLS context is not available");
+        return;
     }
 
-    send_error_html(connection, COLORED_ERROR(404), "");
-}
+    // Keep mongoose's transport, it feeds OpenSSL from the connection buffers
+    int fd = static_cast<int>(reinterpret_cast<size_t>(connection->fd));
+    BIO* rbio = SSL_get_rbio(tls->ssl);
+    BIO* wbio = SSL_get_wbio(tls->ssl);
+    if (rbio != nullptr && wbio != nullptr)
+    {
+        BIO_up_ref(rbio);
+        BIO* ktls = tls_ktls_filter_new(wbio, fd); // Holds its own reference of wbio
+        if (ktls == nullptr && wbio != rbio) BIO_up_ref(wbio);
+        SSL_set_bio(ssl, rbio, ktls ? ktls : wbio);
+    }
+    else SSL_set_fd(ssl, fd);
+    SSL_set_mode(ssl, SSL_get_mode(tls->ssl));
 
-// Serve appropriate resources and perform actions upon client's request
-inline void handle_http_message(struct mg_connection* connection, struct mg_http_message* msg)
-{
-    // Serve index.html resource on '/', '/index.html'
-    if (mg_match(msg->uri, _MATCH_CSTR("/")) ||
-        mg_match(msg->uri, _MATCH_CSTR("/index.html")))
-        handle_index_html(connection, msg);
-    else if (mg_match(msg->uri, _MATCH_CSTR("/favicon.ico"))) // Serve favicon.ico resource on '/favicon.ico'
-        handle_favicon_ico(connection, msg);
-#ifdef ENABLE_FILESYSTEM_ACCESS // If FS access is enabled...
-    else if (mg_match(msg->uri, _MATCH_CSTR("/dir/#"))) // Let the user browse directories on '/dir/...'
-        handle_dir_html(connection, msg);
-#endif
-    else if (mg_match(msg->uri, _MATCH_CSTR("/register-form"))) // Serve register.html on '/register-form'
-        handle_register_form_html(connection, msg);
-    else if (mg_match(msg->uri, _MATCH_CSTR("/register"))) // Receive data from registration form
-        handle_register_html(connection, msg);
-    else if (mg_match(msg->uri, _MATCH_CSTR("/verify/*"))) // Verify email address and serve verify.html
-        handle_verify_html(connection, msg);
-    else if (mg_match(msg->uri, _MATCH_CSTR("/resources/#"))) // Serve built-in resource files
-        handle_resources_html(connection, msg);
-    else handle_registered_paths(connection, msg); // Handle other paths registered in [config.cpp]
+    SSL_free(tls->ssl);
+    SSL_CTX_free(tls->ctx);
+    tls->ssl = ssl;
+    tls->ctx = ctx;
 }
 
-
 /// Handle mongoose events
 void client_handler(struct mg_connection* connection, int ev, void* ev_data)
 {
     if (connection->fn_data != nullptr && ev == MG_EV_ACCEPT) // When user starts a session
     {
-        std::string stls_path(tls_path);                 // TLS Certificate and Key folder
-        if (!stls_path.ends_with('/')) stls_path += '/'; // always '/' at the end
-
-        std::string cert_path(stls_path); // Public Certificate
-        cert_path += "cert.pem";
-
-        std::string key_path(stls_path); // Private Key
-        key_path += "key.pem";
-
-        MG_DEBUG(("Reading [%.*s]...", cert_path.size(), cert_path.c_str()));
-        std::string Cert_ = FILE_read_all(cert_path);
-        MG_DEBUG(("Read: { %.*s... }", 25, Cert_.c_str()));
-
-        MG_DEBUG(("Reading [%.*s]...", key_path.size(), key_path.c_str()));
-        std::string Key_ = FILE_read_all(key_path);
-        MG_DEBUG(("Read: { %.*s... }", 15, Key_.c_str()));
-
-        // Make a structure to pass to mongoose
-        struct mg_tls_opts opts = {
-            .cert = mg_str(Cert_.c_str()),
-            .key = mg_str(Key_.c_str()),
-        };
+        struct mg_tls_opts opts{ }; // No keypair here: it comes with the shared context
         mg_tls_init(connection, &opts); // Initialize TLS Connection
+        tls_use_shared_context(connection);
+    }
+    else if (ev == MG_EV_TLS_HS) // Handshake is done: was the session resumed?
+    {
+        auto* tls = static_cast<struct mg_tls*>(connection->tls);
+        if (tls) tls_count_handshake(tls->ssl);
     }
     else if (ev == MG_EV_HTTP_MSG) // When user requests pages and other data
     {
@@ -261,13 +329,27 @@ void server_initialize()
     // Initialize libcurl library
     curl_global_init(CURL_GLOBAL_ALL);
 
+    // Verification emails are sent in background
+    if (server_verification_email != nullptr &&
+        !mail_queue_start(server_verification_smtp_server, server_verification_email, server_verification_email_password))
+    {
+        puts("[Server] An error occurred during server initialization: Could not start mail queue.");
+        exit(-3);
+    }
+
+    // Passwords are hashed and checked in background
+    if (!passwords_start())
+    {
+        puts("[Server] An error occurred during server initialization: Could not start password hashing.");
+        exit(-3);
+    }
+
     // Handle SIGNALS properly
     signal(SIGINT, signal_handle_print_details);
     signal(SIGTERM, signal_handle_print_details);
     signal(SIGQUIT, signal_handle_print_details);
 
     mg_log_set(log_level); // Set log level for mongoose
-    mg_mgr_init(&manager); // Initialize mongoose
 
 #ifdef ENABLE_FILESYSTEM_ACCESS
     if (log_level >= MG_LL_INFO)
@@ -282,7 +364,8 @@ void server_initialize()
         ftp_injected<on_receive_fn>::$().add([](const std::string& raw_message)
         {
             mutex_locker l(&ftp_callback_mutex); // Async
-            MG_DEBUG((" [FTP] << %.*s", raw_message.size(), raw_message.c_str()));
+            if (strncasecmp(raw_message.c_str(), "PASS ", 5) == 0) MG_DEBUG((" [FTP] << PASS ********"));
+            else MG_DEBUG((" [FTP] << %.*s", raw_message.size(), raw_message.c_str()));
         });
     }
 #endif
@@ -290,6 +373,14 @@ void server_initialize()
 #ifdef ENABLE_FILESYSTEM_ACCESS
     register_additional_handlers(); // from config.cpp
 
+    // fineftp compares passwords as they are: exchange the one that was typed for the stored hash if they match
+    ftp_injected<on_login_fn>::$().add([](const std::string& login, std::string* password)
+    {
+        std::string stored = find_user_password(login);
+        if (stored.empty()) return; // Anonymous or nonexistent user
+        *password = password_verify(stored, *password) ? stored : std::string();
+    });
+
     // Anonymous user can view everyone's files, but not edit
     MG_DEBUG(("[FTP] Adding anonymous user to ftp server..."));
     ftp_server.addUserAnonymous(getcwd(), fineftp::Permission::ReadOnly);
@@ -303,12 +394,57 @@ void server_initialize()
 #endif
 }
 
-/// Start listening on given http_address and run server loop
-void server_run()
+/// Listen on url in the worker's manager. With several workers every one of them binds its own
+/// socket to the same address (SO_REUSEPORT), so the kernel spreads incoming connections between them
+static struct mg_connection* http_listen_shared(struct mg_mgr* mgr, const char* url, void* fn_data)
+{
+    if (workers_count <= 1) return mg_http_listen(mgr, url, client_handler, fn_data);
+
+    struct mg_addr addr{ };
+    if (!mg_aton(mg_url_host(url), &addr))
+    {
+        MG_ERROR(("Invalid listening address '%s'", url));
+        return nullptr;
+    }
+    addr.port = mg_htons(mg_url_port(url));
+
+    union usa usa{ };
+    socklen_t slen = tousa(&addr, &usa);
+    int on = 1, fd = ::socket(addr.is_ip6 ? AF_INET6 : AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd < 0 ||
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+        ::bind(fd, &usa.sa, slen) != 0 ||
+        ::listen(fd, SOMAXCONN) != 0)
+    {
+        MG_ERROR(("Failed to listen on '%s': %s", url, strerror(errno)));
+        if (fd >= 0) ::close(fd);
+        return nullptr;
+    }
+
+    // Let mongoose poll the socket and accept on it like on its own listeners
+    struct mg_connection* c = mg_wrapfd(mgr, fd, client_handler, fn_data);
+    if (c == nullptr)
+    {
+        ::close(fd);
+        return nullptr;
+    }
+    c->is_listening = 1;
+    c->loc = addr;
+    c->pfn = http_cb;
+    if (mg_url_is_ssl(url)) c->is_tls = 1;
+    return c;
+}
+
+/// Initialize worker's manager and open its listeners
+static void server_worker_listen(server_worker* worker)
 {
+    mg_mgr_init(&worker->manager); // Initialize mongoose
+    mg_wakeup_init(&worker->manager); // Background threads hand results back to connections through it
+
     if (http_address)
     {
-        if (!((http_server_connection = mg_http_listen(&manager, http_address, client_handler, nullptr))))
+        if (!((worker->http_server_connection = http_listen_shared(&worker->manager, http_address, nullptr))))
         {
             MG_ERROR(("Could not start listening on '%s'. Use 'http://ADDR:PORT' or just ':PORT' as http(s) address parameter", http_address));
             exit(EXIT_FAILURE);
@@ -317,38 +453,86 @@ void server_run()
 
     if (tls_path && https_address)
     {
-        if (!((https_server_connection = mg_http_listen(&manager, https_address, client_handler, reinterpret_cast<void*>(1)))))
+        if (!((worker->https_server_connection = http_listen_shared(&worker->manager, https_address, reinterpret_cast<void*>(1)))))
         {
             MG_ERROR(("Could not start listening on %s. Use 'https://ADDR:PORT' or just ':PORT' as https address parameter", https_address));
-            https_server_connection = nullptr;
+            worker->https_server_connection = nullptr;
         }
     }
 
     // Override HexDumping for http server
-    if (http_server_connection) http_server_connection->is_hexdumping = hexdump;
+    if (worker->http_server_connection) worker->http_server_connection->is_hexdumping = hexdump;
 
     // Override HexDumping for https server
-    if (https_server_connection) https_server_connection->is_hexdumping = hexdump;
+    if (worker->https_server_connection) worker->https_server_connection->is_hexdumping = hexdump;
+}
+
+/// Worker's event loop. Runs until a signal is caught
+static void* server_worker_loop(void* arg)
+{
+    auto* worker = static_cast<server_worker*>(arg);
+
+    if (pin_workers)
+    {
+        long cpus = ::sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->index % (cpus > 0 ? cpus : 1), &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            MG_ERROR(("[Worker %d] Could not pin to cpu", worker->index));
+    }
+
+    while (s_signo == 0) mg_mgr_poll(&worker->manager, 1000);
+
+    mg_mgr_free(&worker->manager);
+    return nullptr;
+}
+
+/// Start listening on given http_address and run server loop
+void server_run()
+{
+    if (workers_count <= 0) workers_count = static_cast<int>(::sysconf(_SC_NPROCESSORS_ONLN));
+    if (workers_count <= 0) workers_count = 1;
+
+    // No more handler changes from here on: workers read the list concurrently
+    handlers_sealed = true;
+    build_routes();
+
+    // Parse the keypair once, all https connections share it
+    if (tls_path && https_address && !tls_context_load(tls_path))
+    {
+        MG_ERROR(("Could not load TLS keypair from [%s]. HTTPS is disabled", tls_path));
+        https_address = nullptr;
+    }
+
+    workers = new server_worker[workers_count]{ };
+    for (int i = 0; i < workers_count; ++i)
+    {
+        workers[i].index = i;
+        server_worker_listen(&workers[i]);
+    }
 
     auto cwd = getcwd(); // Current Working Directory
 
 
-    if (http_server_connection) // HTTP
+    if (workers[0].http_server_connection) // HTTP
     {
         MG_INFO((""));
         MG_INFO(("Mongoose v" MG_VERSION));
         MG_INFO(("Server is listening on : [%s]", http_address));
         MG_INFO(("Web root directory  : [file://%s/]", cwd.c_str()));
+        MG_INFO(("Event loops         : [%d]", workers_count));
         MG_INFO((""));
     }
 
-    if (https_server_connection) // HTTPS
+    if (workers[0].https_server_connection) // HTTPS
     {
         MG_INFO((""));
         MG_INFO(("Mongoose v" MG_VERSION));
         MG_INFO(("Server is listening on : [%s]", https_address));
         MG_INFO(("Web root directory  : [file://%s/]", cwd.c_str()));
         MG_INFO(("Certificates directory  : [file://%s/]", tls_path));
+        MG_INFO(("Event loops         : [%d]", workers_count));
         MG_INFO((""));
     }
 
@@ -366,24 +550,57 @@ void server_run()
         MG_ERROR(("[FTP] Could not start ftp server on : [ftp://%s:%d]", ftp_server.getAddress().c_str(), ftp_server.getPort()));
         MG_ERROR(("[FTP]"));
     }
+
+    if (compress_start())
+        MG_INFO(("[Compress] Compressed files cache   : [file://%s]", compress_cache_dir));
+
+    if (strcmp(fs_backend, "uring") == 0 && uring_start())
+        MG_INFO(("[URING] Files under /dir/ are opened with io_uring"));
 #endif
 
-    while (s_signo == 0) mg_mgr_poll(&manager, 1000);
+    // Unverified registrations expire
+    if (server_verification_email != nullptr)
+        mg_timer_add(&workers[0].manager, PENDING_USERS_TICK, MG_TIMER_REPEAT,
+                     [](void*) { expire_pending_users(); }, nullptr);
+
+    // Pick up renewed certificates without a restart
+    if (workers[0].https_server_connection)
+        mg_timer_add(&workers[0].manager, TLS_RELOAD_CHECK_INTERVAL, MG_TIMER_REPEAT,
+                     [](void*) { tls_context_reload_if_changed(); }, nullptr);
+
+    // Worker 0 runs on this thread, the rest get their own
+    for (int i = 1; i < workers_count; ++i)
+        if (pthread_create(&workers[i].thread, nullptr, server_worker_loop, &workers[i]) != 0)
+        {
+            MG_ERROR(("[Worker %d] Could not start thread", i));
+            s_signo = SIGABRT;
+            workers_count = i;
+            break;
+        }
+
+    server_worker_loop(&workers[0]);
+
+    for (int i = 1; i < workers_count; ++i)
+        pthread_join(workers[i].thread, nullptr);
 
-    mg_mgr_free(&manager);
 #ifdef ENABLE_FILESYSTEM_ACCESS
     ftp_server.stop();
+    compress_stop();
+    uring_stop();
 #endif
+    mail_queue_stop();
+    passwords_stop();
+    close_users();
+    curl_global_cleanup();
     MG_INFO(("Exiting due to signal [%d]...", s_signo));
 
     exit(s_signo);
 }
 
 
-inline void handle_index_html(struct mg_connection* connection, struct mg_http_message* msg)
+/// Build index page listing every registered handler
+static void render_index_html(std::string& out)
 {
-    MG_DEBUG(("Serving index.html to %M...", mg_print_ip, &connection->rem));
-
     std::string list_html;
 #ifdef ENABLE_FILESYSTEM_ACCESS // if filesystem is enabled
     list_html += "<li><a href=\"/dir/\">Observe directory structure</a></li>\n"; // Add '/dir/' link
@@ -397,14 +614,27 @@ inline void handle_index_html(struct mg_connection* connection, struct mg_http_m
     }
 
     // Add it to the article
-    char article_complete[LEN(article_html) + list_html.size() + 1];
-    sprintf(article_complete, RESOURCE(article_html), list_html.c_str());
+    std::string article_complete = string_format(RESOURCE(article_html), list_html.c_str());
+    http_render_response(
+        out, 200, "Content-Type: text/html\r\n",
+        string_format(RESOURCE(index_html), article_complete.c_str())
+    );
+}
+
+
+inline void handle_index_html(struct mg_connection* connection, struct mg_http_message* msg)
+{
+    MG_DEBUG(("Serving index.html to %M...", mg_print_ip, &connection->rem));
+
+    static thread_local rendered_response page{ };
+    if (page.version != handlers_version) // Handlers changed since the last render
+    {
+        page.version = handlers_version;
+        render_index_html(page.response);
+    }
 
     // Send...
-    mg_http_reply(
-        connection, 200, "Content-Type: text/html\r\n",
-        RESOURCE(index_html), article_complete
-    );
+    http_send_rendered(connection, page.response);
 }
 
 
@@ -412,92 +642,429 @@ inline void handle_favicon_ico(struct mg_connection* connection, struct mg_http_
 {
     MG_DEBUG(("Serving favicon.ico to %M...", mg_print_ip, &connection->rem));
     // Send...
-    http_send_resource(connection, msg, RESOURCE(favicon_ico), LEN(favicon_ico), "image/x-icon");
+    http_send_resource(connection, msg, RESOURCE_VARIANTS(favicon_ico), "image/x-icon");
 }
 
 
 #ifdef ENABLE_FILESYSTEM_ACCESS
 
+/// Append the same table row as printdirentry() prints, but from cached metadata instead of stat()
+static void append_dir_entry(std::string& out, const dir_entry& e)
+{
+    char path[MG_PATH_MAX], sz[40], mod[40];
+    const char* slash = e.is_dir ? "/" : "";
+    if (e.is_dir) mg_snprintf(sz, sizeof(sz), "%s", "[DIR]");
+    else mg_snprintf(sz, sizeof(sz), "%llu", e.size);
+#if defined(MG_HTTP_DIRLIST_TIME_FMT)
+    struct tm time_info{ };
+    localtime_r(&e.mtime, &time_info); // Workers print concurrently
+    strftime(mod, sizeof(mod), "%Y/%m/%d %H:%M:%S", &time_info);
+#else
+    mg_snprintf(mod, sizeof(mod), "%lu", static_cast<unsigned long>(e.mtime));
+#endif
+    int n = static_cast<int>(mg_url_encode(e.name.c_str(), e.name.size(), path, sizeof(path)));
+    out += string_format(
+        "  <tr><td><a href=\"%.*s%s\">%s%s</a></td>"
+        "<td name=%lu>%s</td><td name=%lld>%s</td></tr>\n",
+        n, path, slash, e.name.c_str(), slash, static_cast<unsigned long>(e.mtime), mod,
+        e.is_dir ? -1LL : static_cast<long long>(e.size), sz
+    );
+}
+
+/// Listing being streamed to the client. Entries themselves are shared with the cache
+typedef struct
+{
+    std::shared_ptr<const dir_listing> listing;
+    const std::vector<uint32_t>* order;
+    bool descending;
+    size_t pos, end; // Rows of the current page left to send: [pos, end) in sort order
+    std::string footer;
+} dir_stream;
+
+// Views of the html listing (DIR_SORT_BYTES is only for the API)
+static const char* dir_sort_names[] = {"name", "mtime", "size"};
+
 static void list_dir(
         struct mg_connection* c, struct mg_http_message* hm, const struct mg_http_serve_opts* opts,
         char* dir
     )
 {
     ///
-    /// This is a copy of mongoose's built-in function <br>
-    /// mg_http_serve_dir() -> <b>listdir()</b> <br>
-    /// I don't guarantee the correctness of this function, because I just copied it :)
+    /// Based on mongoose's built-in function <br>
+    /// mg_http_serve_dir() -> <b>listdir()</b>, <br>
+    /// but sorted and paged here (?sort=name|mtime|size&order=asc|desc&page=N)
+    /// and streamed with chunked encoding, so memory doesn't grow with the directory
     ///
 
-    const char* sort_js_code =
-        "<script>function srt(tb, sc, so, d) {"
-        "var tr = Array.prototype.slice.call(tb.rows, 0),"
-        "tr = tr.sort(function (a, b) { var c1 = a.cells[sc], c2 = b.cells[sc],"
-        "n1 = c1.getAttribute('name'), n2 = c2.getAttribute('name'), "
-        "t1 = a.cells[2].getAttribute('name'), "
-        "t2 = b.cells[2].getAttribute('name'); "
-        "return so * (t1 < 0 && t2 >= 0 ? -1 : t2 < 0 && t1 >= 0 ? 1 : "
-        "n1 ? parseInt(n2) - parseInt(n1) : "
-        "c1.textContent.trim().localeCompare(c2.textContent.trim())); });";
-    const char* sort_js_code2 =
-        "for (var i = 0; i < tr.length; i++) tb.appendChild(tr[i]); "
-        "if (!d) window.location.hash = ('sc=' + sc + '&so=' + so); "
-        "};"
-        "window.onload = function() {"
-        "var tb = document.getElementById('tb');"
-        "var m = /sc=([012]).so=(1|-1)/.exec(window.location.hash) || [0, 2, 1];"
-        "var sc = m[1], so = m[2]; document.onclick = function(ev) { "
-        "var c = ev.target.rel; if (c) {if (c == sc) so *= -1; srt(tb, c, so); "
-        "sc = c; ev.preventDefault();}};"
-        "srt(tb, sc, so, true);"
-        "}"
-        "</script>";
-    struct mg_fs* fs = opts->fs == nullptr ? &mg_fs_posix : opts->fs;
-    struct printdirentrydata d = {c, hm, opts, dir};
-    char tmp[10], buf[MG_PATH_MAX];
-    size_t off, n;
+    auto listing = dirlist_get(dir);
+    if (listing == nullptr)
+    {
+        send_error_html(c, COLORED_ERROR(403), "Can't read this directory");
+        return;
+    }
+
+    char buf[MG_PATH_MAX];
     int len = mg_url_decode(_EXPAND(hm->uri), buf, sizeof(buf), 0);
     struct mg_str uri = len > 0 ? mg_str_n(buf, static_cast<size_t>(len)) : hm->uri;
 
+    // Parse the view
+    char var[16]{ };
+    dir_sort sort = DIR_SORT_NAME;
+    if (mg_http_get_var(&hm->query, "sort", var, sizeof(var)) > 0)
+        for (size_t i = 0; i < std::size(dir_sort_names); ++i)
+            if (strcmp(var, dir_sort_names[i]) == 0) sort = static_cast<dir_sort>(i);
+    bool descending = mg_http_get_var(&hm->query, "order", var, sizeof(var)) > 0 && strcmp(var, "desc") == 0;
+    size_t page = 1;
+    if (mg_http_get_var(&hm->query, "page", var, sizeof(var)) > 0) page = std::max(1UL, strtoul(var, nullptr, 10));
+
+    size_t count = listing->entries.size();
+    size_t pages = std::max<size_t>(1, (count + DIR_LISTING_PAGE_SIZE - 1) / DIR_LISTING_PAGE_SIZE);
+    page = std::min(page, pages);
+
+    // Column headers sort by their column, clicking the current one again flips the order
+    std::string columns;
+    static const char* column_titles[] = {"Name", "Modified", "Size"};
+    for (size_t i = 0; i < std::size(dir_sort_names); ++i)
+        columns += string_format(
+            "<th> <a href=\"?sort=%s&order=%s\">%s%s</a> </th>",
+            dir_sort_names[i], i == sort && !descending ? "desc" : "asc", column_titles[i],
+            i != sort ? "" : descending ? " &#9660;" : " &#9650;"
+        );
+
+    std::string pager;
+    if (pages > 1)
+    {
+        const char* order = descending ? "desc" : "asc";
+        pager = "<div class=\"pager\">";
+        if (page > 1)
+            pager += string_format(
+                "<a href=\"?sort=%s&order=%s&page=%zu\">&laquo; Previous</a> ", dir_sort_names[sort], order, page - 1
+            );
+        pager += string_format("Page %zu of %zu", page, pages);
+        if (page < pages)
+            pager += string_format(
+                " <a href=\"?sort=%s&order=%s&page=%zu\">Next &raquo;</a>", dir_sort_names[sort], order, page + 1
+            );
+        pager += "</div>";
+    }
+
     mg_printf(
         c,
         "HTTP/1.1 200 OK\r\n"
         "Content-Type: text/html; charset=utf-8\r\n"
         "%s"
-        "Content-Length:         \r\n\r\n",
+        "Transfer-Encoding: chunked\r\n\r\n",
         opts->extra_headers == nullptr ? "" : opts->extra_headers
     );
-    off = c->send.len; // Start of body
-    mg_printf(
+    if (mg_strcasecmp(hm->method, mg_str("HEAD")) == 0) // Headers only
+    {
+        c->is_resp = 0;
+        return;
+    }
+
+    mg_http_printf_chunk(
         c,
-        "<!DOCTYPE html><html><head><title>Index of %.*s</title>%s%s"
+        "<!DOCTYPE html><html><head><title>Index of %.*s</title>"
         "<link rel=\"stylesheet\" type=\"text/css\" href=\"/resources/bootstrap.css\"/>"
         "<style>body, html { margin: 0; padding: 0; }\n table { margin: 10px; }\n"
-        "h1 { margin: 10px; }\n th,td {text-align: left; padding-right: 1em;"
+        "h1 { margin: 10px; }\n .pager { margin: 10px; }\n th,td {text-align: left; padding-right: 1em;"
         "font-size: 1rem; } </style></head>"
         "<body> <div class=\"navbar\"> <a href=\"/\">Go back</a> </div>"
-        "<h1>Index of %.*s</h1> <table cellpadding=\"0\"> <thead>"
-        "<tr> <th> <a href=\"#\" rel=\"0\">Name</a> </th>"
-        "<th> <a href=\"#\" rel=\"1\">Modified</a> </th>"
-        "<th> <a href=\"#\" rel=\"2\">Size</a> </th> </tr>"
+        "<h1>Index of %.*s</h1> %s <table cellpadding=\"0\"> <thead>"
+        "<tr> %s </tr>"
         "<tr> <td colspan=\"3\"> <hr> </td> </tr>"
         "</thead>"
-        "<tbody id=\"tb\">\n",
-        _PRINT(uri), sort_js_code, sort_js_code2, _PRINT(uri)
+        "<tbody id=\"tb\">\n"
+        "  <tr><td><a href=\"..\">..</a></td>"
+        "<td name=-1></td><td name=-1>[DIR]</td></tr>\n",
+        _PRINT(uri), _PRINT(uri), pager.c_str(), columns.c_str()
     );
+    // The purpose of the copy-paste is to remove <address>Mongoose v....</address> from the end
+    std::string footer = "</tbody><tfoot><tr><td colspan=\"3\"><hr></td></tr></tfoot> </table>";
+    footer += pager;
+    footer += "</body></html>\n";
+
+    size_t begin = (page - 1) * DIR_LISTING_PAGE_SIZE;
+    const auto& order = dirlist_order(*listing, sort);
+    c->pfn_data = new dir_stream{
+        .listing = std::move(listing),
+        .order = &order,
+        .descending = descending,
+        .pos = begin,
+        .end = std::min(count, begin + DIR_LISTING_PAGE_SIZE),
+        .footer = std::move(footer)
+    };
+    c->pfn = [](struct mg_connection* c, int ev, void* ev_data)
+    {
+        auto* ds = static_cast<dir_stream*>(c->pfn_data);
+        bool done = ev == MG_EV_CLOSE;
+
+        // Render only as much as the send buffer budget allows, the rest waits for the socket
+        if ((ev == MG_EV_WRITE || ev == MG_EV_POLL) && c->send.len < DIR_LISTING_SEND_BUDGET)
+        {
+            std::string rows;
+            size_t count = ds->order->size();
+            while (ds->pos < ds->end && c->send.len + rows.size() < DIR_LISTING_SEND_BUDGET)
+            {
+                size_t i = ds->descending ? count - 1 - ds->pos : ds->pos;
+                append_dir_entry(rows, ds->listing->entries[(*ds->order)[i]]);
+                ++ds->pos;
+            }
+            if (!rows.empty()) mg_http_write_chunk(c, rows.data(), rows.size());
+
+            if (ds->pos == ds->end)
+            {
+                mg_http_write_chunk(c, ds->footer.data(), ds->footer.size());
+                mg_http_write_chunk(c, "", 0); // Last chunk
+                done = true;
+            }
+        }
+
+        if (done)
+        {
+            delete ds;
+            c->pfn_data = nullptr;
+            c->pfn = http_cb;
+            c->is_resp = 0;
+        }
+    };
+}
+
+static bool accepts_encoding(struct mg_http_message* msg, std::string_view coding);
+
+/// Check if files of this type are worth compressing
+static bool compressible(struct mg_str mime)
+{
+    for (const char* type : {"text/", "json", "javascript", "xml", "svg"})
+        if (mg_strstr(mime, mg_str(type)) != nullptr) return true;
+    return false;
+}
+
+/// sendfile_fn over kernel TLS: socket is the SSL
+static ssize_t sendfile_ssl(void* socket, int fd, off_t offset, size_t size)
+{
+    auto* ssl = static_cast<SSL*>(socket);
+    ossl_ssize_t sent = SSL_sendfile(ssl, fd, offset, size, 0);
+    bool again = sent <= 0 && SSL_get_error(ssl, static_cast<int>(sent)) == SSL_ERROR_WANT_WRITE;
+    ERR_clear_error();
+    return sent > 0 ? static_cast<ssize_t>(sent) : again ? 0 : -1;
+}
+
+/// Send already opened file at path without mongoose's read-into-buffer loop: headers go through the send buffer
+/// as usual, small files follow from memory, bigger ones are copied by the kernel straight from the page cache
+/// into the socket with sendfile(2) (encrypted on the way with SSL_sendfile() over kernel TLS).
+/// Over userspace TLS the body is read into the send buffer instead.
+/// Text files go compressed when the client accepts it and a cached variant is ready (see compress.h),
+/// ranges are always served from the original.
+/// Falls back to mg_http_serve_file() when there is no file
+static void http_send_file(
+        struct mg_connection* c, struct mg_http_message* hm, const char* path, const struct mg_http_serve_opts* opts,
+        std::shared_ptr<const cached_file> file
+    )
+{
+    if (file == nullptr) return mg_http_serve_file(c, hm, path, opts); // Reports the error
+
+    const char* extra_headers = opts->extra_headers == nullptr ? "" : opts->extra_headers;
+    struct mg_str mime = guess_content_type(mg_str(path), opts->mime_types);
+    struct mg_str* rh = mg_http_get_header(hm, "Range");
+    char etag[64];
+    size_t size = static_cast<size_t>(file->st.st_size);
+    mg_http_etag(etag, sizeof(etag), size, file->st.st_mtime);
+
+    // Pick the compressed variant, if there is one
+    char encoding[64]{ };
+    bool text = compressible(mime);
+    std::string variant;
+    const char* coding;
+    if (text && rh == nullptr &&
+        (coding = compress_find_variant(
+            path, file->st, accepts_encoding(hm, "gzip"), accepts_encoding(hm, "zstd"), variant
+        )) != nullptr)
+    {
+        if (std::shared_ptr<const cached_file> compressed = filecache_get(variant))
+        {
+            file = std::move(compressed);
+            size = static_cast<size_t>(file->st.st_size);
+            mg_snprintf(encoding, sizeof(encoding), "Content-Encoding: %s\r\n", coding);
+            // Every representation needs its own tag
+            size_t len = strlen(etag);
+            mg_snprintf(etag + len - 1, sizeof(etag) - len + 1, "-%s\"", coding);
+        }
+    }
+
+    struct mg_str* inm = mg_http_get_header(hm, "If-None-Match");
+    if (inm != nullptr && mg_strcasecmp(*inm, mg_str(etag)) == 0)
+    {
+        mg_http_reply(c, 304, extra_headers, "");
+        return;
+    }
+
+    int n, status = 200;
+    char range[100]{ };
+    size_t r1 = 0, r2 = 0, cl = size;
+
+    // Handle Range header
+    if (rh != nullptr && (n = getrange(rh, &r1, &r2)) > 0)
+    {
+        // If range is specified like "400-", set second limit to content len
+        if (n == 1) r2 = cl - 1;
+        if (r1 > r2 || r2 >= cl)
+        {
+            status = 416;
+            cl = 0;
+            mg_snprintf(range, sizeof(range), "Content-Range: bytes */%llu\r\n", (uint64_t) size);
+        }
+        else
+        {
+            status = 206;
+            cl = r2 - r1 + 1;
+            mg_snprintf(
+                range, sizeof(range), "Content-Range: bytes %llu-%llu/%llu\r\n",
+                (uint64_t) r1, (uint64_t) (r1 + cl - 1), (uint64_t) size
+            );
+        }
+    }
+
     mg_printf(
-        c, "%s",
-        "  <tr><td><a href=\"..\">..</a></td>"
-        "<td name=-1></td><td name=-1>[DIR]</td></tr>\n"
+        c,
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: %.*s\r\n"
+        "Etag: %s\r\n"
+        "Content-Length: %llu\r\n"
+        "%s%s%s%s\r\n",
+        status, mg_http_status_code_str(status), _PRINT(mime),
+        etag, (uint64_t) cl, encoding, text ? "Vary: Accept-Encoding\r\n" : "", range, extra_headers
     );
 
-    fs->ls(dir, printdirentry, &d);
-    mg_printf(c, "</tbody><tfoot><tr><td colspan=\"3\"><hr></td></tr></tfoot> </table></body></html>\n");
-    // The purpose of the copy-paste is to remove <address>Mongoose v....</address> up here ^
-    n = mg_snprintf(tmp, sizeof(tmp), "%lu", static_cast<unsigned long>(c->send.len - off));
-    if (n > sizeof(tmp)) n = 0;
-    memcpy(c->send.buf + off - 12, tmp, n); // Set content length
-    c->is_resp = 0;                         // Mark response end
+    if (mg_strcasecmp(hm->method, mg_str("HEAD")) == 0 || cl == 0)
+    {
+        c->is_resp = 0;
+        return;
+    }
+
+    if (file->fd < 0) // Contents are in memory
+    {
+        mg_send(c, file->data.data() + r1, cl);
+        c->is_resp = 0;
+        return;
+    }
+
+    posix_fadvise(file->fd, static_cast<off_t>(r1), static_cast<off_t>(cl), POSIX_FADV_SEQUENTIAL); // Readahead harder
+
+    typedef struct
+    {
+        std::shared_ptr<const cached_file> file; // Keeps the descriptor open
+        file_range range;
+        sendfile_fn send; // nullptr - userspace TLS: read into the send buffer, mongoose encrypts it from there
+        void* socket;
+    } file_transfer;
+
+    sendfile_fn send = sendfile_socket;
+    void* socket = c->fd;
+    if (c->is_tls)
+    {
+        SSL* ssl = static_cast<struct mg_tls*>(c->tls)->ssl;
+        send = tls_ktls_send_enabled(ssl) ? sendfile_ssl : nullptr;
+        socket = ssl;
+    }
+    int fd = file->fd;
+    c->pfn_data = new file_transfer{
+        .file = std::move(file), .range = {.fd = fd, .offset = static_cast<off_t>(r1), .left = cl},
+        .send = send, .socket = socket
+    };
+    c->pfn = [](struct mg_connection* c, int ev, void* ev_data)
+    {
+        auto* ft = static_cast<file_transfer*>(c->pfn_data);
+        bool done = ev == MG_EV_CLOSE;
+
+        if (ev == MG_EV_WRITE || ev == MG_EV_POLL)
+        {
+            if (c->send.size < MG_IO_SIZE) mg_iobuf_resize(&c->send, MG_IO_SIZE);
+            sendfile_state state = sendfile_step(
+                ft->range, ft->send, ft->socket, SENDFILE_CHUNK_SIZE,
+                reinterpret_cast<char*>(c->send.buf), &c->send.len, c->send.size
+            );
+            if (state == SENDFILE_FAILED)
+            {
+                // File got truncated or the peer is gone: Content-Length can't be honoured anymore
+                MG_DEBUG(("[SENDFILE] %lu: aborting transfer, %llu bytes left", c->id, (uint64_t) ft->range.left));
+                c->is_closing = 1;
+            }
+            done = state != SENDFILE_MORE;
+        }
+
+        if (done)
+        {
+            delete ft;
+            c->pfn_data = nullptr;
+            c->pfn = http_cb;
+            c->is_resp = 0;
+        }
+    };
+}
+
+/// Serve regular file at path. With io_uring the file is opened in the background
+/// and the connection waits for MG_EV_WAKEUP, otherwise right here
+static void http_serve_file(
+        struct mg_connection* c, struct mg_http_message* hm, const char* path, const struct mg_http_serve_opts* opts
+    )
+{
+    // mg_http_serve_file() may pick a precompressed '.gz' sibling instead, let it do that
+    struct mg_str* ae = mg_http_get_header(hm, "Accept-Encoding");
+    char gz[MG_PATH_MAX + 4];
+    if (ae != nullptr && mg_strstr(*ae, mg_str("gzip")) != nullptr &&
+        snprintf(gz, sizeof(gz), "%s.gz", path) < static_cast<int>(sizeof(gz)) && access(gz, R_OK) == 0)
+        return mg_http_serve_file(c, hm, path, opts);
+
+    // The posix backend opens it right here: no request to build for that
+    if (!uring_enabled()) return http_send_file(c, hm, path, opts, filecache_get(path));
+
+    auto request = std::make_shared<uring_request>();
+    request->path = path;
+    request->mgr = c->mgr;
+    request->conn_id = c->id;
+    if (!uring_open(request)) return http_send_file(c, hm, path, opts, filecache_get(path));
+
+    /// Everything needed to answer once the file is open: the request itself is gone from c->recv by then
+    typedef struct
+    {
+        std::shared_ptr<uring_request> request;
+        std::string head;
+        std::string extra_headers;
+        struct mg_http_serve_opts opts;
+    } file_wait;
+
+    auto* fw = new file_wait{
+        .request = std::move(request),
+        .head = std::string(hm->head.buf, hm->head.len),
+        .extra_headers = opts->extra_headers == nullptr ? "" : opts->extra_headers,
+        .opts = *opts
+    };
+    fw->opts.extra_headers = fw->extra_headers.c_str();
+    fw->opts.root_dir = nullptr; // Not needed anymore, and it won't live that long
+
+    c->pfn_data = fw;
+    c->pfn = [](struct mg_connection* c, int ev, void* ev_data)
+    {
+        auto* fw = static_cast<file_wait*>(c->pfn_data);
+        if (ev == MG_EV_WAKEUP && fw->request->done.load(std::memory_order_acquire))
+        {
+            c->pfn_data = nullptr;
+            c->pfn = http_cb;
+
+            struct mg_http_message hm{ };
+            mg_http_parse(fw->head.data(), fw->head.size(), &hm);
+            http_send_file(c, &hm, fw->request->path.c_str(), &fw->opts, fw->request->file); // May start a transfer
+            delete fw;
+        }
+        else if (ev == MG_EV_CLOSE)
+        {
+            delete fw;
+            c->pfn_data = nullptr;
+            c->pfn = http_cb;
+            c->is_resp = 0;
+        }
+    };
 }
 
 void serve_dir(struct mg_connection* c, struct mg_http_message* hm, const struct mg_http_serve_opts* opts)
@@ -516,129 +1083,186 @@ void serve_dir(struct mg_connection* c, struct mg_http_message* hm, const struct
     }
     else if (flags & MG_FS_DIR) { list_dir(c, hm, opts, path); }
     else if (flags && sp != nullptr && mg_match(mg_str(path), mg_str(sp), nullptr)) { mg_http_serve_ssi(c, opts->root_dir, path); }
-    else { mg_http_serve_file(c, hm, path, opts); }
+    else { http_serve_file(c, hm, path, opts); }
+}
+
+/// Working directory: the root of everything served from the filesystem. The server never changes it
+static const std::string& server_cwd()
+{
+    static const std::string cwd = getcwd();
+    return cwd;
+}
+
+/// Resolve request for something under the working directory, the path after prefix in its uri.
+/// Sends 404 and returns false if there is nothing there
+static bool fs_request_resolve(
+        fs_request& r, struct mg_connection* connection, struct mg_http_message* msg, const char* prefix
+    )
+{
+    if (!fs_request_parse(r, msg, prefix))
+    {
+        send_error_html(connection, COLORED_ERROR(404), ""); // If no - error 404
+        return false;
+    }
+    // options for mongoose's uri_to_path()/serve_dir()
+    r.opts = {.root_dir = server_cwd().c_str()};
+    return true;
 }
 
 inline void handle_dir_html(struct mg_connection* connection, struct mg_http_message* msg)
 {
     MG_DEBUG(("Serving /dir/ to %M...", mg_print_ip, &connection->rem));
-    char* path = nullptr;
-    auto cwd = getcwd(); // Current Working Directory
 
-    std::string uri(_EXPAND(msg->uri));
-    strscanf(uri.c_str(), "/dir/%s", &path); // Extract path from uri
+    fs_request r;
+    if (!fs_request_resolve(r, connection, msg, "/dir/")) return;
 
-    std::string spath(secure_path(path ? path : "")); // PATH string
-    delete[] path;
+    char extra_header[MG_PATH_MAX + 64];
+    // If file is too big - serve as an attachment
+    if (r.st.st_size > MAX_INLINE_FILE_SIZE)
+    {
+        std::string_view name(r.decoded_path);
+        while (name.size() > 1 && name.ends_with('/')) name.remove_suffix(1);
+        name.remove_prefix(name.find_last_of('/') + 1);
 
-    if (!spath.starts_with('/')) spath = "/" + spath; // Make always start with a '/'
+        snprintf(extra_header, sizeof(extra_header), "Content-Disposition: attachment; filename=\"%.*s\"\r\n",
+                 static_cast<int>(name.size()), name.data());
+        r.opts.extra_headers = extra_header;
+    }
 
-    std::string sdpath(spath);
-    sdpath.reserve(sdpath.size() + 1); // Set string buffer size
-    // Decode %XX encoded characters (makes it smaller, so won't overflow)
-    mg_url_decode(sdpath.c_str(), sdpath.size(), sdpath.data(), sdpath.size() + 1, 0);
-    sdpath = sdpath.data(); // trim off data after '\0' left from overwriting itself
+    serve_dir(connection, &r.msg, &r.opts);
+}
 
-    struct stat st{ };
-    if (::stat((cwd + sdpath).c_str(), &st) != 0) // Check if path exists
+inline void handle_api_dir(struct mg_connection* connection, struct mg_http_message* msg)
+{
+    MG_DEBUG(("Serving /api/dir/ to %M...", mg_print_ip, &connection->rem));
+
+    fs_request r;
+    if (!fs_request_resolve(r, connection, msg, "/api/dir/")) return;
+    if (!S_ISDIR(r.st.st_mode))
     {
-        send_error_html(connection, COLORED_ERROR(404), ""); // If no - error 404
+        mg_http_reply(connection, 400, "Content-Type: application/json\r\n", "{\"error\":\"Not a directory\"}\n");
         return;
     }
 
-    // options for function serve_dir()
-    struct mg_http_serve_opts opts{.root_dir = cwd.c_str()};
-    std::string extra_header;
+    // The directory itself (uri_to_path() would go for its index.html), named the way /dir/ listings are cached
+    std::string path = server_cwd() + r.decoded_path;
+    if (!path.ends_with('/')) path += '/';
 
-    // If file is too big - serve as an attachment
-    if (st.st_size > MAX_INLINE_FILE_SIZE)
+    auto listing = dirlist_get(path);
+    if (listing == nullptr)
     {
-        extra_header = "Content-Disposition: attachment; filename=\"";
-        extra_header += path_basename(sdpath);
-        extra_header += "\"\r\n";
-
-        opts.extra_headers = extra_header.c_str();
+        mg_http_reply(connection, 403, "Content-Type: application/json\r\n", "{\"error\":\"Can't read this directory\"}\n");
+        return;
     }
 
-    // Copy everything up to uri
-    std::string msgstrcp(msg->message.buf, msg->uri.buf);
-    msgstrcp += spath;
+    std::string headers = "Content-Type: application/json\r\nCache-Control: no-cache\r\nLast-Modified: ";
+    headers += http_date(listing->modified);
+    headers += "\r\n";
 
-    // Create fabricated http message for serve_dir()
-    struct mg_http_message msg2{ };
-    msg2.message = mg_str_n(msgstrcp.data(), msgstrcp.size());
-    msg2.uri = mg_str_n(msg2.message.buf + (msg->uri.buf - msg->message.buf), spath.size());
-    msg2.method = msg->method;
-    msg2.query = msg->query;
-    msg2.proto = msg->proto;
-    msg2.body = msg->body;
-    msg2.head = msg->head;
-    for (size_t i = 0; i < MG_MAX_HTTP_HEADERS; ++i)
-        msg2.headers[i] = msg->headers[i];
+    time_t since;
+    struct mg_str* ims = mg_http_get_header(msg, "If-Modified-Since");
+    if (ims != nullptr && parse_http_date(std::string_view(ims->buf, ims->len), &since) && listing->modified <= since)
+    {
+        mg_http_reply(connection, 304, headers.c_str(), "");
+        return;
+    }
+
+    // Page: entries with names after cursor (in byte order), at most limit of them
+    char var[MG_PATH_MAX]{ };
+    size_t limit = DIR_API_DEFAULT_LIMIT;
+    if (mg_http_get_var(&msg->query, "limit", var, sizeof(var)) > 0)
+        limit = std::clamp<size_t>(strtoul(var, nullptr, 10), 1, DIR_API_MAX_LIMIT);
+    std::string cursor;
+    if (mg_http_get_var(&msg->query, "cursor", var, sizeof(var)) > 0) cursor = var;
+
+    const auto& order = dirlist_order(*listing, DIR_SORT_BYTES);
+    const auto& entries = listing->entries;
+    auto it = cursor.empty() ? order.begin() : std::upper_bound(
+        order.begin(), order.end(), cursor,
+        [&](const std::string& name, uint32_t i) { return name < entries[i].name; }
+    );
 
-    serve_dir(connection, &msg2, &opts);
+    std::string body = "{\"path\":";
+    append_json_string(body, r.decoded_path);
+    body += string_format(",\"modified\":%lld,\"entries\":[", static_cast<long long>(listing->modified));
+    size_t n = 0;
+    for (; it != order.end() && n < limit; ++it, ++n)
+    {
+        const dir_entry& e = entries[*it];
+        if (n > 0) body += ',';
+        body += "{\"name\":";
+        append_json_string(body, e.name);
+        body += string_format(
+            ",\"type\":\"%s\",\"size\":%llu,\"mtime\":%lld}",
+            e.is_dir ? "dir" : "file", e.size, static_cast<long long>(e.mtime)
+        );
+    }
+    body += "],\"next_cursor\":";
+    if (it != order.end() && n > 0) append_json_string(body, entries[*(it - 1)].name);
+    else body += "null";
+    body += "}\n";
+
+    std::string response;
+    http_render_response(response, 200, headers.c_str(), body);
+    if (mg_strcasecmp(msg->method, mg_str("HEAD")) == 0) response.resize(response.size() - body.size());
+    http_send_rendered(connection, response);
 }
 
 #endif
 
 
-inline void handle_register_form_html(struct mg_connection* connection, struct mg_http_message* msg)
+/// Send a page that never changes, rendering it on the first use in this worker
+inline void http_send_fixed_page(struct mg_connection* connection, rendered_response& page, const char* html)
 {
-    MG_DEBUG(("Serving /register-form to %M...", mg_print_ip, &connection->rem));
-    mg_http_reply(connection, 200, "Content-Type: text/html\r\n", RESOURCE(register_html));
+    if (page.version == 0)
+    {
+        http_render_response(page.response, 200, "Content-Type: text/html\r\n", html);
+        page.version = 1;
+    }
+    http_send_rendered(connection, page.response);
 }
 
 
-inline void send_verification_notification_page_html(struct mg_connection* connection)
+inline void handle_register_form_html(struct mg_connection* connection, struct mg_http_message* msg)
 {
-    MG_DEBUG(("Sending email verification page to %M...", mg_print_ip, &connection->rem));
-    mg_http_reply(connection, 200, "Content-Type: text/html\r\n", RESOURCE(verify_html));
+    MG_DEBUG(("Serving /register-form to %M...", mg_print_ip, &connection->rem));
+    static thread_local rendered_response page{ };
+    http_send_fixed_page(connection, page, RESOURCE(register_html));
 }
 
-typedef struct
-{
-    std::string message;
-    size_t pos;
-} MessageData;
 
-// Callback function that provides the data for the email message
-static size_t curl_read_callback_email_data(void* buffer, size_t size, size_t nmemb, void* instream)
+inline void send_verification_notification_page_html(struct mg_connection* connection)
 {
-    auto* upload = static_cast<MessageData*>(instream);
-
-    if ((size == 0) || (nmemb == 0) || ((size * nmemb) < 1) || upload->pos >= upload->message.size()) return 0;
-
-    size_t len = std::min(upload->message.size() - upload->pos, size * nmemb);
-
-    memcpy(buffer, upload->message.c_str() + upload->pos, len);
-    upload->pos += len;
-
-    return len;
+    MG_DEBUG(("Sending email verification page to %M...", mg_print_ip, &connection->rem));
+    static thread_local rendered_response page{ };
+    http_send_fixed_page(connection, page, RESOURCE(verify_html));
 }
 
-inline id_t generate_id_and_send_email(
+/// Check that a verification link may be sent to email, answering the client if not.
+/// Returns where the link points to ("http(s)://<host>"), empty if it may not
+inline std::string verification_link_base(
         struct mg_connection* connection, struct mg_http_message* msg,
         const std::string& email
     )
 {
     MG_DEBUG(("[Send Email] Checking user email..."));
     auto email_hostaddr_pos = email.find('@');
-    if (email_hostaddr_pos == std::string::npos) return 0;
+    if (email_hostaddr_pos == std::string::npos) return { };
 
     if (!server_verification_email_hosts_whitelist.empty() &&
         !server_verification_email_hosts_whitelist.contains(email.substr(email_hostaddr_pos + 1)))
     {
-        MG_DEBUG(("[Send Email] Host Not Allowed: %s", email.c_str()[email_hostaddr_pos + 1]));
+        MG_DEBUG(("[Send Email] Host Not Allowed: %s", email.c_str() + email_hostaddr_pos + 1));
         send_error_html(connection, COLORED_ERROR(406), "This email service provider is not allowed");
-        return 0;
+        return { };
     }
 
     if (!server_verification_email_hosts_blacklist.empty() &&
         server_verification_email_hosts_blacklist.contains(email.substr(email_hostaddr_pos + 1)))
     {
-        MG_DEBUG(("[Send Email] Banned Host: %s", email.c_str()[email_hostaddr_pos + 1]));
+        MG_DEBUG(("[Send Email] Banned Host: %s", email.c_str() + email_hostaddr_pos + 1));
         send_error_html(connection, COLORED_ERROR(406), "This email service provider is not allowed");
-        return 0;
+        return { };
     }
 
     auto server_address = mg_http_get_header(msg, "Host");
@@ -647,83 +1271,152 @@ inline id_t generate_id_and_send_email(
     {
         MG_DEBUG(("[Send Email] Can't obtain Host address from header: 'Host'"));
         send_error_html(connection, COLORED_ERROR(500), "Can't generate a verification link");
-        return 0;
+        return { };
     }
 
 
-    MG_DEBUG(("[Send Email] Generating ID..."));
-
-    std::string server_address_str(server_address->buf, server_address->len);
-
-    srandom(mg_millis());
-
-    id_t id = random();
-    for (int i = 0; id == 0 || pending_id_exists(id) && i < 10; ++i)
-        id = random();
-    if (pending_id_exists(id)) return 0;
-
-    // Set up the curl handle
-    CURL* curl = curl_easy_init();
-
-    if (!curl)
+    if (pending_users_full())
     {
-        MG_ERROR(("[Send Email] Unable to initialize curl."));
-        send_error_html(connection, COLORED_ERROR(500), "Can't generate a verification link");
-        return 0;
+        send_error_html(connection, COLORED_ERROR(503), "Too many registrations right now. Try again later");
+        return { };
     }
 
-    // Set the SMTP server and port
-    curl_easy_setopt(curl, CURLOPT_URL, server_verification_smtp_server);
-
-    // Set the username and password for authentication
-    curl_easy_setopt(curl, CURLOPT_USERNAME, server_verification_email);
-    curl_easy_setopt(curl, CURLOPT_PASSWORD, server_verification_email_password);
-
-    std::string link = "http" + std::string(connection->is_tls ? "s" : "") +
-        "://" + server_address_str + "/verify/" + std::to_string(id);
-
-    // Define email message
-    std::string message = "To: " + email + "\r\n" +
-        "From: " + server_verification_email + "\r\n" +
-        "Subject: Confirm registration of new account\r\n"
-        "\r\n"
-        "To verify your email account and complete the registration process open link " + link +
-        " in any available web browser.";
-
-    MG_DEBUG(("Sending link [%s] to [%s]", link.c_str(), email.c_str()));
+    return "http" + std::string(connection->is_tls ? "s" : "") + "://" +
+        std::string(server_address->buf, server_address->len);
+}
 
-    struct curl_slist* recipients = nullptr;
-    curl_easy_setopt(curl, CURLOPT_MAIL_FROM, server_verification_email);
-    recipients = curl_slist_append(recipients, email.c_str());
-    curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
+/// What became of a registration. Sent to the waiting connection as the single byte of an mg_wakeup
+typedef enum : char
+{
+    REGISTRATION_SAVED,   // The user is on the disk
+    REGISTRATION_LOST,    // The user is registered, but the journal couldn't sync it
+    REGISTRATION_UNSAVED, // The journal refused the user: it is not registered
+    REGISTRATION_PENDING, // Verification link is on its way
+    REGISTRATION_EXISTS,
+    REGISTRATION_BUSY,    // No room for another pending user
+    REGISTRATION_NO_MAIL, // The mail queue is full
+    REGISTRATION_FAILED   // Couldn't hash the password or make an ID
+} registration_outcome;
+
+/// Tell the connection waiting in http_wait_registration() what became of its registration. Any thread
+static void registration_wakeup(struct mg_mgr* mgr, unsigned long conn_id, registration_outcome outcome)
+{
+    mg_wakeup(mgr, conn_id, &outcome, sizeof(outcome)); // Fails harmlessly if the connection is gone already
+}
 
-    curl_easy_setopt(curl, CURLOPT_READFUNCTION, curl_read_callback_email_data);
-    MessageData data{.message = message, .pos = 0};
-    curl_easy_setopt(curl, CURLOPT_READDATA, &data);
-    curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
-    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+/// Make user pending and mail the link to verify it. Runs on a hashing thread
+static registration_outcome register_pending_user(const __user_map_t::value_type& user, const std::string& link_base)
+{
+    MG_DEBUG(("[Send Email] Generating ID..."));
 
-    // Send the email
-    CURLcode res = curl_easy_perform(curl);
+    // The link is all it takes to complete the registration: the ID must not be guessable. Hashing threads
+    // register at once, so it is taken by the insert itself. Pending before the link is out, so it works as soon as it arrives
+    id_t id = 0;
+    for (int i = 0;; ++i)
+    {
+        if (i == 10 || RAND_bytes(reinterpret_cast<unsigned char*>(&id), sizeof(id)) != 1) return REGISTRATION_FAILED;
+        if (id == 0) continue;
+        if (add_pending_user(id, user)) break;
+        if (!pending_id_exists(id)) return REGISTRATION_BUSY; // Not taken: there is no room
+    }
 
-    // Clean up
-    curl_slist_free_all(recipients);
-    curl_easy_cleanup(curl);
-    curl_global_cleanup();
+    std::string link = link_base + "/verify/" + std::to_string(id);
+    MG_DEBUG(("Sending link [%s] to [%s]", link.c_str(), user.second.first.c_str()));
 
-    // Check for errors
-    if (res != CURLE_OK)
+    // The mail thread delivers it (with retries), the user gets the answer right away
+    if (!mail_enqueue(
+            user.second.first, "Confirm registration of new account",
+            "To verify your email account and complete the registration process open link " + link +
+            " in any available web browser."
+        ))
     {
-        MG_ERROR(("[Send Email] curl_easy_perform() failed: %s\n", curl_easy_strerror(res)));
-        send_error_html(connection, COLORED_ERROR(500), "Can't generate a verification link");
-        return 0;
+        take_pending_user(id);
+        return REGISTRATION_NO_MAIL;
     }
+    return REGISTRATION_PENDING;
+}
+
+/// Park the connection until registration_wakeup() tells it what to answer
+static void http_wait_registration(struct mg_connection* connection)
+{
+    connection->pfn = [](struct mg_connection* c, int ev, void* ev_data)
+    {
+        if (ev == MG_EV_WAKEUP)
+        {
+            auto* data = static_cast<struct mg_str*>(ev_data);
+            if (data->len != sizeof(registration_outcome)) return;
+            c->pfn = http_cb;
+            switch (static_cast<registration_outcome>(data->buf[0]))
+            {
+                case REGISTRATION_SAVED:
+                    mg_http_reply(c, 200, "", "Success"); // TODO: Successful Creation Page
+                    break;
+                case REGISTRATION_PENDING:
+                    send_verification_notification_page_html(c);
+                    break;
+                case REGISTRATION_EXISTS:
+                    send_error_html(c, COLORED_ERROR(409), "User already exists");
+                    break;
+                case REGISTRATION_BUSY:
+                    send_error_html(c, COLORED_ERROR(503), "Too many registrations right now. Try again later");
+                    break;
+                case REGISTRATION_NO_MAIL:
+                    send_error_html(c, COLORED_ERROR(503), "Can't send a verification link right now. Try again later");
+                    break;
+                case REGISTRATION_LOST:
+                case REGISTRATION_UNSAVED:
+                    send_error_html(c, COLORED_ERROR(500), "Could not save user");
+                    break;
+                default:
+                    send_error_html(c, COLORED_ERROR(500), "Could not insert user");
+            }
+        }
+        else if (ev == MG_EV_CLOSE)
+        {
+            c->pfn = http_cb;
+            c->is_resp = 0;
+        }
+    };
+}
+
+/// Register user. The outcome goes to the connection once the user is on the disk. Any thread
+static registration_outcome register_new_user(
+        const __user_map_t::value_type& user, struct mg_mgr* mgr, unsigned long conn_id
+    )
+{
+    new_user_result result = add_new_user(
+        user, [mgr, conn_id](bool durable)
+        {
+            registration_wakeup(mgr, conn_id, durable ? REGISTRATION_SAVED : REGISTRATION_LOST);
+        }
+    );
+    if (result == NEW_USER_EXISTS) return REGISTRATION_EXISTS;
+    if (result == NEW_USER_NOT_SAVED) return REGISTRATION_UNSAVED;
+#ifdef ENABLE_FILESYSTEM_ACCESS
+    add_user(ftp_server, user);
+#endif
+    return REGISTRATION_SAVED;
+}
 
-    return id;
+/// Take a token for the request, or turn it down with 429/503 before any real work is done
+static bool http_admit(struct mg_connection* connection, rate_class cls)
+{
+    unsigned retry_after = 0;
+    rate_verdict verdict = rate_admit(connection->rem, cls, &retry_after);
+    if (verdict == RATE_ADMITTED) return true;
+
+    char headers[64];
+    snprintf(headers, sizeof(headers), "Retry-After: %u\r\nContent-Type: text/plain\r\n", retry_after);
+    if (verdict == RATE_TOO_MANY) mg_http_reply(connection, 429, headers, "Too many requests. Try again later\n");
+    else mg_http_reply(connection, 503, headers, "The server is busy. Try again later\n");
+    MG_DEBUG(("Shed a request from %M: %d", mg_print_ip, &connection->rem, verdict));
+    return false;
 }
 
 inline void handle_register_html(struct mg_connection* connection, struct mg_http_message* msg)
 {
+    if (!http_admit(connection, RATE_REGISTER)) return;
+
     MG_DEBUG(("Processing registration request from %M...", mg_print_ip, &connection->rem));
     if (mg_strcmp(msg->method, mg_str("POST")))
     {
@@ -757,55 +1450,67 @@ inline void handle_register_html(struct mg_connection* connection, struct mg_htt
         return;
     }
 
-    if (get_registered_users()->contains(login))
+    if (user_exists(login))
     {
         send_error_html(connection, COLORED_ERROR(409), "User already exists");
         MG_INFO(("Blocked an attempt to create existing user - '%s'.", login));
         return;
     }
 
-    if (!std::regex_match(login, std::regex(REGEX_LOGIN)) || !std::regex_match(email, std::regex(REGEX_EMAIL)))
+    if (!valid_login(login) || !valid_email(email))
     {
         send_error_html(connection, COLORED_ERROR(406), "Wrong login or email format");
-        MG_INFO(("Blocked an attempt to create user - '%s' / '%s' / '%s'.", login, email, password));
+        MG_INFO(("Blocked an attempt to create user - '%s' / '%s'.", login, email));
         return;
     }
 
     if (std::string(password).find(' ') != std::string::npos)
     {
         send_error_html(connection, COLORED_ERROR(406), "The password should not contain whitespaces");
-        MG_INFO(("Blocked an attempt to create user - '%s' / '%s' / '%s'.", login, email, password));
+        MG_INFO(("Blocked an attempt to create user - '%s' / '%s'.", login, email));
         return;
     }
 
-    if (server_verification_email == nullptr)
+    std::string link_base;
+    if (server_verification_email == nullptr) MG_DEBUG(("Verification Email --- Disabled"));
+    else
     {
         MG_DEBUG(("Verification Email --- Enabled"));
-        __user_map_t::value_type user{login, {email, password}};
-        if (!add_new_user(user))
+        link_base = verification_link_base(connection, msg, email);
+        if (link_base.empty()) return;
+    }
+
+    // scrypt takes tens of milliseconds: a hashing thread makes the hash and registers the user (or mails
+    // the link), whether the client still waits or not. The connection is only woken up to answer
+    auto job = std::make_shared<password_job>();
+    job->password = password;
+    OPENSSL_cleanse(password, sizeof(password));
+    job->completed = [mgr = connection->mgr, conn_id = connection->id, login = std::string(login),
+            email = std::string(email), link_base = std::move(link_base)](password_job& done)
+    {
+        registration_outcome outcome = REGISTRATION_FAILED;
+        if (!done.hash.empty())
         {
-            send_error_html(connection, COLORED_ERROR(500), "Could not insert user");
-            return;
+            __user_map_t::value_type user{login, {email, done.hash}};
+            if (!link_base.empty()) outcome = register_pending_user(user, link_base);
+            else if ((outcome = register_new_user(user, mgr, conn_id)) == REGISTRATION_SAVED)
+                return; // The journal wakes the connection up once the user is on the disk
         }
-#ifdef ENABLE_FILESYSTEM_ACCESS
-        add_user(ftp_server, user);
-#endif
-        mg_http_reply(connection, 200, "", "Success"); // TODO: Successful Creation Page
-    }
-    else
+        registration_wakeup(mgr, conn_id, outcome);
+    };
+    if (!password_submit(job))
     {
-        MG_DEBUG(("Verification Email --- Disabled"));
-        id_t id = generate_id_and_send_email(connection, msg, email);
-        if (id == 0) return;
-
-        add_pending_user(id, {login, {email, password}});
-        send_verification_notification_page_html(connection);
+        send_error_html(connection, COLORED_ERROR(503), "Too many registrations right now. Try again later");
+        return;
     }
+    http_wait_registration(connection);
 }
 
 
-inline void handle_verify_html(struct mg_connection* connection, const struct mg_http_message* msg)
+inline void handle_verify_html(struct mg_connection* connection, struct mg_http_message* msg)
 {
+    if (!http_admit(connection, RATE_VERIFY)) return; // Links can't be guessed at full speed
+
     if (server_verification_email == nullptr)
     {
         send_error_html(connection, COLORED_ERROR(405), "Email authorization in disabled");
@@ -819,74 +1524,178 @@ inline void handle_verify_html(struct mg_connection* connection, const struct mg
         return;
     }
 
-    char* id_ptr = nullptr;
-
-    std::string uri(_EXPAND(msg->uri));
-    strscanf(uri.c_str(), "/verify/%s", &id_ptr);
-
-    std::string id_str(secure_path(id_ptr ? id_ptr : ""));
-    delete[] id_ptr;
-
+    std::string_view id_str = uri_tail(msg, "/verify/");
     id_t id = 0;
-    try { id = std::stoul(id_str); }
-    catch (...)
+    auto [end, error] = std::from_chars(id_str.data(), id_str.data() + id_str.size(), id);
+    if (error != std::errc() || end != id_str.data() + id_str.size() || id == 0)
     {
         send_error_html(connection, COLORED_ERROR(403), "Invalid link");
         return;
     }
 
-    if (id == 0)
+    auto pending_user = take_pending_user(id);
+    if (!pending_user)
     {
         send_error_html(connection, COLORED_ERROR(403), "Invalid link");
         return;
     }
 
-    auto pending_user = find_pending_user(id);
-    if (pending_user == pending_user_invalid())
+    switch (register_new_user(*pending_user, connection->mgr, connection->id))
     {
-        send_error_html(connection, COLORED_ERROR(403), "Invalid link");
+        case REGISTRATION_EXISTS:
+            send_error_html(connection, COLORED_ERROR(409), "User already exists");
+            return;
+        case REGISTRATION_UNSAVED:
+            add_pending_user(id, *pending_user); // Not the user's fault: the link works again once the disk does
+            send_error_html(connection, COLORED_ERROR(500), "Could not save user");
+            return;
+        default:
+            http_wait_registration(connection);
+    }
+}
+
+
+inline void handle_resources_html(struct mg_connection* connection, struct mg_http_message* msg)
+{
+    MG_DEBUG(("Processing /resources/ for %M...", mg_print_ip, &connection->rem));
+
+    std::string_view path = uri_tail(msg, "/resources/");
+    if (path.empty()) // Case: /resources/
+    {
+        send_error_html(connection, COLORED_ERROR(400), "No resource given");
         return;
     }
 
-    add_new_user(pending_user->second);
+    if (path == "bootstrap.css") // Case: /resources/bootstrap.css
+        http_send_resource(connection, msg, RESOURCE_VARIANTS(bootstrap_css), "text/css");
+    else if (path == "CascadiaMono.woff") // Case: /resources/CascadiaMono.woff
+        http_send_resource(connection, msg, RESOURCE_VARIANTS(CascadiaMono_woff), "font/woff");
+    else send_error_html(connection, COLORED_ERROR(501), "This resource does not exist");
+}
+
+inline void handle_metrics(struct mg_connection* connection, struct mg_http_message* msg)
+{
+    MG_DEBUG(("Serving /metrics to %M...", mg_print_ip, &connection->rem));
+
+    std::string metrics;
+    append_metric(metrics, "workers", workers_count);
+    tls_metrics(metrics);
+    mail_metrics(metrics);
+    passwords_metrics(metrics);
+    pending_users_metrics(metrics);
+    ratelimit_metrics(metrics);
+    journal_metrics(metrics);
 #ifdef ENABLE_FILESYSTEM_ACCESS
-    add_user(ftp_server, pending_user->second);
+    dirlist_metrics(metrics);
+    compress_metrics(metrics);
+    filecache_metrics(metrics);
+    uring_metrics(metrics);
 #endif
 
-    mg_http_reply(connection, 200, "", "Success");
+    mg_http_reply(connection, 200, "Content-Type: text/plain\r\n", "%s", metrics.c_str());
 }
 
-
-inline void handle_resources_html(struct mg_connection* connection, struct mg_http_message* msg)
+/// Strip spaces and tabs around str
+static std::string_view trim(std::string_view str)
 {
-    MG_DEBUG(("Processing /resources/ for %M...", mg_print_ip, &connection->rem));
-
-    char* path = nullptr;
+    size_t begin = str.find_first_not_of(" \t");
+    if (begin == std::string_view::npos) return { };
+    return str.substr(begin, str.find_last_not_of(" \t") - begin + 1);
+}
 
-    std::string uri(_EXPAND(msg->uri));
-    strscanf(uri.c_str(), "/resources/%s", &path);
+/// Check if the client accepts given content coding: listed in Accept-Encoding (or matched by '*') with q > 0
+static bool accepts_encoding(struct mg_http_message* msg, std::string_view coding)
+{
+    struct mg_str* header = mg_http_get_header(msg, "Accept-Encoding");
+    if (header == nullptr) return false;
 
-    if (path == nullptr) // Case: /resources/
+    std::string_view list(header->buf, header->len);
+    bool wildcard = false;
+    while (!list.empty())
     {
-        send_error_html(connection, COLORED_ERROR(400), "No resource given");
-        return;
+        size_t comma = list.find(',');
+        std::string_view item = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view{ } : list.substr(comma + 1);
+
+        size_t semicolon = item.find(';');
+        std::string_view token = trim(item.substr(0, semicolon));
+        bool allowed = true;
+        if (semicolon != std::string_view::npos)
+        {
+            std::string_view param = trim(item.substr(semicolon + 1));
+            if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=')
+                allowed = param.find_first_not_of("0.", 2) != std::string_view::npos; // q=0, q=0.000 - refused
+        }
+
+        if (token.size() == coding.size() && strncasecmp(token.data(), coding.data(), coding.size()) == 0)
+            return allowed;
+        if (token == "*") wildcard = allowed;
     }
+    return wildcard;
+}
 
-    std::string path_s(path);
-    delete[] path;
+/// Check if If-None-Match header lists etag (or '*'). Weak and strong tags compare equal here (RFC 9110)
+static bool etag_matches(struct mg_http_message* msg, std::string_view etag)
+{
+    struct mg_str* header = mg_http_get_header(msg, "If-None-Match");
+    if (header == nullptr) return false;
 
-    if (path_s == "bootstrap.css") // Case: /resources/bootstrap.css
-        http_send_resource(connection, msg, RESOURCE(bootstrap_css), LEN(bootstrap_css), "text/css");
-    else if (path_s == "CascadiaMono.woff") // Case: /resources/CascadiaMono.woff
-        http_send_resource(connection, msg, RESOURCE(CascadiaMono_woff), LEN(CascadiaMono_woff), "font/woff");
-    else send_error_html(connection, COLORED_ERROR(501), "This resource does not exist");
+    std::string_view list(header->buf, header->len);
+    while (!list.empty())
+    {
+        size_t comma = list.find(',');
+        std::string_view tag = trim(list.substr(0, comma));
+        list = comma == std::string_view::npos ? std::string_view{ } : list.substr(comma + 1);
+
+        if (tag == "*") return true;
+        if (tag.starts_with("W/")) tag.remove_prefix(2);
+        if (tag == etag) return true;
+    }
+    return false;
 }
 
 inline void http_send_resource(
-        struct mg_connection* connection, struct mg_http_message* msg, const char* rcdata, size_t rcsize,
+        struct mg_connection* connection, struct mg_http_message* msg, const embedded_resource& rc,
         const char* mime_type
     )
 {
+    // Pick the smallest representation the client can decode
+    const char* rcdata = RESOURCE(rc.data);
+    size_t rcsize = rc.len;
+    const char* encoding = "";
+    if (rc.br_len > 0 && accepts_encoding(msg, "br"))
+    {
+        rcdata = RESOURCE(rc.br), rcsize = rc.br_len;
+        encoding = "Content-Encoding: br\r\n";
+    }
+    else if (rc.gzip_len > 0 && accepts_encoding(msg, "gzip"))
+    {
+        rcdata = RESOURCE(rc.gzip), rcsize = rc.gzip_len;
+        encoding = "Content-Encoding: gzip\r\n";
+    }
+    const char* vary = rc.br_len > 0 || rc.gzip_len > 0 ? "Vary: Accept-Encoding\r\n" : "";
+
+    // Every representation has its own strong tag: "<content hash>[-encoding]"
+    char etag[64]{ };
+    mg_snprintf(
+        etag, sizeof(etag), "\"%s%s\"", rc.etag,
+        rcdata == RESOURCE(rc.br) ? "-br" : rcdata == RESOURCE(rc.gzip) ? "-gz" : ""
+    );
+
+    if (etag_matches(msg, etag)) // The client has it already
+    {
+        mg_printf(
+            connection,
+            "HTTP/1.1 304 %s\r\n"
+            "ETag: %s\r\n"
+            "Cache-Control: " RESOURCE_CACHE_CONTROL "\r\n"
+            "%s\r\n",
+            mg_http_status_code_str(304), etag, vary
+        );
+        connection->is_resp = 0;
+        return;
+    }
+
     int n, status = 200;
     char range[100]{ };
     size_t r1 = 0, r2 = 0, cl = rcsize;
@@ -909,7 +1718,7 @@ inline void http_send_resource(
         {
             status = 206;
             cl = r2 - r1 + 1;
-            mg_snprintf(range, sizeof(range), "Content-Range: bytes %llu%llu/%llu\r\n", r1, r1 + cl - 1, rcsize);
+            mg_snprintf(range, sizeof(range), "Content-Range: bytes %llu-%llu/%llu\r\n", r1, r1 + cl - 1, rcsize);
         }
     }
     mg_printf(
@@ -917,11 +1726,14 @@ inline void http_send_resource(
         "HTTP/1.1 %d %s\r\n"
         "Content-Type: %.*s\r\n"
         "Content-Length: %llu\r\n"
-        "%s\r\n",
+        "ETag: %s\r\n"
+        "Cache-Control: " RESOURCE_CACHE_CONTROL "\r\n"
+        "%s%s%s\r\n",
         status, mg_http_status_code_str(status),
         _PRINT(mime),
         cl,
-        range
+        etag,
+        encoding, vary, range
     );
 
     if (mg_strcasecmp(msg->method, mg_str("HEAD")) == 0)
@@ -978,7 +1790,7 @@ inline void http_send_resource(
     // Track to-be-sent content length at the end of connection->data, aligned
     auto clp = reinterpret_cast<size_t*>(&connection->data[(sizeof(connection->data) - sizeof(size_t)) /
         sizeof(size_t) * sizeof(size_t)]);
-    connection->pfn_data = new str_buf_fd{.data = rcdata, .len = rcsize, .pos = 0};
+    connection->pfn_data = new str_buf_fd{.data = rcdata, .len = rcsize, .pos = status == 206 ? r1 : 0};
     *clp = cl; // Track to-be-sent content length
 }
 
@@ -986,8 +1798,5 @@ inline void http_send_resource(
 inline void send_error_html(struct mg_connection* connection, int code, const char* color, const char* msg)
 {
     MG_DEBUG(("Sending error message: Error %d \"%s\"...", code, msg));
-    mg_http_reply(
-        connection, code, "Content-Type: text/html\r\n", RESOURCE(error_html),
-        color, color, color, color, code, mg_http_status_code_str(code), msg
-    );
+    http_send_rendered(connection, error_page(code, color, msg));
 }
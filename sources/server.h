@@ -6,6 +6,9 @@
 
 #include <string>
 #include "../mongoose/mongoose.h"
+#include "router.h"
+#include "ratelimit.h"
+#include "response.h"
 
 #ifdef ENABLE_FILESYSTEM_ACCESS
 # include "../ftp/ftp_event_handler.h"
@@ -24,6 +27,18 @@ extern const char* server_verification_email;
 extern const char* server_verification_email_password;
 extern const char* server_verification_smtp_server;
 extern int log_level, hexdump;
+extern int workers_count, pin_workers;
+extern long tls_ticket_rotation_interval;
+extern int tls_ktls;
+extern unsigned long long dir_cache_size;
+extern const char* compress_cache_dir;
+extern unsigned long long file_cache_size;
+extern const char* fs_backend;
+extern unsigned long long scrypt_n;
+extern unsigned long scrypt_r, scrypt_p;
+extern int hash_threads;
+extern long pending_ttl;
+extern rate_limit rate_limits[RATE_CLASS_COUNT];
 
 #ifdef ENABLE_FILESYSTEM_ACCESS
 extern pthread_mutex_t ftp_callback_mutex;
@@ -33,15 +48,19 @@ extern void server_initialize();
 extern void server_run();
 
 
-typedef void (*path_handler_function)(struct mg_connection* connection, struct mg_http_message* msg);
-
 typedef struct
 {
     std::string path_regex;
     std::string description;
     path_handler_function fn;
+    unsigned methods;
 } registered_path_handler;
 
-extern void register_path_handler(const std::string& path, const std::string& description, path_handler_function fn);
+/// Handlers are shared by all workers without locking, so register them before server_run().
+/// methods is a mask of ROUTE_* values (any method by default)
+extern void register_path_handler(
+        const std::string& path, const std::string& description, path_handler_function fn,
+        unsigned methods = ROUTE_ANY
+    );
 
 #endif //WEBSERVER_SERVER_H
@@ -1,9 +1,11 @@
 // Copyright (c) 2022 Perets Dmytro
 // Author: Perets Dmytro <dmytroperets@gmail.com>
 
+#include <atomic>
 #include <list>
 #include <filesystem>
 #include <utility>
+#include <pthread.h>
 #include "server.h"
 #include "settings.h"
 #include "../resources.hpp"
@@ -23,6 +25,10 @@ typedef struct
 } dashboard_data;
 
 static dashboard_data statistics = {.recent_uploads_count = 0, .recent_uploaded_files = { }};
+// Written from ftp threads, read from http workers
+static pthread_mutex_t statistics_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Bumped whenever statistics change, so rendered dashboards know when to re-render
+static std::atomic<unsigned long long> statistics_version = 1;
 
 
 class scheduled_handler
@@ -105,17 +111,29 @@ void register_additional_handlers()
         "/dashboard", "View statistics on dashboard",
         [](struct mg_connection* connection, struct mg_http_message* msg)
         {
-            std::string appendix;
-            for (auto& f : statistics.recent_uploaded_files)
+            static thread_local rendered_response page{ };
+            if (page.version != statistics_version) // Re-render only after new uploads
             {
-                appendix += "<li><a href=\"/dir/" + f.second + "\">" + f.first + "</a></li>\n";
-                MG_INFO(("Indexed '%s' => '%s'.", f.first.c_str(), f.second.c_str()));
+                std::string appendix;
+                unsigned long long uploads_count;
+                {
+                    mutex_locker l(&statistics_mutex);
+                    page.version = statistics_version;
+                    for (auto& f : statistics.recent_uploaded_files)
+                    {
+                        appendix += "<li><a href=\"/dir/" + f.second + "\">" + f.first + "</a></li>\n";
+                        MG_DEBUG(("Indexed '%s' => '%s'.", f.first.c_str(), f.second.c_str()));
+                    }
+                    uploads_count = statistics.recent_uploads_count;
+                }
+
+                http_render_response(
+                    page.response, 200, "Content-Type: text/html\r\n",
+                    string_format(RESOURCE(dashboard_html), uploads_count, appendix.c_str())
+                );
             }
 
-            mg_http_reply(
-                connection, 200, "", RESOURCE(dashboard_html),
-                statistics.recent_uploads_count, appendix.c_str()
-            );
+            http_send_rendered(connection, page.response);
         }
     );
 
@@ -124,6 +142,7 @@ void register_additional_handlers()
             std::shared_ptr<::fineftp::FtpUser> ftp_user
         )
         {
+            mutex_locker l(&statistics_mutex); // Called from all ftp threads
             scheduled_handler::$()();
 
             if (ftp_command == "STOR")
@@ -156,6 +175,7 @@ void register_additional_handlers()
                             statistics.recent_uploaded_files.emplace_front(path_basename(filepath), std::filesystem::relative(fpath, base).string());
                             while (statistics.recent_uploaded_files.size() > MAX_RECENT_UPLOAD_RECORDS_COUNT)
                                 statistics.recent_uploaded_files.pop_back();
+                            ++statistics_version;
                         }
                     }, ftp_command, parameters, ftp_working_directory, std::move(ftp_user)
                 );
@@ -0,0 +1,107 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "timerwheel.h"
+
+
+static void timer_list_push(timer_node* head, timer_node* node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void timer_list_unlink(timer_node* node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+}
+
+/// Put node into the slot its expiry falls into, counting from the next tick
+static void timer_wheel_place(timer_wheel& wheel, timer_node* node)
+{
+    uint64_t expires = node->expires < wheel.next ? wheel.next : node->expires;
+    uint64_t delta = expires - wheel.next;
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t{1} << (TIMER_WHEEL_BITS * (level + 1)))) ++level;
+
+    // Too far for the top level: park it in the furthest slot, it comes back here when that one cascades
+    uint64_t horizon = uint64_t{1} << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+    if (delta >= horizon) expires = wheel.next + horizon - 1;
+
+    size_t slot = (expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    timer_list_push(&wheel.slots[level][slot], node);
+}
+
+/// Move timers of the slot one level down (or further)
+static void timer_wheel_cascade(timer_wheel& wheel, int level, size_t slot)
+{
+    timer_node* head = &wheel.slots[level][slot];
+    if (head->next == head) return;
+
+    // Detach the list first: timers may land in the very same slot again
+    timer_node* first = head->next;
+    timer_node* last = head->prev;
+    head->next = head->prev = head;
+    last->next = nullptr;
+
+    for (timer_node* node = first; node != nullptr;)
+    {
+        timer_node* next = node->next;
+        timer_wheel_place(wheel, node);
+        node = next;
+    }
+}
+
+
+void timer_wheel_init(timer_wheel& wheel, uint64_t now)
+{
+    wheel.next = now;
+    wheel.count = 0;
+    for (auto& level : wheel.slots)
+        for (auto& head : level)
+            head.prev = head.next = &head;
+}
+
+void timer_wheel_add(timer_wheel& wheel, timer_node* node, uint64_t expires)
+{
+    node->expires = expires;
+    timer_wheel_place(wheel, node);
+    ++wheel.count;
+}
+
+void timer_wheel_remove(timer_wheel& wheel, timer_node* node)
+{
+    if (node->prev == nullptr) return;
+    timer_list_unlink(node);
+    --wheel.count;
+}
+
+void timer_wheel_advance(timer_wheel& wheel, uint64_t now, std::vector<timer_node*>& expired)
+{
+    for (; wheel.next <= now; ++wheel.next)
+    {
+        uint64_t tick = wheel.next;
+
+        // Whenever a level wraps around, the next slot of the level above comes down
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+        {
+            if ((tick & ((uint64_t{1} << (TIMER_WHEEL_BITS * level)) - 1)) != 0) break;
+            timer_wheel_cascade(wheel, level, (tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+        }
+
+        timer_node* head = &wheel.slots[0][tick & (TIMER_WHEEL_SLOTS - 1)];
+        while (head->next != head)
+        {
+            timer_node* node = head->next;
+            timer_list_unlink(node);
+            --wheel.count;
+            expired.push_back(node);
+        }
+
+        if (wheel.count == 0) wheel.next = now; // Nothing to wait for: skip the rest at once
+    }
+}
@@ -0,0 +1,48 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Hierarchical timer wheel. TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots, every level
+/// TIMER_WHEEL_SLOTS times coarser than the one below. Adding and removing a timer is O(1),
+/// a timer moves down at most TIMER_WHEEL_LEVELS - 1 times before it fires.
+/// Timers are intrusive: the owner embeds timer_node into its own entry. Not thread-safe
+
+#ifndef WEBSERVER_TIMERWHEEL_H
+#define WEBSERVER_TIMERWHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4 // Timers further than 64^4 ticks ahead are kept at the top until they get closer
+
+
+typedef struct timer_node
+{
+    struct timer_node* prev = nullptr; // nullptr - not in a wheel
+    struct timer_node* next = nullptr;
+    uint64_t expires = 0;              // Tick to fire at
+} timer_node;
+
+typedef struct
+{
+    uint64_t next;   // Next tick to process
+    size_t count;    // Timers in the wheel
+    timer_node slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // Heads of circular lists
+} timer_wheel;
+
+
+/// Empty the wheel and make now the next tick. The wheel must stay where it is afterwards: lists point into it
+extern void timer_wheel_init(timer_wheel& wheel, uint64_t now);
+
+/// Schedule node to fire at tick expires (at the next tick, if that is passed already). Node must not be in a wheel
+extern void timer_wheel_add(timer_wheel& wheel, timer_node* node, uint64_t expires);
+
+/// Cancel node's timer. Does nothing if it isn't scheduled
+extern void timer_wheel_remove(timer_wheel& wheel, timer_node* node);
+
+/// Process ticks up to and including now. Nodes that fire are taken out of the wheel and appended to expired
+extern void timer_wheel_advance(timer_wheel& wheel, uint64_t now, std::vector<timer_node*>& expired);
+
+#endif //WEBSERVER_TIMERWHEEL_H
@@ -0,0 +1,493 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "tls.h"
+
+#include "constants.h"
+#include "server.h"
+#include "tools.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <pthread.h>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <openssl/err.h>
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+
+// Current context. Connections hold their own references, so swapping it never breaks them
+static SSL_CTX* tls_context = nullptr;
+static pthread_mutex_t tls_context_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Where the keypair lives and what it looked like when it was loaded last time
+static std::string tls_context_dir;
+static struct timespec tls_cert_mtime{ }, tls_key_mtime{ };
+
+
+/// Session ticket encryption key. Tickets are issued with the current key
+/// and still accepted with the previous one, so rotation doesn't drop sessions
+typedef struct
+{
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    uint64_t created; // ms
+} ticket_key;
+
+// Shared by all contexts (and so all listeners and workers), survives keypair reloads
+static ticket_key ticket_keys[2]{ }; // [0] - current, [1] - previous
+static bool ticket_keys_initialized = false;
+static pthread_mutex_t ticket_keys_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Resumption statistics
+static std::atomic<unsigned long long> handshakes_resumed{0}, handshakes_full{0}, tickets_unknown_key{0};
+// Kernel TLS statistics
+static std::atomic<unsigned long long> ktls_send_enabled{0}, ktls_send_fallback{0};
+
+
+// OpenSSL drives kernel TLS through BIO controls that an own BIO has to know to take part
+#if defined(OPENSSL_NO_KTLS)
+# define KTLS_FILTER 0 // OpenSSL never offers keys
+#elif defined(BIO_CTRL_SET_KTLS) && defined(BIO_CTRL_SET_KTLS_TX_SEND_CTRL_MSG) && defined(BIO_CTRL_CLEAR_KTLS_TX_CTRL_MSG)
+# define KTLS_FILTER 1
+#elif OPENSSL_VERSION_MAJOR == 3 && BIO_CTRL_GET_KTLS_SEND == 73 && BIO_CTRL_GET_KTLS_RECV == 76
+// 3.x keeps them internal (openssl/bio.h lists them in a comment). libssl sends them to libcrypto's BIOs,
+// so they are fixed by the 3.x ABI, next to the public ones checked above
+# define BIO_CTRL_SET_KTLS 72
+# define BIO_CTRL_SET_KTLS_TX_SEND_CTRL_MSG 74
+# define BIO_CTRL_CLEAR_KTLS_TX_CTRL_MSG 75
+# define KTLS_FILTER 1
+#else
+# define KTLS_FILTER 0 // Unknown values: the filter would miss the keys or take other controls for them
+#endif
+
+#ifndef SOL_TLS
+# define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+# define TCP_ULP 31
+#endif
+
+
+/// State of the kTLS filter, one per connection
+typedef struct
+{
+    int fd;               // Connection socket
+    bool send;            // The kernel encrypts everything written from now on
+    int record_type;      // Send the next write as this (non application data) record type, -1 - none
+    bool attempted;       // OpenSSL has offered keys
+    int error;            // Why the kernel refused them
+} ktls_filter;
+
+
+/// Size of the kernel structure for the cipher OpenSSL has picked, 0 if the kernel doesn't know it
+static socklen_t ktls_crypto_info_size(const struct tls_crypto_info* info)
+{
+    switch (info->cipher_type)
+    {
+        case TLS_CIPHER_AES_GCM_128: return sizeof(struct tls12_crypto_info_aes_gcm_128);
+        case TLS_CIPHER_AES_GCM_256: return sizeof(struct tls12_crypto_info_aes_gcm_256);
+        case TLS_CIPHER_AES_CCM_128: return sizeof(struct tls12_crypto_info_aes_ccm_128);
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+        case TLS_CIPHER_CHACHA20_POLY1305: return sizeof(struct tls12_crypto_info_chacha20_poly1305);
+#endif
+        default: return 0;
+    }
+}
+
+/// Hand transmit keys to the kernel: what socket BIOs do in OpenSSL itself
+static bool ktls_start_send(ktls_filter* kf, const struct tls_crypto_info* info)
+{
+    kf->attempted = true;
+    socklen_t len = ktls_crypto_info_size(info);
+    if (len == 0)
+    {
+        kf->error = EOPNOTSUPP;
+        return false;
+    }
+
+    // The ULP stays installed on failure, but without keys it only passes data through
+    if (setsockopt(kf->fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0 && errno != EEXIST)
+    {
+        kf->error = errno;
+        return false;
+    }
+    if (setsockopt(kf->fd, SOL_TLS, TLS_TX, info, len) != 0)
+    {
+        kf->error = errno;
+        return false;
+    }
+    return kf->send = true;
+}
+
+/// Send a handshake message or an alert as its own record type (plain writes are application data)
+static int ktls_send_record(ktls_filter* kf, const char* data, int len)
+{
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(unsigned char))];
+    } cmsgbuf{ };
+    struct iovec iov{.iov_base = const_cast<char*>(data), .iov_len = static_cast<size_t>(len)};
+    struct msghdr msg{ };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf.buf;
+    msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = static_cast<unsigned char>(kf->record_type);
+    msg.msg_controllen = cmsg->cmsg_len;
+
+    return static_cast<int>(sendmsg(kf->fd, &msg, MSG_NOSIGNAL));
+}
+
+static int ktls_filter_write(BIO* b, const char* data, int len)
+{
+    auto* kf = static_cast<ktls_filter*>(BIO_get_data(b));
+    BIO_clear_retry_flags(b);
+
+    if (kf->send && kf->record_type >= 0)
+    {
+        int n = ktls_send_record(kf, data, len);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) BIO_set_retry_write(b);
+            return -1;
+        }
+        kf->record_type = -1;
+        return n;
+    }
+
+    // Everything else goes through mongoose: straight to the socket, where the kernel encrypts it if enabled
+    int n = BIO_write(BIO_next(b), data, len);
+    BIO_copy_next_retry(b);
+    return n;
+}
+
+static int ktls_filter_read(BIO* b, char* data, int len)
+{
+    BIO_clear_retry_flags(b);
+    int n = BIO_read(BIO_next(b), data, len);
+    BIO_copy_next_retry(b);
+    return n;
+}
+
+static long ktls_filter_ctrl(BIO* b, int cmd, long larg, void* parg)
+{
+    auto* kf = static_cast<ktls_filter*>(BIO_get_data(b));
+    switch (cmd)
+    {
+#if KTLS_FILTER
+        case BIO_CTRL_SET_KTLS: // larg - is transmit direction
+            return larg && ktls_start_send(kf, static_cast<const struct tls_crypto_info*>(parg));
+        case BIO_CTRL_GET_KTLS_SEND:
+            return kf->send;
+        case BIO_CTRL_SET_KTLS_TX_SEND_CTRL_MSG:
+            kf->record_type = static_cast<int>(larg);
+            return 0;
+        case BIO_CTRL_CLEAR_KTLS_TX_CTRL_MSG:
+            kf->record_type = -1;
+            return 0;
+#endif
+        case BIO_C_GET_FD: // SSL_sendfile() sends straight to the socket
+            if (parg != nullptr) *static_cast<int*>(parg) = kf->fd;
+            return kf->fd;
+        default:
+            return BIO_next(b) ? BIO_ctrl(BIO_next(b), cmd, larg, parg) : 0;
+    }
+}
+
+static int ktls_filter_create(BIO* b)
+{
+    BIO_set_data(b, new ktls_filter{.fd = -1, .send = false, .record_type = -1, .attempted = false, .error = 0});
+    BIO_set_init(b, 1);
+    return 1;
+}
+
+static int ktls_filter_destroy(BIO* b)
+{
+    delete static_cast<ktls_filter*>(BIO_get_data(b));
+    BIO_set_data(b, nullptr);
+    return 1;
+}
+
+static int ktls_filter_type = 0;
+
+static BIO_METHOD* ktls_filter_method()
+{
+    static BIO_METHOD* method = []
+    {
+        ktls_filter_type = BIO_get_new_index() | BIO_TYPE_FILTER;
+        BIO_METHOD* m = BIO_meth_new(ktls_filter_type, "kTLS filter");
+        BIO_meth_set_write(m, ktls_filter_write);
+        BIO_meth_set_read(m, ktls_filter_read);
+        BIO_meth_set_ctrl(m, ktls_filter_ctrl);
+        BIO_meth_set_create(m, ktls_filter_create);
+        BIO_meth_set_destroy(m, ktls_filter_destroy);
+        return m;
+    }();
+    return method;
+}
+
+/// Get kTLS filter state of this connection, if it has one
+static ktls_filter* ktls_filter_of(SSL* ssl)
+{
+    for (BIO* b = SSL_get_wbio(ssl); b != nullptr; b = BIO_next(b)) // Skips the handshake buffer, if any
+        if (BIO_method_type(b) == ktls_filter_type)
+            return static_cast<ktls_filter*>(BIO_get_data(b));
+    return nullptr;
+}
+
+
+/// Make a new current key, the old one becomes previous. Caller holds ticket_keys_mutex
+static bool ticket_keys_rotate_locked(uint64_t now)
+{
+    ticket_key key{ };
+    if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+        RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+        RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1)
+        return false;
+    key.created = now;
+
+    ticket_keys[1] = ticket_keys[0];
+    ticket_keys[0] = key;
+    if (!ticket_keys_initialized) ticket_keys[1] = key; // Nothing to fall back to yet
+    ticket_keys_initialized = true;
+
+    MG_DEBUG(("[TLS] Rotated session ticket key"));
+    return true;
+}
+
+/// Encrypt new tickets with the current key, decrypt with whichever key issued them
+static int ticket_key_callback(
+        SSL*, unsigned char key_name[16], unsigned char iv[EVP_MAX_IV_LENGTH],
+        EVP_CIPHER_CTX* cipher_ctx, EVP_MAC_CTX* hmac_ctx, int enc
+    )
+{
+    ticket_key key{ };
+    int result = 1;
+    {
+        mutex_locker l(&ticket_keys_mutex);
+        uint64_t now = mg_millis();
+        if (!ticket_keys_initialized ||
+            (enc && tls_ticket_rotation_interval > 0 &&
+             now - ticket_keys[0].created >= static_cast<uint64_t>(tls_ticket_rotation_interval) * 1000))
+            if (!ticket_keys_rotate_locked(now) && !ticket_keys_initialized)
+                return -1;
+
+        if (enc) key = ticket_keys[0];
+        else if (memcmp(key_name, ticket_keys[0].name, sizeof(ticket_keys[0].name)) == 0)
+            key = ticket_keys[0];
+        else if (memcmp(key_name, ticket_keys[1].name, sizeof(ticket_keys[1].name)) == 0)
+            key = ticket_keys[1], result = 2; // Valid, but ask OpenSSL to issue a fresh ticket
+        else
+        {
+            ++tickets_unknown_key;
+            return 0; // Expired key: do a full handshake
+        }
+    }
+
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0),
+        OSSL_PARAM_construct_end()
+    };
+    if (EVP_MAC_init(hmac_ctx, key.hmac_key, sizeof(key.hmac_key), params) != 1) return -1;
+
+    if (enc)
+    {
+        memcpy(key_name, key.name, sizeof(key.name));
+        if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1) return -1;
+        if (EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1) return -1;
+    }
+    else if (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1) return -1;
+
+    return result;
+}
+
+
+static bool same_mtime(const struct timespec& a, const struct timespec& b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/// Print the reason of the last OpenSSL failure
+static void log_openssl_error(const char* what, const std::string& path)
+{
+    char err[256]{ };
+    ERR_error_string_n(ERR_get_error(), err, sizeof(err));
+    MG_ERROR(("[TLS] %s [%s]: %s", what, path.c_str(), err));
+    ERR_clear_error();
+}
+
+bool tls_context_load(const char* dir)
+{
+    std::string stls_path(dir);                      // TLS Certificate and Key folder
+    if (!stls_path.ends_with('/')) stls_path += '/'; // always '/' at the end
+
+    std::string cert_path(stls_path + "cert.pem"); // Public Certificate
+    std::string key_path(stls_path + "key.pem");   // Private Key
+
+    struct stat cert_st{ }, key_st{ };
+    if (::stat(cert_path.c_str(), &cert_st) != 0 || ::stat(key_path.c_str(), &key_st) != 0)
+    {
+        MG_ERROR(("[TLS] Can't find keypair in [%s]", stls_path.c_str()));
+        return false;
+    }
+
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == nullptr)
+    {
+        log_openssl_error("Can't create context for", stls_path);
+        return false;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (tls_ktls && KTLS_FILTER) SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS); // Offer keys to the transport after handshakes
+    else if (tls_ktls) MG_ERROR(("[TLS] kTLS is not supported with this OpenSSL build: encrypting in userspace"));
+
+    // Let returning clients do abbreviated handshakes: by session id (cached here) or by ticket
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, reinterpret_cast<const unsigned char*>(APPNAME), static_strlen(APPNAME));
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_callback);
+
+    MG_DEBUG(("[TLS] Reading [%s]...", cert_path.c_str()));
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_path.c_str()) != 1)
+    {
+        log_openssl_error("Can't load certificate", cert_path);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+
+    MG_DEBUG(("[TLS] Reading [%s]...", key_path.c_str()));
+    if (SSL_CTX_use_PrivateKey_file(ctx, key_path.c_str(), SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1)
+    {
+        // Happens in the middle of a renewal too: keep the old pair and retry later
+        log_openssl_error("Can't load private key", key_path);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+
+    SSL_CTX* old;
+    {
+        mutex_locker l(&tls_context_mutex);
+        old = tls_context;
+        tls_context = ctx;
+        tls_context_dir = stls_path;
+        tls_cert_mtime = cert_st.st_mtim;
+        tls_key_mtime = key_st.st_mtim;
+    }
+    if (old) SSL_CTX_free(old);
+
+    MG_INFO(("[TLS] Loaded keypair from [%s]", stls_path.c_str()));
+    return true;
+}
+
+void tls_context_reload_if_changed()
+{
+    std::string dir;
+    struct timespec cert_mtime{ }, key_mtime{ };
+    {
+        mutex_locker l(&tls_context_mutex);
+        if (tls_context_dir.empty()) return;
+        dir = tls_context_dir;
+        cert_mtime = tls_cert_mtime;
+        key_mtime = tls_key_mtime;
+    }
+
+    struct stat cert_st{ }, key_st{ };
+    if (::stat((dir + "cert.pem").c_str(), &cert_st) != 0 || ::stat((dir + "key.pem").c_str(), &key_st) != 0)
+        return; // Files are being replaced right now
+
+    if (same_mtime(cert_st.st_mtim, cert_mtime) && same_mtime(key_st.st_mtim, key_mtime))
+        return;
+
+    MG_INFO(("[TLS] Keypair in [%s] has changed. Reloading...", dir.c_str()));
+    tls_context_load(dir.c_str());
+}
+
+SSL_CTX* tls_context_acquire()
+{
+    mutex_locker l(&tls_context_mutex);
+    if (tls_context) SSL_CTX_up_ref(tls_context);
+    return tls_context;
+}
+
+BIO* tls_ktls_filter_new(BIO* wbio, int fd)
+{
+    if (!tls_ktls || !KTLS_FILTER) return nullptr;
+
+    BIO* filter = BIO_new(ktls_filter_method());
+    if (filter == nullptr) return nullptr;
+    static_cast<ktls_filter*>(BIO_get_data(filter))->fd = fd;
+
+    BIO_up_ref(wbio);
+    return BIO_push(filter, wbio);
+}
+
+bool tls_ktls_send_enabled(SSL* ssl)
+{
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+void tls_count_handshake(SSL* ssl)
+{
+    if (SSL_session_reused(ssl)) ++handshakes_resumed;
+    else ++handshakes_full;
+
+    ktls_filter* kf = ktls_filter_of(ssl);
+    if (kf == nullptr) return; // kTLS is disabled
+    if (kf->send)
+    {
+        ++ktls_send_enabled;
+        return;
+    }
+
+    // Tell once loudly (it's usually a missing 'tls' module or an OpenSSL build without kTLS), then quietly
+    static std::atomic<bool> reported{false};
+    char reason[128];
+    if (!kf->attempted)
+        mg_snprintf(
+            reason, sizeof(reason), "OpenSSL didn't offer keys for %s %s",
+            SSL_get_version(ssl), SSL_get_cipher_name(ssl)
+        );
+    else
+        mg_snprintf(
+            reason, sizeof(reason), "kernel refused %s: %s%s", SSL_get_cipher_name(ssl), strerror(kf->error),
+            kf->error == ENOENT ? " (is the 'tls' module loaded?)" : ""
+        );
+
+    if (!reported.exchange(true)) MG_INFO(("[TLS] kTLS is not available, encrypting in userspace: %s", reason));
+    else MG_DEBUG(("[TLS] kTLS is not available, encrypting in userspace: %s", reason));
+    ++ktls_send_fallback;
+}
+
+void tls_metrics(std::string& out)
+{
+    append_metric(out, "tls_handshakes_resumed", handshakes_resumed);
+    append_metric(out, "tls_handshakes_full", handshakes_full);
+    append_metric(out, "tls_tickets_unknown_key", tickets_unknown_key);
+    append_metric(out, "tls_ktls_send_enabled", ktls_send_enabled);
+    append_metric(out, "tls_ktls_send_fallback", ktls_send_fallback);
+
+    SSL_CTX* ctx = tls_context_acquire();
+    if (ctx == nullptr) return;
+    append_metric(out, "tls_session_cache_size", SSL_CTX_sess_number(ctx));
+    append_metric(out, "tls_session_cache_hits", SSL_CTX_sess_hits(ctx));
+    append_metric(out, "tls_session_cache_misses", SSL_CTX_sess_misses(ctx));
+    SSL_CTX_free(ctx);
+}
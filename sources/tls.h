@@ -0,0 +1,39 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Shared TLS context: the certificate and the key are parsed once
+/// and every accepted https connection reuses them
+
+#ifndef WEBSERVER_TLS_H
+#define WEBSERVER_TLS_H
+
+#include <string>
+#include <openssl/ssl.h>
+
+
+/// Load cert.pem and key.pem from given directory into a new shared context.
+/// On failure the previous context (if any) stays in use
+extern bool tls_context_load(const char* dir);
+
+/// Reload the shared context if cert.pem or key.pem were modified (e.g. renewed by certbot)
+extern void tls_context_reload_if_changed();
+
+/// Get a new reference to the current shared context. Release it with SSL_CTX_free()
+extern SSL_CTX* tls_context_acquire();
+
+/// Wrap the write side of mongoose's transport into a filter that lets OpenSSL
+/// switch the socket to kernel TLS after the handshake. Takes its own reference of wbio.
+/// Returns nullptr if kTLS is disabled
+extern BIO* tls_ktls_filter_new(BIO* wbio, int fd);
+
+/// Check if the kernel encrypts everything sent on this connection, so SSL_sendfile() can be used
+extern bool tls_ktls_send_enabled(SSL* ssl);
+
+/// Count a finished handshake as resumed (session cache or ticket) or full,
+/// and as offloaded to the kernel or not (logging why)
+extern void tls_count_handshake(SSL* ssl);
+
+/// Append session resumption counters to metrics
+extern void tls_metrics(std::string& out);
+
+#endif //WEBSERVER_TLS_H
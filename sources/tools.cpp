@@ -8,7 +8,11 @@
 
 #include "tools.h"
 
+#include <cstdarg>
+#include <cstdio>
+#include <cerrno>
 #include <cstring>
+#include <fcntl.h>
 #include <ftw.h>
 #include <pthread.h>
 #include <linux/limits.h>
@@ -59,6 +63,72 @@ std::string erase_all(const std::string& str, const std::string& seq)
 }
 
 
+std::string string_format(const char* fmt, ...)
+{
+    va_list ap, ap_copy;
+    va_start(ap, fmt);
+    va_copy(ap_copy, ap);
+    int len = vsnprintf(nullptr, 0, fmt, ap_copy);
+    va_end(ap_copy);
+
+    std::string res(len < 0 ? 0 : len, '\0');
+    if (len > 0) vsnprintf(res.data(), res.size() + 1, fmt, ap);
+    va_end(ap);
+    return res;
+}
+
+
+void append_json_string(std::string& out, std::string_view str)
+{
+    out += '"';
+    for (char ch : str)
+    {
+        switch (ch)
+        {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(ch) < 0x20)
+                {
+                    char esc[8];
+                    snprintf(esc, sizeof(esc), "\\u%04x", ch);
+                    out += esc;
+                }
+                else out += ch;
+        }
+    }
+    out += '"';
+}
+
+
+//// Time ////
+
+std::string http_date(time_t t)
+{
+    struct tm tm{ };
+    gmtime_r(&t, &tm);
+    char buf[64];
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buf;
+}
+
+
+bool parse_http_date(std::string_view str, time_t* t)
+{
+    std::string s(str); // strptime() wants it terminated
+    struct tm tm{ };
+    const char* end = strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == nullptr || *end != 0) return false;
+    *t = timegm(&tm);
+    return true;
+}
+
+
 //// Path/FS ////
 
 std::string getcwd()
@@ -155,3 +225,47 @@ std::string FILE_read_all(const std::string& file)
     fclose(f);
     return buf;
 }
+
+bool FILE_write_atomic(const std::string& file, std::string_view data)
+{
+    std::string tmp = file + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return false;
+
+    bool success = true;
+    for (size_t done = 0; success && done < data.size();)
+    {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n > 0) done += static_cast<size_t>(n);
+        else success = n < 0 && errno == EINTR;
+    }
+    success = success && fsync(fd) == 0;
+    close(fd);
+
+    if (!success || rename(tmp.c_str(), file.c_str()) != 0)
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    // The rename itself must reach the disk too
+    std::string dir = path_dirname(file);
+    int dfd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0)
+    {
+        fsync(dfd);
+        close(dfd);
+    }
+    return true;
+}
+
+
+//// Statistics ////
+
+void append_metric(std::string& out, const char* name, unsigned long long value)
+{
+    out += name;
+    out += ' ';
+    out += std::to_string(value);
+    out += '\n';
+}
@@ -5,6 +5,8 @@
 #define WEBSERVER_TOOLS_H
 
 #include <string>
+#include <string_view>
+#include <ctime>
 
 
 class mutex_locker
@@ -34,6 +36,18 @@ extern bool starts_with(const char* str, const char* prefix);
 /// Erase all seq occurrences in str
 extern std::string erase_all(const std::string& str, const std::string& seq);
 
+/// printf into a heap-allocated string of any length
+extern std::string string_format(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/// Append str as a quoted JSON string
+extern void append_json_string(std::string& out, std::string_view str);
+
+/// Format time as HTTP date (RFC 9110 IMF-fixdate): "Sun, 06 Nov 1994 08:49:37 GMT"
+extern std::string http_date(time_t t);
+
+/// Parse HTTP date (IMF-fixdate). Returns false if str is not one
+extern bool parse_http_date(std::string_view str, time_t* t);
+
 /// Get Current Working Directory
 extern std::string getcwd();
 
@@ -55,5 +69,12 @@ extern std::string path_basename(std::string path);
 /// Read the contents of a file into a buffer string
 extern std::string FILE_read_all(const std::string& file);
 
+/// Replace the contents of a file with data so that a crash leaves either the old or the new ones:
+/// write a temporary file, fsync it, rename it over, fsync the directory
+extern bool FILE_write_atomic(const std::string& file, std::string_view data);
+
+/// Append "name value" line to plain text metrics
+extern void append_metric(std::string& out, const char* name, unsigned long long value);
+
 
 #endif //WEBSERVER_TOOLS_H
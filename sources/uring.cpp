@@ -0,0 +1,257 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "uring.h"
+
+#include "constants.h"
+#include "server.h"
+#include "tools.h"
+
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#ifdef HAVE_LIBURING
+# include <liburing.h>
+# include <sys/eventfd.h>
+#endif
+
+
+// Statistics
+static std::atomic<unsigned long long> uring_requests{0}, uring_failures{0}, uring_wait_us{0};
+
+#ifdef HAVE_LIBURING
+
+typedef enum
+{
+    URING_STATX,
+    URING_OPEN,
+    URING_READ
+} uring_stage;
+
+/// Request in flight: which operation it waits for and what the previous ones gave
+typedef struct
+{
+    std::shared_ptr<uring_request> request;
+    uring_stage stage;
+    struct statx stx;
+    struct stat st;
+    int fd;
+    std::string data;
+    size_t got;
+} uring_op;
+
+static struct io_uring uring;
+static int uring_event = -1; // eventfd: new requests were queued
+static uint64_t uring_event_value;
+static std::deque<std::shared_ptr<uring_request>> uring_queue;
+static size_t uring_in_flight = 0; // Only touched by the ring's thread
+static pthread_mutex_t uring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t uring_thread;
+static std::atomic<bool> uring_running{false};
+
+
+/// Re-arm the read that wakes the ring's thread up when requests are queued
+static void uring_watch_queue()
+{
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&uring);
+    io_uring_prep_read(sqe, uring_event, &uring_event_value, sizeof(uring_event_value), 0);
+    io_uring_sqe_set_data(sqe, nullptr);
+}
+
+/// Hand the result over and wake up the connection
+static void uring_finish(uring_op* op, std::shared_ptr<const cached_file> file)
+{
+    uring_request& request = *op->request;
+    if (file == nullptr) ++uring_failures;
+    uring_wait_us += static_cast<unsigned long long>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - request.queued).count()
+    );
+
+    request.file = std::move(file);
+    request.done.store(true, std::memory_order_release);
+    mg_wakeup(request.mgr, request.conn_id, "", 0); // Nobody is there if the connection has closed meanwhile
+
+    delete op;
+    --uring_in_flight;
+}
+
+/// Move queued requests into the ring while there is room
+static void uring_take_requests()
+{
+    mutex_locker l(&uring_mutex);
+    while (!uring_queue.empty() && uring_in_flight < URING_QUEUE_DEPTH - 1) // One entry is for the queue watch
+    {
+        auto* op = new uring_op{.request = std::move(uring_queue.front()), .stage = URING_STATX, .stx = { }, .st = { }, .fd = -1};
+        uring_queue.pop_front();
+        ++uring_in_flight;
+
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&uring);
+        io_uring_prep_statx(sqe, AT_FDCWD, op->request->path.c_str(), AT_STATX_SYNC_AS_STAT, STATX_BASIC_STATS, &op->stx);
+        io_uring_sqe_set_data(sqe, op);
+    }
+}
+
+/// Take the result of op's operation and submit the next one
+static void uring_advance(uring_op* op, int res)
+{
+    const std::string& path = op->request->path;
+    size_t size = static_cast<size_t>(op->st.st_size);
+    struct io_uring_sqe* sqe;
+
+    switch (op->stage)
+    {
+        case URING_STATX:
+            if (res < 0) return uring_finish(op, nullptr);
+            op->st.st_dev = makedev(op->stx.stx_dev_major, op->stx.stx_dev_minor);
+            op->st.st_ino = op->stx.stx_ino;
+            op->st.st_mode = op->stx.stx_mode;
+            op->st.st_nlink = op->stx.stx_nlink;
+            op->st.st_uid = op->stx.stx_uid;
+            op->st.st_gid = op->stx.stx_gid;
+            op->st.st_size = static_cast<off_t>(op->stx.stx_size);
+            op->st.st_mtim = {.tv_sec = op->stx.stx_mtime.tv_sec, .tv_nsec = op->stx.stx_mtime.tv_nsec};
+
+            if (auto file = filecache_find(path, op->st)) return uring_finish(op, std::move(file));
+            if (!S_ISREG(op->st.st_mode)) return uring_finish(op, nullptr);
+
+            op->stage = URING_OPEN;
+            sqe = io_uring_get_sqe(&uring);
+            io_uring_prep_openat(sqe, AT_FDCWD, path.c_str(), O_RDONLY | O_CLOEXEC, 0);
+            break;
+
+        case URING_OPEN:
+            if (res < 0) return uring_finish(op, nullptr);
+            op->fd = res;
+            if (file_cache_size == 0 || size > FILE_CACHE_MAX_FILE_SIZE)
+                return uring_finish(op, filecache_put(path, op->st, op->fd, { })); // Sent from the descriptor
+
+            op->stage = URING_READ;
+            op->data.resize(size);
+            op->got = 0;
+            sqe = io_uring_get_sqe(&uring);
+            io_uring_prep_read(sqe, op->fd, op->data.data(), static_cast<unsigned>(size), 0);
+            break;
+
+        case URING_READ:
+            if (res > 0 && (op->got += static_cast<size_t>(res)) < size)
+            {
+                sqe = io_uring_get_sqe(&uring);
+                io_uring_prep_read(sqe, op->fd, op->data.data() + op->got, static_cast<unsigned>(size - op->got), op->got);
+                break;
+            }
+
+            if (op->got == size)
+            {
+                close(op->fd);
+                return uring_finish(op, filecache_put(path, op->st, -1, std::move(op->data)));
+            }
+            return uring_finish(op, filecache_put(path, op->st, op->fd, { })); // Truncated meanwhile: the descriptor will do
+    }
+    io_uring_sqe_set_data(sqe, op);
+}
+
+static void* uring_thread_loop(void*)
+{
+    uring_watch_queue();
+    io_uring_submit(&uring);
+
+    while (uring_running)
+    {
+        struct io_uring_cqe* cqe;
+        if (io_uring_wait_cqe(&uring, &cqe) < 0) continue; // Interrupted
+
+        do
+        {
+            auto* op = static_cast<uring_op*>(io_uring_cqe_get_data(cqe));
+            int res = cqe->res;
+            io_uring_cqe_seen(&uring, cqe);
+
+            if (op == nullptr) uring_watch_queue();
+            else uring_advance(op, res);
+        } while (io_uring_peek_cqe(&uring, &cqe) == 0);
+
+        uring_take_requests(); // New ones, or the ones that waited for room
+        io_uring_submit(&uring);
+    }
+    return nullptr;
+}
+
+
+bool uring_start()
+{
+    int error = io_uring_queue_init(URING_QUEUE_DEPTH, &uring, 0);
+    if (error < 0)
+    {
+        MG_ERROR(("[URING] Can't set up io_uring (%s): files will be opened synchronously", strerror(-error)));
+        return false;
+    }
+
+    uring_event = eventfd(0, EFD_CLOEXEC);
+    uring_running = uring_event >= 0;
+    if (!uring_running || pthread_create(&uring_thread, nullptr, uring_thread_loop, nullptr) != 0)
+    {
+        MG_ERROR(("[URING] Could not start io_uring thread."));
+        uring_running = false;
+        if (uring_event >= 0) close(uring_event);
+        io_uring_queue_exit(&uring);
+        return false;
+    }
+    return true;
+}
+
+void uring_stop()
+{
+    if (!uring_running) return;
+    uring_running = false;
+    eventfd_write(uring_event, 1);
+    pthread_join(uring_thread, nullptr);
+
+    io_uring_queue_exit(&uring);
+    close(uring_event);
+}
+
+bool uring_enabled() { return uring_running.load(std::memory_order_relaxed); }
+
+bool uring_open(const std::shared_ptr<uring_request>& request)
+{
+    if (!uring_running) return false;
+
+    request->queued = std::chrono::steady_clock::now();
+    request->done = false;
+    ++uring_requests;
+    {
+        mutex_locker l(&uring_mutex);
+        uring_queue.push_back(request);
+    }
+    eventfd_write(uring_event, 1);
+    return true;
+}
+
+#else
+
+bool uring_start()
+{
+    MG_ERROR(("[URING] Built without io_uring support: files will be opened synchronously"));
+    return false;
+}
+
+void uring_stop() { }
+
+bool uring_enabled() { return false; }
+
+bool uring_open(const std::shared_ptr<uring_request>&) { return false; }
+
+#endif
+
+void uring_metrics(std::string& out)
+{
+    append_metric(out, "fs_uring_requests", uring_requests);
+    append_metric(out, "fs_uring_failures", uring_failures);
+    append_metric(out, "fs_uring_wait_us", uring_wait_us);
+}
@@ -0,0 +1,49 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Asynchronous file opening for /dir/ with io_uring. A background thread runs statx, openat
+/// and read for small files through one ring, so a slow disk or a network mount holds up
+/// only the downloads from it, not the event loops. The connection is woken up with
+/// MG_EV_WAKEUP when its file is ready
+
+#ifndef WEBSERVER_URING_H
+#define WEBSERVER_URING_H
+
+#include "filecache.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+
+
+struct mg_mgr;
+
+typedef struct
+{
+    std::string path;
+    struct mg_mgr* mgr;    // Where the connection to wake up lives
+    unsigned long conn_id;
+
+    std::chrono::steady_clock::time_point queued;
+    std::atomic<bool> done;
+    std::shared_ptr<const cached_file> file; // Result (valid once done is set): nullptr if it can't be opened
+} uring_request;
+
+
+/// Set up the ring and start its thread. Returns false (and files are opened synchronously) if that is not possible
+extern bool uring_start();
+
+/// Stop the ring's thread. Requests still in flight are never completed
+extern void uring_stop();
+
+/// Whether files are opened through io_uring: check before building a request
+extern bool uring_enabled();
+
+/// Queue opening request's file. Returns false if io_uring is not running: open it synchronously then
+extern bool uring_open(const std::shared_ptr<uring_request>& request);
+
+/// Append io_uring counters to metrics
+extern void uring_metrics(std::string& out);
+
+#endif //WEBSERVER_URING_H
@@ -4,67 +4,373 @@
 
 
 #include "constants.h"
+#include "journal.h"
+#include "passwd.h"
+#include "server.h"
+#include "timerwheel.h"
 #include "tools.h"
 #include "../mongoose/mongoose.h"
 
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <map>
+#include <memory>
 #include <string>
-#include <bits/local_lim.h>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
 
 
+typedef std::vector<user_entry> user_chunk; // Storage of users, never changes once shared
+typedef std::vector<std::shared_ptr<const user_chunk>> user_chunks;
+
+/// Open addressing hash table of users. Never changes once built. Tables built from each other share
+/// the users themselves, so a rebuild only copies pointers
+typedef struct
+{
+    user_chunks chunks; // Keep users alive
+    std::vector<const user_entry*> users;
+    std::vector<uint32_t> slots; // Index + 1 into users, 0 - empty. Power of 2 in size, at most half full
+} user_table;
+
+/// Registered users as readers see them. Replaced as a whole on every change, so lookups from http workers
+/// and ftp threads take no locks. New users go to the small recent table, which is merged into base
+/// once it outgrows the square root of base's size: a registration doesn't rebuild the whole table
+typedef struct
+{
+    std::shared_ptr<const user_table> base;
+    std::shared_ptr<const user_table> recent;
+} user_directory;
+
+/// Give users[index] its slot. Returns false if the login has one already
+static bool user_table_place(user_table& table, size_t index)
+{
+    size_t mask = table.slots.size() - 1;
+    const std::string& login = table.users[index]->first;
+    size_t i = std::hash<std::string_view>{ }(login) & mask;
+    for (; table.slots[i] != 0; i = (i + 1) & mask)
+        if (table.users[table.slots[i] - 1]->first == login) return false;
+    table.slots[i] = static_cast<uint32_t>(index + 1);
+    return true;
+}
+
+/// Build table of from's users (if any) and users of chunks. Repeated logins are dropped and counted in duplicates
+static std::shared_ptr<const user_table> user_table_build(
+        const user_table* from, const user_chunks& chunks, size_t* duplicates = nullptr
+    )
+{
+    auto table = std::make_shared<user_table>();
+    size_t count = from ? from->users.size() : 0;
+    for (auto& chunk : chunks) count += chunk->size();
+
+    if (from)
+    {
+        table->chunks = from->chunks;
+        table->users = from->users;
+    }
+    table->users.reserve(count);
+
+    size_t size = 2;
+    while (size < count * 2) size <<= 1;
+    if (from && from->slots.size() == size) table->slots = from->slots; // Only new users need their slots
+    else
+    {
+        table->slots.assign(size, 0);
+        for (size_t i = 0; i < table->users.size(); ++i) user_table_place(*table, i);
+    }
+
+    for (auto& chunk : chunks)
+    {
+        for (const user_entry& user : *chunk)
+        {
+            table->users.push_back(&user);
+            if (user_table_place(*table, table->users.size() - 1)) continue;
+            table->users.pop_back();
+            if (duplicates) ++*duplicates;
+        }
+        table->chunks.push_back(chunk);
+    }
+    return table;
+}
+
+static const user_entry* user_table_find(const user_table& table, std::string_view login)
+{
+    size_t mask = table.slots.size() - 1;
+    for (size_t i = std::hash<std::string_view>{ }(login) & mask;; i = (i + 1) & mask)
+    {
+        uint32_t slot = table.slots[i];
+        if (slot == 0) return nullptr;
+        if (table.users[slot - 1]->first == login) return table.users[slot - 1];
+    }
+}
+
+static const user_entry* users_find(const user_directory& directory, std::string_view login)
+{
+    if (const user_entry* user = user_table_find(*directory.recent, login)) return user;
+    return user_table_find(*directory.base, login);
+}
+
+/// Call fn for every user of the directory
+template <typename Fn>
+static void users_for_each(const user_directory& directory, Fn fn)
+{
+    for (const user_entry* user : directory.base->users) fn(*user);
+    for (const user_entry* user : directory.recent->users) fn(*user);
+}
+
 // Users: login, email, password
-static inline __user_map_t registered_users{};
-// Users who just created their account and need to verify their email address
-static inline __pending_user_map_t registered_users_pending{};
+static std::atomic<std::shared_ptr<const user_directory>> registered_users{
+    std::make_shared<const user_directory>(
+        user_directory{.base = user_table_build(nullptr, { }), .recent = user_table_build(nullptr, { })}
+    )
+};
+static std::atomic<unsigned long long> registered_users_version{0}; // Bumped after every change
 
+// Writers to registered_users (http workers, the journal thread) take turns, readers don't wait
+static pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-const __user_map_t* get_registered_users()
+/// User who just created their account and needs to verify their email address.
+/// The timer is the entry itself: an expired node is cast back to it
+typedef struct : timer_node
 {
-    return &registered_users;
+    id_t id;
+    __user_map_t::value_type user;
+    size_t bytes; // Approximate memory taken
+} pending_user;
+
+static std::unordered_map<id_t, pending_user> pending_users;
+static timer_wheel pending_users_expiry; // Ticks of PENDING_USERS_TICK ms
+static bool pending_users_expiry_ready = false;
+static size_t pending_users_bytes = 0;
+// Pending users are accessed from every http worker
+static pthread_mutex_t pending_users_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics
+static std::atomic<unsigned long long> pending_users_added{0}, pending_users_verified{0}, pending_users_expired{0},
+    pending_users_rejected{0};
+
+
+/// Make the directory visible to readers. Caller holds users_mutex
+static void users_publish_locked(std::shared_ptr<const user_table> base, std::shared_ptr<const user_table> recent)
+{
+    registered_users.store(
+        std::make_shared<const user_directory>(user_directory{.base = std::move(base), .recent = std::move(recent)}),
+        std::memory_order_release
+    );
+    registered_users_version.fetch_add(1, std::memory_order_release);
 }
 
-bool load_users()
+/// Current users for lookups. Every thread holds on to its own reference and only takes a new one
+/// after a change, so readers don't even share a reference count. Valid until the thread's next call
+static const user_directory& users_current()
 {
-    MG_DEBUG(("[USERS] Loading users from file[" CONFIG_DIR "passwd" "]..."));
-    FILE* file = ::fopen(CONFIG_DIR "passwd", "rb"); // Open users file
-    if (file)
+    thread_local std::shared_ptr<const user_directory> directory;
+    thread_local unsigned long long version = ~0ULL;
+
+    unsigned long long current = registered_users_version.load(std::memory_order_acquire);
+    if (version != current)
     {
-        bool success = true;
-        while (!::feof(file))
+        directory = registered_users.load(std::memory_order_acquire);
+        version = current;
+    }
+    return *directory;
+}
+
+/// Add user unless the login is taken. Caller holds users_mutex
+static bool users_insert_locked(user_entry user)
+{
+    std::shared_ptr<const user_directory> directory = registered_users.load(std::memory_order_acquire);
+    if (users_find(*directory, user.first) != nullptr) return false;
+
+    auto recent = user_table_build(directory->recent.get(), {std::make_shared<const user_chunk>(1, std::move(user))});
+    size_t base_size = std::max<size_t>(directory->base->users.size(), USERS_RECENT_MIN_SIZE * USERS_RECENT_MIN_SIZE);
+    if (recent->users.size() * recent->users.size() <= base_size) users_publish_locked(directory->base, std::move(recent));
+    else users_publish_locked(user_table_build(directory->base.get(), recent->chunks), user_table_build(nullptr, { }));
+    return true;
+}
+
+
+/// Parse passwd
+static bool load_users_text();
+
+static bool save_users_covering(uint64_t* covered);
+
+/// Journal record of a new user: "A<login>\0<email>\0<password>"
+static std::string user_record(const __user_map_t::value_type& user)
+{
+    std::string record = "A";
+    record += user.first;
+    record += '\0';
+    record += user.second.first;
+    record += '\0';
+    record += user.second.second;
+    return record;
+}
+
+/// Apply journal record. Caller holds users_mutex
+static void apply_user_record(std::string_view record)
+{
+    if (!record.starts_with('A')) return; // Unknown kind of change
+    record.remove_prefix(1);
+
+    size_t email = record.find('\0');
+    size_t password = email == std::string_view::npos ? email : record.find('\0', email + 1);
+    if (password == std::string_view::npos) return;
+
+    // Might be in passwd already, if the process died between the snapshot and the journal compaction
+    users_insert_locked(
         {
-            char username[HOST_NAME_MAX + 1]{};
-            char email[HOST_NAME_MAX + 1]{};
-            char password[HOST_NAME_MAX + 1]{};
-            if (::fscanf(file, "%s : %s : %s\n", username, email, password) == 3) // Scan line in format "<user> : <email> : <password>\n"
-                // Store user's credentials in a map
-                success = success && registered_users.insert({username, {email, password}}).second;
+            std::string(record.substr(0, email)),
+            {std::string(record.substr(email + 1, password - email - 1)), std::string(record.substr(password + 1))}
         }
-        ::fclose(file);
+    );
+}
+
+
+bool user_exists(const std::string& login)
+{
+    return users_find(users_current(), login) != nullptr;
+}
+
+std::string find_user_password(const std::string& login)
+{
+    const user_entry* user = users_find(users_current(), login);
+    return user == nullptr ? std::string() : user->second.second;
+}
+
+/// Load users from passwd.bin if it is intact and made from passwd described by st
+static bool load_users_snapshot(const struct stat& st)
+{
+    std::vector<user_entry> users;
+    if (!passwd_snapshot_read(CONFIG_DIR "passwd.bin", st, users)) return false;
+
+    mutex_locker l(&users_mutex);
+    users_publish_locked(
+        user_table_build(nullptr, {std::make_shared<const user_chunk>(std::move(users))}), user_table_build(nullptr, { })
+    );
+    return true;
+}
+
+bool load_users()
+{
+    struct stat st{ };
+    bool success = ::stat(CONFIG_DIR "passwd", &st) == 0;
+    if (success && load_users_snapshot(st))
+        MG_DEBUG(("[USERS] Loaded users from snapshot [" CONFIG_DIR "passwd.bin" "]"));
+    else if (success)
+    {
+        success = load_users_text();
+        // Make the snapshot, so the next start is faster
+        std::string records;
+        uint64_t count = 0;
+        bool snapshot = true;
+        users_for_each(
+            *registered_users.load(std::memory_order_acquire), [&](const user_entry& reg_user)
+            {
+                snapshot = snapshot && passwd_snapshot_append(records, reg_user);
+                ++count;
+            }
+        );
+        if (!snapshot || !passwd_snapshot_write(CONFIG_DIR "passwd.bin", std::move(records), count, st))
+            MG_ERROR(("[USERS] Could not write snapshot [" CONFIG_DIR "passwd.bin" "]"));
+    }
+
+    // Then everything registered since passwd was written
+    bool journal = journal_open(
+        CONFIG_DIR "passwd.journal", [](std::string_view record)
+        {
+            mutex_locker l(&users_mutex);
+            apply_user_record(record);
+        }, [](uint64_t& covered) { return save_users_covering(&covered); }
+    );
+    return success && journal;
+}
+
+/// Parse passwd
+static bool load_users_text()
+{
+    MG_DEBUG(("[USERS] Loading users from file[" CONFIG_DIR "passwd" "]..."));
+    std::vector<user_entry> users;
+    bool success = passwd_read(CONFIG_DIR "passwd", users);
+    if (success)
+    {
+        size_t duplicates = 0;
+        mutex_locker l(&users_mutex);
+        users_publish_locked(
+            user_table_build(nullptr, {std::make_shared<const user_chunk>(std::move(users))}, &duplicates),
+            user_table_build(nullptr, { })
+        );
+        success = duplicates == 0;
         MG_DEBUG(("[USERS] Success = %d", success));
-        return success;
     }
-    return false;
+    return success;
 }
 
-bool save_users()
+/// Write passwd and the snapshot. covered (if given) is set to the journal position the saved users correspond to
+static bool save_users_covering(uint64_t* covered)
 {
     MG_DEBUG(("[USERS] Saving all users to file [" CONFIG_DIR "passwd" "]..."));
-    FILE* file = ::fopen(CONFIG_DIR "passwd", "wb");
-    if (!file) return false;
-    for (auto& reg_user : registered_users)
-        ::fprintf(file, "%s : %s : %s\n", reg_user.first.c_str(), reg_user.second.first.c_str(), reg_user.second.second.c_str());
-    ::fclose(file);
+    std::shared_ptr<const user_directory> directory;
+    {
+        // New users are appended to the journal and published in one go under users_mutex
+        mutex_locker l(&users_mutex);
+        directory = registered_users.load(std::memory_order_acquire);
+        if (covered) *covered = journal_position();
+    }
+
+    std::string data, records;
+    uint64_t count = 0;
+    bool snapshot = true;
+    users_for_each(
+        *directory, [&](const user_entry& reg_user)
+        {
+            data += reg_user.first + " : " + reg_user.second.first + " : " + reg_user.second.second + "\n";
+            snapshot = snapshot && passwd_snapshot_append(records, reg_user);
+            ++count;
+        }
+    );
+
+    struct stat st{ };
+    if (!FILE_write_atomic(CONFIG_DIR "passwd", data) || ::stat(CONFIG_DIR "passwd", &st) != 0)
+    {
+        MG_ERROR(("[USERS] Could not save users to [" CONFIG_DIR "passwd" "]: %s", strerror(errno)));
+        return false;
+    }
+    // passwd is what counts: a missing or failed snapshot only makes the next start slower
+    if (!snapshot || !passwd_snapshot_write(CONFIG_DIR "passwd.bin", std::move(records), count, st))
+        MG_ERROR(("[USERS] Could not write snapshot [" CONFIG_DIR "passwd.bin" "]"));
     MG_DEBUG(("[USERS] Saved."));
     return true;
 }
 
+bool save_users() { return save_users_covering(nullptr); }
+
+void close_users() { journal_close(); }
 
-bool add_new_user(const __user_map_t::value_type& user_data)
+
+new_user_result add_new_user(const __user_map_t::value_type& user_data, std::function<void(bool)> synced)
 {
-    auto user = registered_users.insert(user_data);
-    MG_DEBUG(("Insert Success? = %d", user.second));
-    return user.second && save_users();
+    mutex_locker l(&users_mutex);
+    if (users_find(*registered_users.load(std::memory_order_acquire), user_data.first) != nullptr)
+    {
+        MG_DEBUG(("Insert Success? = 0"));
+        return NEW_USER_EXISTS;
+    }
+
+    // Only the new user goes to the disk. It is published right away, so the login is taken at once,
+    // but whoever registered it hears back through synced
+    if (!journal_append(user_record(user_data), std::move(synced))) return NEW_USER_NOT_SAVED;
+    users_insert_locked(user_data);
+    MG_DEBUG(("Insert Success? = 1"));
+    return NEW_USER_ADDED;
 }
 
 
@@ -75,15 +381,17 @@ void forward_users(fineftp::FtpServer& ftp_server)
     std::string cwd(getcwd());
     cwd += '/';
 
-    for (const auto& reg_user : registered_users)
-    {
-        std::string root_dir = cwd + reg_user.first;
-        if (mkdir_p(root_dir))
+    users_for_each(
+        *registered_users.load(std::memory_order_acquire), [&](const user_entry& reg_user)
         {
-            MG_DEBUG(("[FTP] Adding user \"%s\" to ftp server...", reg_user.first.c_str()));
-            ftp_server.addUser(reg_user.first, reg_user.second.second, root_dir, fineftp::Permission::All);
+            std::string root_dir = cwd + reg_user.first;
+            if (mkdir_p(root_dir))
+            {
+                MG_DEBUG(("[FTP] Adding user \"%s\" to ftp server...", reg_user.first.c_str()));
+                ftp_server.addUser(reg_user.first, reg_user.second.second, root_dir, fineftp::Permission::All);
+            }
         }
-    }
+    );
 }
 
 void add_user(fineftp::FtpServer& ftp_server, const __user_map_t::value_type& reg_user)
@@ -99,22 +407,112 @@ void add_user(fineftp::FtpServer& ftp_server, const __user_map_t::value_type& re
 #endif
 
 
+/// Current tick of the pending users' wheel
+static uint64_t pending_users_now()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now).count()) / PENDING_USERS_TICK;
+}
+
+/// Drop pending user. Caller holds pending_users_mutex
+static void pending_users_erase_locked(std::unordered_map<id_t, pending_user>::iterator it)
+{
+    timer_wheel_remove(pending_users_expiry, &it->second);
+    pending_users_bytes -= it->second.bytes;
+    pending_users.erase(it);
+}
+
+/// Room for another pending user of the given size. Caller holds pending_users_mutex
+static bool pending_users_fit_locked(size_t bytes)
+{
+    return pending_users.size() < PENDING_USERS_MAX_COUNT && pending_users_bytes + bytes <= PENDING_USERS_MAX_MEMORY;
+}
+
 bool pending_id_exists(id_t id)
 {
-    return registered_users_pending.contains(id);
+    mutex_locker l(&pending_users_mutex);
+    return pending_users.contains(id);
+}
+
+bool pending_users_full()
+{
+    mutex_locker l(&pending_users_mutex);
+    return !pending_users_fit_locked(0);
 }
 
 bool add_pending_user(id_t id, const __user_map_t::value_type& user)
 {
-    return registered_users_pending.insert({id, user}).second;
+    size_t bytes = sizeof(pending_user) + 4 * sizeof(void*) /* hash table node */ +
+        user.first.size() + user.second.first.size() + user.second.second.size();
+
+    mutex_locker l(&pending_users_mutex);
+    if (!pending_users_fit_locked(bytes))
+    {
+        ++pending_users_rejected;
+        return false;
+    }
+
+    auto [it, inserted] = pending_users.try_emplace(id, pending_user{{ }, id, user, bytes});
+    if (!inserted) return false;
+
+    if (!pending_users_expiry_ready)
+    {
+        timer_wheel_init(pending_users_expiry, pending_users_now());
+        pending_users_expiry_ready = true;
+    }
+
+    pending_users_bytes += bytes;
+    uint64_t ttl = (static_cast<uint64_t>(std::max(pending_ttl, 0L)) * 1000 + PENDING_USERS_TICK - 1) / PENDING_USERS_TICK;
+    timer_wheel_add(pending_users_expiry, &it->second, pending_users_now() + ttl);
+    ++pending_users_added;
+    return true;
+}
+
+std::optional<__user_map_t::value_type> take_pending_user(id_t id)
+{
+    mutex_locker l(&pending_users_mutex);
+    auto it = pending_users.find(id);
+    if (it == pending_users.end()) return std::nullopt;
+
+    // Could be due, but the timer hasn't come yet
+    if (it->second.expires <= pending_users_now())
+    {
+        ++pending_users_expired;
+        pending_users_erase_locked(it);
+        return std::nullopt;
+    }
+
+    auto user = std::move(it->second.user);
+    pending_users_erase_locked(it);
+    ++pending_users_verified;
+    return user;
 }
 
-__pending_user_map_t::iterator find_pending_user(id_t id)
+void expire_pending_users()
 {
-    return registered_users_pending.find(id);
+    std::vector<timer_node*> expired;
+    mutex_locker l(&pending_users_mutex);
+    if (!pending_users_expiry_ready) return;
+
+    timer_wheel_advance(pending_users_expiry, pending_users_now(), expired);
+    for (timer_node* node : expired)
+    {
+        auto it = pending_users.find(static_cast<pending_user*>(node)->id);
+        pending_users_bytes -= it->second.bytes;
+        pending_users.erase(it); // The timer is out of the wheel already
+        ++pending_users_expired;
+    }
+    if (!expired.empty()) MG_DEBUG(("[USERS] %zu pending registrations expired", expired.size()));
 }
 
-__pending_user_map_t::iterator pending_user_invalid()
+void pending_users_metrics(std::string& out)
 {
-    return registered_users_pending.end();
+    append_metric(out, "pending_users_added", pending_users_added);
+    append_metric(out, "pending_users_verified", pending_users_verified);
+    append_metric(out, "pending_users_expired", pending_users_expired);
+    append_metric(out, "pending_users_rejected", pending_users_rejected);
+
+    mutex_locker l(&pending_users_mutex);
+    append_metric(out, "pending_users", pending_users.size());
+    append_metric(out, "pending_users_bytes", pending_users_bytes);
 }
@@ -4,25 +4,43 @@
 #define USERS_H
 
 #include "settings.h"
+#include <functional>
 #include <map>
+#include <optional>
 #include <fineftp/server.h>
 
 typedef id_t uint32_t;
 typedef std::map<std::string, std::pair<std::string, std::string>> __user_map_t;
-typedef std::map<id_t, __user_map_t::value_type> __pending_user_map_t;
 
 
-/// Get a map of registered users
-extern const __user_map_t* get_registered_users();
+/// Check if a user with given login is registered
+extern bool user_exists(const std::string& login);
 
-// Load user credentials from passwd file
+/// Stored password (hash) of the user, empty if there is no such user
+extern std::string find_user_password(const std::string& login);
+
+// Load user credentials from passwd file and the journal of later registrations
 extern bool load_users();
 
-// Save user credentials to passwd file
+// Save user credentials to passwd file (atomically)
 extern bool save_users();
 
-// Add new user and save all
-extern bool add_new_user(const __user_map_t::value_type& user_data);
+// Sync the journal and close it
+extern void close_users();
+
+/// What add_new_user() did with the user
+typedef enum
+{
+    NEW_USER_ADDED,
+    NEW_USER_EXISTS,   // The login is taken
+    NEW_USER_NOT_SAVED // The journal refused it: the user is not registered
+} new_user_result;
+
+// Add new user and append it to the journal. synced is called (from the journal's thread) once it's on the disk,
+// only if the user was added
+extern new_user_result add_new_user(
+        const __user_map_t::value_type& user_data, std::function<void(bool)> synced = nullptr
+    );
 
 
 #ifdef ENABLE_FILESYSTEM_ACCESS
@@ -36,9 +54,17 @@ extern void add_user(fineftp::FtpServer& ftp_server, const __user_map_t::value_t
 #endif
 
 
+/// Pending users wait for their email to be verified for pending_ttl seconds at most
 extern bool pending_id_exists(id_t id);
+/// Returns false if the id is taken or there are too many pending users already
 extern bool add_pending_user(id_t id, const __user_map_t::value_type& user);
-extern __pending_user_map_t::iterator find_pending_user(id_t id);
-extern __pending_user_map_t::iterator pending_user_invalid();
+/// Tell if there is no room for another pending user
+extern bool pending_users_full();
+/// Remove pending user and give its data (empty if no such id or it has expired)
+extern std::optional<__user_map_t::value_type> take_pending_user(id_t id);
+/// Drop pending users whose time is up. Called every PENDING_USERS_TICK ms
+extern void expire_pending_users();
+/// Append pending users counters to metrics
+extern void pending_users_metrics(std::string& out);
 
 #endif //USERS_H
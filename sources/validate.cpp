@@ -0,0 +1,57 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+#include "validate.h"
+
+#include "settings.h"
+
+#include <regex>
+
+
+// Patterns the hand-written matchers implement: an overridden pattern goes to std::regex instead
+static constexpr std::string_view default_regex_login = "^[a-zA-Z0-9_]*$";
+static constexpr std::string_view default_regex_email = R"(^[a-zA-Z0-9_.+-]+@[a-zA-Z0-9-]+\.[a-zA-Z0-9-.]+$)";
+
+static constexpr bool is_alnum(char ch)
+{
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9');
+}
+
+bool valid_login(std::string_view login)
+{
+    if constexpr (std::string_view(REGEX_LOGIN) == default_regex_login)
+    {
+        for (char ch : login)
+            if (!is_alnum(ch) && ch != '_') return false;
+        return true;
+    }
+    else
+    {
+        static const std::regex regex(REGEX_LOGIN, std::regex::optimize); // Compiled once
+        return std::regex_match(login.begin(), login.end(), regex);
+    }
+}
+
+bool valid_email(std::string_view email)
+{
+    if constexpr (std::string_view(REGEX_EMAIL) == default_regex_email)
+    {
+        // <local: [a-zA-Z0-9_.+-]+> @ <label: [a-zA-Z0-9-]+> . <rest: [a-zA-Z0-9.-]+>
+        size_t at = email.find('@');
+        if (at == 0 || at == std::string_view::npos) return false;
+        for (char ch : email.substr(0, at))
+            if (!is_alnum(ch) && ch != '_' && ch != '.' && ch != '+' && ch != '-') return false;
+
+        std::string_view domain = email.substr(at + 1);
+        size_t dot = domain.find('.'); // The label can't have dots: the first one ends it
+        if (dot == 0 || dot == std::string_view::npos || dot + 1 == domain.size()) return false;
+        for (char ch : domain)
+            if (!is_alnum(ch) && ch != '-' && ch != '.') return false;
+        return true;
+    }
+    else
+    {
+        static const std::regex regex(REGEX_EMAIL, std::regex::optimize); // Compiled once
+        return std::regex_match(email.begin(), email.end(), regex);
+    }
+}
@@ -0,0 +1,20 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Registration input formats. The default REGEX_LOGIN and REGEX_EMAIL are matched by hand,
+/// in one linear pass without allocations. Patterns overridden through the macros go to
+/// std::regex, compiled once
+
+#ifndef WEBSERVER_VALIDATE_H
+#define WEBSERVER_VALIDATE_H
+
+#include <string_view>
+
+
+/// Check login against REGEX_LOGIN
+extern bool valid_login(std::string_view login);
+
+/// Check email against REGEX_EMAIL
+extern bool valid_email(std::string_view email);
+
+#endif //WEBSERVER_VALIDATE_H
@@ -0,0 +1,27 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Bare checks for the tests: a failed one is reported and the test exits with 1 in the end
+
+#ifndef WEBSERVER_TESTS_CHECK_H
+#define WEBSERVER_TESTS_CHECK_H
+
+#include <cstdio>
+
+
+inline int check_failures = 0;
+
+#define CHECK(cond)                                                                       \
+    do                                                                                    \
+    {                                                                                     \
+        if (!(cond))                                                                      \
+        {                                                                                 \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);      \
+            ++check_failures;                                                             \
+        }                                                                                 \
+    } while (0)
+
+/// Exit code of the test
+#define CHECK_RESULT() (check_failures == 0 ? 0 : 1)
+
+#endif //WEBSERVER_TESTS_CHECK_H
@@ -0,0 +1,84 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Directory listing cache: hits, invalidation on changes, and listings too big for the cache,
+/// which are kept aside within DIR_CACHE_LARGE_SIZE (built with a small one)
+
+#include "check.h"
+#include "../sources/dirlist.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+unsigned long long dir_cache_size = 4096; // A listing of a hundred files doesn't fit
+
+static std::string root;
+
+static unsigned long long metric(const char* name)
+{
+    std::string metrics;
+    dirlist_metrics(metrics);
+    size_t at = metrics.find(std::string(name) + ' ');
+    return at == std::string::npos ? ~0ULL : std::stoull(metrics.substr(at + strlen(name) + 1));
+}
+
+static std::string make_dir(const std::string& name, int files)
+{
+    std::string dir = root + "/" + name;
+    CHECK(mkdir(dir.c_str(), 0755) == 0);
+    for (int i = 0; i < files; ++i)
+        close(open((dir + "/a-file-with-a-rather-long-name-number-" + std::to_string(i)).c_str(), O_CREAT | O_WRONLY, 0644));
+    return dir;
+}
+
+
+static void test_cached_until_changed()
+{
+    std::string dir = make_dir("small", 2);
+    auto first = dirlist_get(dir);
+    CHECK(first != nullptr && first->entries.size() == 2);
+    CHECK(dirlist_get(dir + "/") == first); // Same key with the slash
+
+    close(open((dir + "/new").c_str(), O_CREAT | O_WRONLY, 0644));
+    auto changed = dirlist_get(dir);
+    CHECK(changed != first && changed->entries.size() == 3);
+    CHECK(dirlist_get(dir) == changed);
+}
+
+static void test_large_listings()
+{
+    std::string a = make_dir("large-a", 150), b = make_dir("large-b", 150);
+
+    // Too big for the cache, but read once all the same
+    auto listing = dirlist_get(a);
+    CHECK(listing != nullptr && listing->entries.size() == 150);
+    CHECK(dirlist_get(a) == listing);
+    CHECK(metric("dir_cache_large_listings") == 1);
+    CHECK(metric("dir_cache_large_bytes") <= DIR_CACHE_LARGE_SIZE);
+
+    // Two of them don't fit: the older one goes, small listings stay
+    auto small = dirlist_get(root + "/small");
+    CHECK(dirlist_get(b) != nullptr);
+    CHECK(metric("dir_cache_large_listings") == 1);
+    CHECK(dirlist_get(a) != listing);
+    CHECK(dirlist_get(root + "/small") == small);
+}
+
+
+int main()
+{
+    char dir[] = "/tmp/dirlist_test.XXXXXX";
+    if (mkdtemp(dir) == nullptr) return 1;
+    root = dir;
+
+    test_cached_until_changed();
+    test_large_listings();
+
+    CHECK(system(("rm -rf " + root).c_str()) == 0);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// A storm of 404s: the cached error page send_error_html() sends against formatting the page with mg_http_reply()
+/// for every request, the way it was done before. Both must send the same status line and page
+
+#include "check.h"
+#include "../sources/response.h"
+#include "../sources/settings.h"
+#include "../mongoose/mongoose.h"
+#include "../resources.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+
+#define BENCH_REQUESTS 200000
+
+
+/// What went to the send buffer, without the headers in between
+static std::string status_and_body(const struct mg_connection& connection)
+{
+    std::string sent(reinterpret_cast<const char*>(connection.send.buf), connection.send.len);
+    size_t status_end = sent.find("\r\n"), head_end = sent.find("\r\n\r\n");
+    if (status_end == std::string::npos || head_end == std::string::npos) return { };
+    return sent.substr(0, status_end) + '\n' + sent.substr(head_end + 4);
+}
+
+static void old_send_error_html(struct mg_connection* connection, int code, const char* color, const char* msg)
+{
+    mg_http_reply(
+        connection, code, "Content-Type: text/html\r\n", RESOURCE(error_html),
+        color, color, color, color, code, mg_http_status_code_str(code), msg
+    );
+}
+
+static void new_send_error_html(struct mg_connection* connection, int code, const char* color, const char* msg)
+{
+    http_send_rendered(connection, error_page(code, color, msg));
+}
+
+
+int main()
+{
+    // No socket: responses only go to the send buffer, which is emptied after each one like a write would
+    struct mg_connection connection{ };
+
+    old_send_error_html(&connection, COLORED_ERROR(404), "");
+    std::string formatted = status_and_body(connection);
+    connection.send.len = 0;
+    new_send_error_html(&connection, COLORED_ERROR(404), "");
+    std::string cached = status_and_body(connection);
+    connection.send.len = 0;
+    CHECK(!formatted.empty());
+    CHECK(formatted == cached);
+    CHECK(cached.compare(0, 22, "HTTP/1.1 404 Not Found") == 0);
+
+    auto bench = [&](const char* name, auto send)
+    {
+        size_t bytes = 0;
+        auto started = std::chrono::steady_clock::now();
+        for (int i = 0; i < BENCH_REQUESTS; ++i)
+        {
+            send(&connection, COLORED_ERROR(404), "");
+            bytes += connection.send.len;
+            connection.send.len = 0;
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count() /
+            BENCH_REQUESTS;
+        printf("%-14s %8.1f ns per 404 (%zu bytes)\n", name, ns, bytes / BENCH_REQUESTS);
+        return ns;
+    };
+    double old_ns = bench("mg_http_reply", old_send_error_html);
+    double new_ns = bench("cached page", new_send_error_html);
+    printf("%.2fx\n", old_ns / new_ns);
+
+    mg_iobuf_free(&connection.send);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,132 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Filesystem request paths: confinement to the working directory, and no heap allocations on the way
+
+#include "check.h"
+#include "../sources/fsrequest.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+
+
+// Every heap allocation of the process goes through here
+static size_t allocations = 0;
+
+void* operator new(size_t size)
+{
+    ++allocations;
+    if (void* p = malloc(size == 0 ? 1 : size)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+
+/// Request with only uri (and head, which must be left alone) set. Points into uri, nothing is copied
+static struct mg_http_message request(std::string_view uri)
+{
+    struct mg_http_message msg{ };
+    msg.uri = mg_str_n(uri.data(), uri.size());
+    msg.head = msg.uri;
+    return msg;
+}
+
+static bool parse(fs_request& r, std::string_view uri, std::string_view prefix = "/dir/")
+{
+    struct mg_http_message msg = request(uri);
+    return fs_request_parse(r, &msg, prefix);
+}
+
+
+static void test_uri_tail()
+{
+    struct mg_http_message msg = request("/verify/12345");
+    CHECK(uri_tail(&msg, "/verify/") == "12345");
+    CHECK(uri_tail(&msg, "/resources/").empty());
+    CHECK(uri_tail(&msg, "/verify/12345").empty());
+}
+
+static void test_resolves()
+{
+    fs_request r;
+    CHECK(parse(r, "/dir/file.txt"));
+    CHECK(std::string_view(r.path) == "/file.txt" && r.path_len == 9);
+    CHECK(std::string_view(r.decoded_path) == "/file.txt");
+    CHECK(S_ISREG(r.st.st_mode) && r.st.st_size == 5);
+    CHECK(std::string_view(r.msg.uri.buf, r.msg.uri.len) == "/file.txt");
+    CHECK(std::string_view(r.msg.head.buf, r.msg.head.len) == "/dir/file.txt"); // Still the original request
+
+    CHECK(parse(r, "/dir/"));
+    CHECK(std::string_view(r.decoded_path) == "/" && S_ISDIR(r.st.st_mode));
+
+    CHECK(parse(r, "/api/dir/sub", "/api/dir/"));
+    CHECK(std::string_view(r.decoded_path) == "/sub" && S_ISDIR(r.st.st_mode));
+
+    CHECK(parse(r, "/dir/sub/inner%20name.txt"));
+    CHECK(std::string_view(r.path) == "/sub/inner%20name.txt");
+    CHECK(std::string_view(r.decoded_path) == "/sub/inner name.txt" && S_ISREG(r.st.st_mode));
+}
+
+static void test_confined()
+{
+    fs_request r;
+    CHECK(!parse(r, "/dir/../file.txt"));
+    CHECK(!parse(r, "/dir/sub/../../file.txt"));
+    CHECK(!parse(r, "/dir/%2e%2e/file.txt"));       // Encoded '..'
+    CHECK(!parse(r, "/dir/sub/%2E%2E/file.txt"));
+    CHECK(!parse(r, "/dir/sub%2f%2e%2e/file.txt")); // Encoded '/..'
+    CHECK(!parse(r, "/dir/missing"));
+    CHECK(!parse(r, "/dir/%zz"));                   // Not %XX
+    CHECK(!parse(r, "/dir/" + std::string(MG_PATH_MAX, 'a')));
+}
+
+static void test_no_allocations()
+{
+    static const std::string_view uris[] = {
+        "/dir/file.txt", "/dir/", "/dir/sub/inner%20name.txt", "/dir/%2e%2e/file.txt", "/dir/missing", "/dir/%zz"
+    };
+
+    fs_request r;
+    size_t before = allocations;
+    for (int i = 0; i < 1000; ++i)
+        for (auto uri : uris)
+        {
+            struct mg_http_message msg = request(uri);
+            fs_request_parse(r, &msg, "/dir/");
+            uri_tail(&msg, "/dir/");
+        }
+    CHECK(allocations == before);
+}
+
+
+int main()
+{
+    char dir[] = "/tmp/fsrequest_test.XXXXXX";
+    if (mkdtemp(dir) == nullptr || chdir(dir) != 0) return 1;
+
+    // Paths are resolved relative to the working directory
+    int fd = open("file.txt", O_CREAT | O_WRONLY, 0644);
+    CHECK(fd >= 0 && write(fd, "hello", 5) == 5);
+    close(fd);
+    CHECK(mkdir("sub", 0755) == 0);
+    close(open("sub/inner name.txt", O_CREAT | O_WRONLY, 0644));
+
+    test_uri_tail();
+    test_resolves();
+    test_confined();
+    test_no_allocations();
+
+    unlink("sub/inner name.txt");
+    rmdir("sub");
+    unlink("file.txt");
+    rmdir(dir);
+    return CHECK_RESULT();
+}
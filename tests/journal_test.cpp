@@ -0,0 +1,215 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Journal: replay, torn and corrupt tails, acknowledgements after the sync, compaction
+
+#include "check.h"
+#include "../sources/journal.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <pthread.h>
+#include <sys/stat.h>
+
+
+static std::string journal_file;
+
+static std::vector<std::string> records_of(std::initializer_list<const char*> records)
+{
+    return {records.begin(), records.end()};
+}
+
+/// Open the journal and return the records it replays
+static std::vector<std::string> journal_reopen(
+        std::function<bool(uint64_t&)> snapshot = [](uint64_t&) { return false; }
+    )
+{
+    std::vector<std::string> records;
+    CHECK(journal_open(journal_file.c_str(), [&](std::string_view record) { records.emplace_back(record); }, snapshot));
+    return records;
+}
+
+static off_t journal_file_size()
+{
+    struct stat st{ };
+    return ::stat(journal_file.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+/// Write bytes behind the journal's back, as a crash in the middle of an append leaves them
+static void journal_file_append(const void* data, size_t size)
+{
+    int fd = open(journal_file.c_str(), O_WRONLY | O_APPEND);
+    CHECK(fd >= 0 && write(fd, data, size) == static_cast<ssize_t>(size));
+    close(fd);
+}
+
+static bool wait_for(const std::function<bool()>& condition)
+{
+    for (int i = 0; i < 500 && !condition(); ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return condition();
+}
+
+
+static void test_acknowledged_after_sync()
+{
+    unlink(journal_file.c_str());
+    journal_reopen();
+
+    pthread_t appender = pthread_self();
+    std::atomic<int> synced{0}, durable{0}, from_appender{0};
+    for (int i = 0; i < 3; ++i)
+        CHECK(journal_append(
+            "record " + std::to_string(i), [&](bool ok)
+            {
+                if (pthread_equal(pthread_self(), appender)) ++from_appender; // Not synced yet while appending
+                durable += ok;
+                ++synced;
+            }
+        ));
+    CHECK(wait_for([&] { return synced == 3; }));
+    CHECK(durable == 3);
+    CHECK(from_appender == 0);
+    journal_close();
+
+    CHECK(journal_reopen() == records_of({"record 0", "record 1", "record 2"}));
+    journal_close();
+}
+
+static void test_torn_tail()
+{
+    unlink(journal_file.c_str());
+    journal_reopen();
+    CHECK(journal_append("alpha"));
+    CHECK(journal_append("beta"));
+    journal_close();
+    off_t intact = journal_file_size();
+
+    // Header of a record that never got written in full
+    uint32_t header[2] = {100, 0};
+    journal_file_append(header, sizeof(header));
+    journal_file_append("gamm", 4);
+
+    CHECK(journal_reopen() == records_of({"alpha", "beta"}));
+    CHECK(journal_file_size() == intact);
+    CHECK(journal_append("delta")); // Goes right after the intact part
+    journal_close();
+
+    CHECK(journal_reopen() == records_of({"alpha", "beta", "delta"}));
+    journal_close();
+
+    // Half a header
+    journal_file_append(header, 3);
+    CHECK(journal_reopen() == records_of({"alpha", "beta", "delta"}));
+    journal_close();
+}
+
+static void test_corrupt_tail()
+{
+    unlink(journal_file.c_str());
+    journal_reopen();
+    CHECK(journal_append("alpha"));
+    CHECK(journal_append("omega"));
+    journal_close();
+
+    // Flip the last byte of the last record: its CRC doesn't match anymore
+    int fd = open(journal_file.c_str(), O_RDWR);
+    off_t last = journal_file_size() - 1;
+    char ch = 0;
+    CHECK(pread(fd, &ch, 1, last) == 1);
+    ch ^= 0x20;
+    CHECK(pwrite(fd, &ch, 1, last) == 1);
+    close(fd);
+
+    CHECK(journal_reopen() == records_of({"alpha"}));
+    journal_close();
+}
+
+/// Records appended while the snapshot is taken must survive the compaction, either in it or in the journal,
+/// and get acknowledged even if nothing is appended after them
+static void test_compaction_keeps_later_records()
+{
+    unlink(journal_file.c_str());
+
+    // Stands for the owner: its state and the lock it appends under
+    static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static std::vector<std::string> state, saved;
+    state.clear();
+    saved.clear();
+    std::atomic<int> snapshots{0}, appended{0}, synced{0}, durable{0};
+    std::string padding(100, 'x');
+
+    auto append = [&](const std::string& record)
+    {
+        pthread_mutex_lock(&state_mutex);
+        CHECK(journal_append(
+            record, [&](bool ok)
+            {
+                durable += ok;
+                ++synced;
+            }
+        ));
+        ++appended;
+        state.push_back(record);
+        pthread_mutex_unlock(&state_mutex);
+    };
+
+    journal_reopen(
+        [&](uint64_t& covered)
+        {
+            pthread_mutex_lock(&state_mutex);
+            saved = state;
+            covered = journal_position();
+            pthread_mutex_unlock(&state_mutex);
+            // Comes in while the snapshot is written: the last one may be followed by nothing
+            append("snapshot " + std::to_string(snapshots) + padding);
+            std::this_thread::sleep_for(std::chrono::milliseconds(5)); // Writing it takes a while
+            ++snapshots;
+            return true;
+        }
+    );
+
+    for (int i = 0; i < 400; ++i)
+    {
+        append(std::to_string(i) + padding);
+        if (i % 20 == 0) std::this_thread::sleep_for(std::chrono::milliseconds(3));
+    }
+    CHECK(wait_for([&] { return snapshots > 0; }));
+    CHECK(wait_for([&] { return synced == appended; }));
+    CHECK(durable == appended);
+    journal_close();
+
+    std::vector<std::string> replayed = journal_reopen();
+    journal_close();
+    CHECK(replayed.size() < state.size()); // Compacted at all
+
+    // Snapshot and journal together hold every record, the journal continuing where the snapshot ends
+    CHECK(saved.size() + replayed.size() >= state.size());
+    size_t first = state.size() - replayed.size();
+    CHECK(first <= saved.size());
+    CHECK(std::equal(replayed.begin(), replayed.end(), state.begin() + static_cast<std::ptrdiff_t>(first)));
+}
+
+
+int main()
+{
+    char dir[] = "/tmp/journal_test.XXXXXX";
+    if (mkdtemp(dir) == nullptr) return 1;
+    journal_file = std::string(dir) + "/journal";
+
+    test_acknowledged_after_sync();
+    test_torn_tail();
+    test_corrupt_tail();
+    test_compaction_keeps_later_records();
+
+    unlink(journal_file.c_str());
+    rmdir(dir);
+    return CHECK_RESULT();
+}
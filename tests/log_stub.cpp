@@ -0,0 +1,26 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// The modules log through mongoose: the tests only need errors, and without the rest of mongoose
+
+#include "../mongoose/mongoose.h"
+
+#include <cstdarg>
+#include <cstdio>
+
+
+int mg_log_level = MG_LL_ERROR;
+
+void mg_log_prefix(int ll, const char* file, int line, const char* fname)
+{
+    fprintf(stderr, "[%d] %s:%d %s: ", ll, file, line, fname);
+}
+
+void mg_log(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
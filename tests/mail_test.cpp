@@ -0,0 +1,288 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Mail queue against an SMTP stub on 127.0.0.1: delivery, retries with backoff after a refused message,
+/// giving up after MAIL_MAX_ATTEMPTS (built with short delays) and the counters of all that
+
+#include "check.h"
+#include "../sources/mail.h"
+#include "../sources/tools.h"
+#include "../mongoose/mongoose.h"
+
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <curl/curl.h>
+
+
+/// Message the stub got, whether it took it or not
+typedef struct
+{
+    std::string auth; // AUTH PLAIN credentials, base64
+    std::string from, to, data;
+    uint64_t at;      // When the data was complete (mg_millis)
+    bool accepted;
+} smtp_transaction;
+
+static int smtp_listener = -1;
+static uint16_t smtp_port;
+static std::thread smtp_acceptor;
+static std::vector<std::thread> smtp_sessions;
+static std::atomic<bool> smtp_stopping{false};
+
+static pthread_mutex_t smtp_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<smtp_transaction> smtp_transactions;
+static int smtp_rejects = 0; // Messages to turn down with 451 before taking any
+
+
+static bool smtp_reply(int fd, const char* reply)
+{
+    return write(fd, reply, strlen(reply)) == static_cast<ssize_t>(strlen(reply));
+}
+
+/// Next line without CRLF. false once the client is gone
+static bool smtp_read_line(int fd, std::string& buffer, std::string& line)
+{
+    size_t end;
+    char chunk[4096];
+    while ((end = buffer.find("\r\n")) == std::string::npos)
+    {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) return false;
+        buffer.append(chunk, static_cast<size_t>(n));
+    }
+    line = buffer.substr(0, end);
+    buffer.erase(0, end + 2);
+    return true;
+}
+
+/// Address in "MAIL FROM:<address> ..." and "RCPT TO:<address>"
+static std::string smtp_address(const std::string& line)
+{
+    size_t open = line.find('<'), close = line.find('>');
+    return open == std::string::npos || close < open ? std::string() : line.substr(open + 1, close - open - 1);
+}
+
+/// Just enough of RFC 5321 (and AUTH PLAIN) for curl, any number of messages per connection
+static void smtp_session(int fd)
+{
+    std::string buffer, line;
+    smtp_transaction transaction{ };
+    smtp_reply(fd, "220 stub ESMTP\r\n");
+    while (smtp_read_line(fd, buffer, line))
+    {
+        std::string command = line.substr(0, 4);
+        for (char& ch : command) ch = static_cast<char>(toupper(ch));
+
+        if (command == "EHLO" || command == "HELO") smtp_reply(fd, "250-stub\r\n250 AUTH PLAIN\r\n");
+        else if (command == "AUTH")
+        {
+            // "AUTH PLAIN <credentials>", or the credentials come on their own line
+            if (line.size() > 11) transaction.auth = line.substr(11);
+            else if (!smtp_reply(fd, "334 \r\n") || !smtp_read_line(fd, buffer, transaction.auth)) break;
+            smtp_reply(fd, "235 2.7.0 Authentication successful\r\n");
+        }
+        else if (command == "MAIL")
+        {
+            transaction.from = smtp_address(line);
+            smtp_reply(fd, "250 2.1.0 Ok\r\n");
+        }
+        else if (command == "RCPT")
+        {
+            transaction.to = smtp_address(line);
+            smtp_reply(fd, "250 2.1.5 Ok\r\n");
+        }
+        else if (command == "DATA")
+        {
+            smtp_reply(fd, "354 End data with <CR><LF>.<CR><LF>\r\n");
+            transaction.data.clear();
+            while (smtp_read_line(fd, buffer, line) && line != ".") transaction.data += line + "\n";
+
+            transaction.at = mg_millis();
+            {
+                mutex_locker l(&smtp_mutex);
+                transaction.accepted = smtp_rejects == 0;
+                if (!transaction.accepted) --smtp_rejects;
+                smtp_transactions.push_back(transaction);
+            }
+            smtp_reply(fd, transaction.accepted ? "250 2.0.0 Ok: queued\r\n" : "451 4.3.0 Try again later\r\n");
+        }
+        else if (command == "RSET" || command == "NOOP") smtp_reply(fd, "250 2.0.0 Ok\r\n");
+        else if (command == "QUIT")
+        {
+            smtp_reply(fd, "221 2.0.0 Bye\r\n");
+            break;
+        }
+        else smtp_reply(fd, "502 5.5.2 Error: command not recognized\r\n");
+    }
+    close(fd);
+}
+
+static bool smtp_start()
+{
+    struct sockaddr_in addr{.sin_family = AF_INET, .sin_port = 0, .sin_addr = {htonl(INADDR_LOOPBACK)}, .sin_zero{ }};
+    socklen_t len = sizeof(addr);
+    smtp_listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (smtp_listener < 0 ||
+        bind(smtp_listener, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        listen(smtp_listener, 16) != 0 ||
+        getsockname(smtp_listener, reinterpret_cast<struct sockaddr*>(&addr), &len) != 0)
+        return false;
+    smtp_port = ntohs(addr.sin_port);
+
+    smtp_acceptor = std::thread(
+        []
+        {
+            int fd;
+            while ((fd = accept4(smtp_listener, nullptr, nullptr, SOCK_CLOEXEC)) >= 0 || errno == EINTR)
+                if (fd >= 0 && !smtp_stopping) smtp_sessions.emplace_back(smtp_session, fd);
+        }
+    );
+    return true;
+}
+
+/// Stop once the queue is stopped: its connections are closed by then
+static void smtp_stop()
+{
+    smtp_stopping = true;
+    shutdown(smtp_listener, SHUT_RDWR);
+    smtp_acceptor.join();
+    close(smtp_listener);
+    for (auto& session : smtp_sessions) session.join();
+}
+
+static std::vector<smtp_transaction> smtp_taken()
+{
+    mutex_locker l(&smtp_mutex);
+    std::vector<smtp_transaction> taken;
+    taken.swap(smtp_transactions);
+    return taken;
+}
+
+static size_t smtp_count()
+{
+    mutex_locker l(&smtp_mutex);
+    return smtp_transactions.size();
+}
+
+
+static unsigned long long metric(const char* name)
+{
+    std::string metrics = "\n";
+    mail_metrics(metrics);
+    size_t at = metrics.find("\n" + std::string(name) + ' ');
+    return at == std::string::npos ? ~0ULL : std::stoull(metrics.substr(at + strlen(name) + 2));
+}
+
+static bool wait_for(const std::function<bool()>& condition)
+{
+    for (int i = 0; i < 1000 && !condition(); ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return condition();
+}
+
+
+static void test_delivery()
+{
+    unsigned long long sent = metric("mail_sent"), queued = metric("mail_queued");
+    CHECK(mail_enqueue("user@example.com", "Confirm registration", "Open this link"));
+    CHECK(wait_for([] { return smtp_count() == 1; }));
+    CHECK(wait_for([] { return metric("mail_pending") == 0; }));
+
+    auto transactions = smtp_taken();
+    CHECK(transactions.size() == 1);
+    if (transactions.size() != 1) return;
+    CHECK(transactions[0].accepted);
+    CHECK(transactions[0].auth == "AHNlcnZlckBleGFtcGxlLmNvbQBzZWNyZXQ="); // "\0server@example.com\0secret"
+    CHECK(transactions[0].from == "server@example.com");
+    CHECK(transactions[0].to == "user@example.com");
+    CHECK(transactions[0].data.find("To: user@example.com\n") != std::string::npos);
+    CHECK(transactions[0].data.find("From: server@example.com\n") != std::string::npos);
+    CHECK(transactions[0].data.find("Subject: Confirm registration\n") != std::string::npos);
+    CHECK(transactions[0].data.find("\n\nOpen this link\n") != std::string::npos);
+
+    CHECK(metric("mail_sent") == sent + 1);
+    CHECK(metric("mail_queued") == queued + 1);
+}
+
+/// Refused once: sent again MAIL_RETRY_DELAY later
+static void test_retry()
+{
+    unsigned long long sent = metric("mail_sent"), retried = metric("mail_retried"), failed = metric("mail_failed");
+    {
+        mutex_locker l(&smtp_mutex);
+        smtp_rejects = 1;
+    }
+    CHECK(mail_enqueue("retry@example.com", "Retry", "Again"));
+    CHECK(wait_for([] { return metric("mail_pending") == 0; }));
+
+    auto transactions = smtp_taken();
+    CHECK(transactions.size() == 2);
+    if (transactions.size() != 2) return;
+    CHECK(!transactions[0].accepted && transactions[1].accepted);
+    CHECK(transactions[1].to == "retry@example.com");
+    CHECK(transactions[1].at - transactions[0].at >= MAIL_RETRY_DELAY);
+
+    CHECK(metric("mail_sent") == sent + 1);
+    CHECK(metric("mail_retried") == retried + 1);
+    CHECK(metric("mail_failed") == failed);
+}
+
+/// Refused every time: the delay doubles after every attempt, the message is dropped after the last one
+static void test_give_up()
+{
+    unsigned long long sent = metric("mail_sent"), retried = metric("mail_retried"), failed = metric("mail_failed");
+    {
+        mutex_locker l(&smtp_mutex);
+        smtp_rejects = MAIL_MAX_ATTEMPTS + 1;
+    }
+    CHECK(mail_enqueue("never@example.com", "Never", "Lost"));
+    CHECK(wait_for([] { return metric("mail_pending") == 0; }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(MAIL_RETRY_DELAY << MAIL_MAX_ATTEMPTS)); // No more attempts
+
+    auto transactions = smtp_taken();
+    CHECK(transactions.size() == MAIL_MAX_ATTEMPTS);
+    for (size_t i = 1; i < transactions.size(); ++i)
+    {
+        CHECK(!transactions[i].accepted);
+        CHECK(transactions[i].at - transactions[i - 1].at >= static_cast<uint64_t>(MAIL_RETRY_DELAY) << (i - 1));
+    }
+
+    CHECK(metric("mail_sent") == sent);
+    CHECK(metric("mail_retried") == retried + MAIL_MAX_ATTEMPTS - 1);
+    CHECK(metric("mail_failed") == failed + 1);
+    {
+        mutex_locker l(&smtp_mutex);
+        smtp_rejects = 0;
+    }
+}
+
+
+int main()
+{
+    if (!smtp_start()) return 1;
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    std::string server = "smtp://127.0.0.1:" + std::to_string(smtp_port);
+    CHECK(mail_queue_start(server.c_str(), "server@example.com", "secret"));
+
+    test_delivery();
+    test_retry();
+    test_give_up();
+
+    mail_queue_stop();
+    CHECK(!mail_enqueue("late@example.com", "Late", "Stopped"));
+    curl_global_cleanup();
+    smtp_stop();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,6 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Mongoose for the tests that need more of it than logging, built the way server.cpp builds it
+
+#include "../mongoose/mongoose.c"
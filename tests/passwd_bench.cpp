@@ -0,0 +1,101 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Startup with a million users: passwd parsed as text against its snapshot mapped into memory.
+/// Both must give the same users, and a snapshot that is damaged or older than passwd must be refused
+
+#include "check.h"
+#include "../sources/passwd.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+
+
+#define BENCH_USERS 1000000
+
+static std::string passwd_file, snapshot_file;
+
+/// i-th user, as registration would make them (the password is an scrypt hash)
+static user_entry user_at(size_t i)
+{
+    std::string n = std::to_string(i);
+    return {"user" + n, {"user" + n + "@mail.example.com", "$7$C6..../....sWzOk9wMJrKAl8ntoQBYnUbQAAEN1/" + n + "$Nm7PFJ"}};
+}
+
+/// Users read back are the ones written, in the same order
+static bool same_users(const std::vector<user_entry>& users)
+{
+    if (users.size() != BENCH_USERS) return false;
+    for (size_t i = 0; i < users.size(); ++i)
+        if (users[i] != user_at(i)) return false;
+    return true;
+}
+
+template <typename Load>
+static double bench(const char* name, Load load)
+{
+    std::vector<user_entry> users;
+    auto started = std::chrono::steady_clock::now();
+    CHECK(load(users));
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    CHECK(same_users(users));
+    printf("%-10s %8.3f s for %d users\n", name, seconds, BENCH_USERS);
+    return seconds;
+}
+
+
+int main()
+{
+    char dir[] = "/tmp/passwd_bench.XXXXXX";
+    if (mkdtemp(dir) == nullptr) return 1;
+    passwd_file = std::string(dir) + "/passwd";
+    snapshot_file = std::string(dir) + "/passwd.bin";
+
+    // Written the way save_users() does it
+    std::string data, records;
+    for (size_t i = 0; i < BENCH_USERS; ++i)
+    {
+        user_entry user = user_at(i);
+        data += user.first + " : " + user.second.first + " : " + user.second.second + "\n";
+        CHECK(passwd_snapshot_append(records, user));
+    }
+    FILE* file = fopen(passwd_file.c_str(), "wb");
+    CHECK(file && fwrite(data.data(), 1, data.size(), file) == data.size());
+    if (file) fclose(file);
+    data = { };
+    struct stat st{ };
+    CHECK(::stat(passwd_file.c_str(), &st) == 0);
+    CHECK(passwd_snapshot_write(snapshot_file.c_str(), std::move(records), BENCH_USERS, st));
+
+    bench("text", [](std::vector<user_entry>& users) { return passwd_read(passwd_file.c_str(), users); });
+    bench(
+        "snapshot", [&](std::vector<user_entry>& users)
+        {
+            return passwd_snapshot_read(snapshot_file.c_str(), st, users);
+        }
+    );
+
+    // passwd changed after the snapshot was made
+    std::vector<user_entry> users;
+    struct stat newer = st;
+    ++newer.st_mtim.tv_sec;
+    CHECK(!passwd_snapshot_read(snapshot_file.c_str(), newer, users));
+
+    // A flipped byte in the records
+    int fd = open(snapshot_file.c_str(), O_RDWR);
+    char ch = 0;
+    CHECK(pread(fd, &ch, 1, 1000) == 1);
+    ch ^= 1;
+    CHECK(pwrite(fd, &ch, 1, 1000) == 1);
+    close(fd);
+    CHECK(!passwd_snapshot_read(snapshot_file.c_str(), st, users));
+
+    unlink(passwd_file.c_str());
+    unlink(snapshot_file.c_str());
+    rmdir(dir);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,82 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Rate limiter: bursts, the shared limit, and clients forgotten to make room.
+/// Built with a table of a single set, so the fifth client evicts somebody
+
+#include "check.h"
+#include "../sources/ratelimit.h"
+#include "../mongoose/mongoose.h"
+
+#include <cstring>
+
+
+// Slow enough that no token comes back while the test runs
+rate_limit rate_limits[RATE_CLASS_COUNT] = {
+    {.per_minute = 1, .burst = 3, .global_per_minute = 0},
+    {.per_minute = 1, .burst = 3, .global_per_minute = 6}
+};
+
+static struct mg_addr client(uint32_t n)
+{
+    struct mg_addr addr{ };
+    memcpy(addr.ip, &n, sizeof(n));
+    return addr;
+}
+
+/// Requests of the client admitted out of tries
+static int admitted(uint32_t n, int tries, rate_class cls = RATE_REGISTER)
+{
+    int count = 0;
+    for (int i = 0; i < tries; ++i) count += rate_admit(client(n), cls, nullptr) == RATE_ADMITTED;
+    return count;
+}
+
+
+static void test_burst()
+{
+    CHECK(admitted(1, 5) == 3);
+    unsigned retry_after = 0;
+    CHECK(rate_admit(client(1), RATE_REGISTER, &retry_after) == RATE_TOO_MANY);
+    CHECK(retry_after == 60); // A token a minute
+    CHECK(admitted(2, 5) == 3); // Others are not affected
+}
+
+static void test_eviction()
+{
+    // Clients 1 and 2 are there already: fill the rest of the set
+    CHECK(admitted(3, 1) == 1);
+    CHECK(admitted(4, 1) == 1);
+
+    // A newcomer into the full table gets a single request, not a burst
+    CHECK(admitted(5, 3) == 1);
+
+    // Cycling through addresses to flush buckets wins a request per address at most
+    for (uint32_t n = 100; n < 200; ++n) CHECK(admitted(n, 3) == 1);
+
+    // Client 1 spent its burst before being forgotten: coming back doesn't refill it
+    CHECK(admitted(1, 3) == 1);
+}
+
+static void test_global()
+{
+    // The shared bucket holds a second's worth: 6 per minute rounds up to 1
+    CHECK(admitted(1000, 1, RATE_VERIFY) == 1);
+    CHECK(rate_admit(client(1001), RATE_VERIFY, nullptr) == RATE_OVERLOADED);
+    // Not the client's fault: its token is given back once the others stop
+    rate_limits[RATE_VERIFY].global_per_minute = 0;
+    CHECK(admitted(1001, 5, RATE_VERIFY) == 1); // In a full table: a single request
+}
+
+
+int main()
+{
+    test_burst();
+    test_eviction();
+    test_global();
+
+    std::string metrics;
+    ratelimit_metrics(metrics);
+    CHECK(metrics.find("rate_evictions") != std::string::npos);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,99 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Lookup time with a thousand routes: the router against mg_match() over every pattern in turn,
+/// the way requests were dispatched before. Both must pick the same route for every uri
+
+#include "check.h"
+#include "../sources/router.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+#define BENCH_ROUTES 1000
+
+// Which kind of route answered
+static void literal_route(struct mg_connection*, struct mg_http_message*) { }
+static void wildcard_route(struct mg_connection*, struct mg_http_message*) { }
+static void rest_route(struct mg_connection*, struct mg_http_message*) { }
+static void post_route(struct mg_connection*, struct mg_http_message*) { }
+
+typedef struct
+{
+    std::string pattern;
+    path_handler_function fn;
+} bench_route;
+
+/// First pattern that matches, like the old handler list
+static path_handler_function linear_find(const std::vector<bench_route>& routes, struct mg_str uri)
+{
+    for (const auto& route : routes)
+        if (mg_match(uri, mg_str_n(route.pattern.data(), route.pattern.size()), nullptr)) return route.fn;
+    return nullptr;
+}
+
+static void test_precedence()
+{
+    path_handler_function fn = nullptr;
+    CHECK(router_find(mg_str("/api/v1/res7/items"), mg_str("GET"), &fn) == ROUTE_FOUND && fn == literal_route);
+    CHECK(router_find(mg_str("/api/v1/res7/items/42"), mg_str("GET"), &fn) == ROUTE_FOUND && fn == wildcard_route);
+    CHECK(router_find(mg_str("/static7/a/b/c.css"), mg_str("GET"), &fn) == ROUTE_FOUND && fn == rest_route);
+    CHECK(router_find(mg_str("/submit7"), mg_str("POST"), &fn) == ROUTE_FOUND && fn == post_route);
+    CHECK(router_find(mg_str("/submit7"), mg_str("GET"), &fn) == ROUTE_METHOD_NOT_ALLOWED);
+    CHECK(router_find(mg_str("/api/v1/res7"), mg_str("GET"), &fn) == ROUTE_NOT_FOUND);
+    CHECK(router_find(mg_str("/nowhere"), mg_str("GET"), &fn) == ROUTE_NOT_FOUND);
+}
+
+
+int main()
+{
+    std::vector<bench_route> routes;
+    std::vector<std::string> uris;
+    for (int i = 0; i < BENCH_ROUTES / 4; ++i)
+    {
+        std::string n = std::to_string(i);
+        routes.push_back({"/api/v1/res" + n + "/items", literal_route});
+        routes.push_back({"/api/v1/res" + n + "/items/*", wildcard_route});
+        routes.push_back({"/static" + n + "/#", rest_route});
+        uris.push_back("/api/v1/res" + n + "/items");
+        uris.push_back("/api/v1/res" + n + "/items/" + std::to_string(i * 7));
+        uris.push_back("/static" + n + "/css/site.css");
+        uris.push_back("/missing" + n);
+    }
+    for (const auto& route : routes) router_add(route.pattern, ROUTE_ANY, route.fn);
+    for (int i = 0; i < BENCH_ROUTES / 4; ++i)
+        router_add("/submit" + std::to_string(i), ROUTE_POST, post_route); // Not among the GETs below
+
+    int different = 0;
+    for (const auto& uri : uris)
+    {
+        path_handler_function fn = nullptr;
+        if (router_find(mg_str_n(uri.data(), uri.size()), mg_str("GET"), &fn) != ROUTE_FOUND) fn = nullptr;
+        different += fn != linear_find(routes, mg_str_n(uri.data(), uri.size()));
+    }
+    CHECK(different == 0);
+    test_precedence();
+
+    auto bench = [&](const char* name, int rounds, auto find)
+    {
+        size_t found = 0;
+        auto started = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; ++r)
+            for (const auto& uri : uris) found += find(mg_str_n(uri.data(), uri.size())) != nullptr;
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count() /
+            (static_cast<double>(rounds) * uris.size());
+        printf("%-8s %10.1f ns per request (%zu routes, %zu found)\n", name, ns, routes.size() + BENCH_ROUTES / 4, found);
+    };
+    bench("mg_match", 5, [&](struct mg_str uri) { return linear_find(routes, uri); });
+    bench(
+        "router", 500, [](struct mg_str uri)
+        {
+            path_handler_function fn = nullptr;
+            return router_find(uri, mg_str("GET"), &fn) == ROUTE_FOUND ? fn : nullptr;
+        }
+    );
+    return CHECK_RESULT();
+}
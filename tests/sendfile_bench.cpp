@@ -0,0 +1,127 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Throughput of file bodies sent with sendfile_step() through an event loop that works like mongoose's:
+/// a socket is polled for writing only while something is buffered, the poll timeout is a second.
+/// Fails if the transfer ever waits for the timeout or the peer gets other bytes than the file has
+
+#include "check.h"
+#include "../sources/sendfile.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+
+#define BENCH_FILE_SIZE (256 << 20)
+#define BENCH_BUFFER_SIZE 2048 // MG_IO_SIZE
+#define BENCH_CHUNK_SIZE 1048576 // SENDFILE_CHUNK_SIZE
+
+/// Send the file to a reader thread. Returns MB/s
+static double bench_transfer(const char* name, int file, uint64_t expected, sendfile_fn send)
+{
+    // Over loopback TCP, like a client on the same host
+    int listener = socket(AF_INET, SOCK_STREAM, 0), sockets[2];
+    struct sockaddr_in addr{.sin_family = AF_INET, .sin_port = 0, .sin_addr = {htonl(INADDR_LOOPBACK)}, .sin_zero{ }};
+    socklen_t addr_len = sizeof(addr);
+    CHECK(bind(listener, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0 && listen(listener, 1) == 0);
+    getsockname(listener, reinterpret_cast<struct sockaddr*>(&addr), &addr_len);
+    sockets[1] = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(connect(sockets[1], reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0);
+    sockets[0] = accept(listener, nullptr, nullptr);
+    close(listener);
+    fcntl(sockets[0], F_SETFL, fcntl(sockets[0], F_GETFL) | O_NONBLOCK);
+
+    uint64_t received = 0, sum = 0;
+    std::thread reader(
+        [&]
+        {
+            std::vector<unsigned char> data(1 << 16);
+            ssize_t n;
+            while ((n = read(sockets[1], data.data(), data.size())) > 0)
+            {
+                sum = crc32(sum, data.data(), static_cast<uInt>(n));
+                received += static_cast<uint64_t>(n);
+            }
+        }
+    );
+
+    char buf[BENCH_BUFFER_SIZE];
+    size_t len = 0;
+    file_range range{.fd = file, .offset = 0, .left = BENCH_FILE_SIZE};
+    sendfile_state state = SENDFILE_MORE;
+    int timeouts = 0, polls = 0;
+    void* socket = reinterpret_cast<void*>(static_cast<intptr_t>(sockets[0]));
+
+    auto started = std::chrono::steady_clock::now();
+    while (state == SENDFILE_MORE || len > 0)
+    {
+        // The response starts on MG_EV_WRITE of the headers, goes on with every poll
+        if (state == SENDFILE_MORE) state = sendfile_step(range, send, socket, BENCH_CHUNK_SIZE, buf, &len, sizeof(buf));
+        if (state == SENDFILE_FAILED || (state == SENDFILE_DONE && len == 0)) break;
+
+        struct pollfd pfd{.fd = sockets[0], .events = static_cast<short>(len > 0 ? POLLOUT : 0), .revents = 0};
+        ++polls;
+        if (poll(&pfd, 1, 1000) == 0 && state == SENDFILE_MORE) ++timeouts; // Nothing would wake mongoose up
+        if (pfd.revents & POLLOUT)
+        {
+            ssize_t n = write(sockets[0], buf, len);
+            if (n > 0)
+            {
+                memmove(buf, buf + n, len - static_cast<size_t>(n));
+                len -= static_cast<size_t>(n);
+            }
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    close(sockets[0]);
+    reader.join();
+    close(sockets[1]);
+
+    CHECK(state == SENDFILE_DONE);
+    CHECK(timeouts == 0);
+    CHECK(received == BENCH_FILE_SIZE);
+    CHECK(sum == expected);
+
+    double mbps = BENCH_FILE_SIZE / seconds / (1 << 20);
+    printf("%-10s %8.1f MB/s  %d polls, %d timeouts\n", name, mbps, polls, timeouts);
+    return mbps;
+}
+
+
+int main()
+{
+    char path[] = "/tmp/sendfile_bench.XXXXXX";
+    int file = mkstemp(path);
+    if (file < 0) return 1;
+    unlink(path);
+
+    std::vector<unsigned char> data(BENCH_FILE_SIZE);
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    for (auto& byte : data)
+    {
+        seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+        byte = static_cast<unsigned char>(seed);
+    }
+    CHECK(write(file, data.data(), data.size()) == static_cast<ssize_t>(data.size()));
+    uint64_t expected = crc32(0, data.data(), static_cast<uInt>(data.size()));
+    data = { };
+
+    bench_transfer("sendfile", file, expected, sendfile_socket);
+    bench_transfer("copy", file, expected, nullptr);
+
+    close(file);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,181 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// The server binary run by the benchmarks that talk to it over HTTP, and a bare HTTP/1.1 client for them.
+/// Responses are read by their Content-Length, as the server always sends one
+
+#ifndef WEBSERVER_TESTS_SERVER_PROCESS_H
+#define WEBSERVER_TESTS_SERVER_PROCESS_H
+
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+
+typedef struct
+{
+    pid_t pid;
+    uint16_t port; // Of its http listener on 127.0.0.1
+} server_process;
+
+
+/// Port nobody listens on right now
+inline uint16_t free_port()
+{
+    struct sockaddr_in addr{.sin_family = AF_INET, .sin_port = 0, .sin_addr = {htonl(INADDR_LOOPBACK)}, .sin_zero{ }};
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return 0;
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) != 0)
+        addr.sin_port = 0;
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+/// Blocking connection to 127.0.0.1:port that gives up on reads after timeout_s. Returns -1 if it can't connect
+inline int http_connect(uint16_t port, int timeout_s = 10)
+{
+    struct sockaddr_in addr{.sin_family = AF_INET, .sin_port = htons(port), .sin_addr = {htonl(INADDR_LOOPBACK)}, .sin_zero{ }};
+    int on = 1, fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    struct timeval timeout{.tv_sec = timeout_s, .tv_usec = 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline bool http_write(int fd, const std::string& request)
+{
+    for (size_t done = 0; done < request.size();)
+    {
+        ssize_t n = write(fd, request.data() + done, request.size() - done);
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/// Read one response from fd. Returns its status (-1 if the connection broke or timed out), the body goes to body.
+/// buffer keeps what came after the response: pipelined responses are read one by one through it
+inline int http_read(int fd, std::string& buffer, std::string* body = nullptr)
+{
+    char chunk[16384];
+    size_t head_end;
+    while ((head_end = buffer.find("\r\n\r\n")) == std::string::npos)
+    {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) return -1;
+        buffer.append(chunk, static_cast<size_t>(n));
+    }
+
+    int status = -1;
+    if (sscanf(buffer.c_str(), "HTTP/1.%*d %d", &status) != 1) return -1;
+
+    size_t length = 0;
+    for (size_t line = buffer.find("\r\n") + 2; line < head_end; line = buffer.find("\r\n", line) + 2)
+        if (strncasecmp(buffer.c_str() + line, "Content-Length:", 15) == 0)
+            length = strtoull(buffer.c_str() + line + 15, nullptr, 10);
+
+    while (buffer.size() < head_end + 4 + length)
+    {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) return -1;
+        buffer.append(chunk, static_cast<size_t>(n));
+    }
+    if (body != nullptr) body->assign(buffer, head_end + 4, length);
+    buffer.erase(0, head_end + 4 + length);
+    return status;
+}
+
+/// Send request over fd and wait for its response
+inline int http_exchange(int fd, const std::string& request, std::string* body = nullptr)
+{
+    std::string buffer;
+    return http_write(fd, request) ? http_read(fd, buffer, body) : -1;
+}
+
+inline std::string http_get_request(const std::string& uri)
+{
+    return "GET " + uri + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+}
+
+/// Value of name in the server's /metrics, -1 if it is not there
+inline long long server_metric(const server_process& server, const std::string& name)
+{
+    int fd = http_connect(server.port);
+    std::string body;
+    if (fd < 0) return -1;
+    int status = http_exchange(fd, http_get_request("/metrics"), &body);
+    close(fd);
+
+    body.insert(0, "\n"); // Every line starts after one
+    size_t at = body.find("\n" + name + " ");
+    if (status != 200 || at == std::string::npos) return -1;
+    return strtoll(body.c_str() + at + name.size() + 2, nullptr, 10);
+}
+
+/// Run binary (with the given options after the listening address) in dir, which becomes its web root.
+/// Waits until it answers. Returns false if it exits or doesn't listen within 10 s
+inline bool server_start(
+        server_process& server, const char* binary, const std::string& dir, const std::vector<std::string>& options
+    )
+{
+    server.port = free_port();
+    std::string address = "http://127.0.0.1:" + std::to_string(server.port);
+    std::vector<const char*> argv{binary, "--http_address", address.c_str(), "--loglevel", "1"};
+    for (const auto& option : options) argv.push_back(option.c_str());
+    argv.push_back(nullptr);
+
+    server.pid = fork();
+    if (server.pid < 0) return false;
+    if (server.pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        if (chdir(dir.c_str()) != 0 || null < 0) _exit(127);
+        dup2(null, STDOUT_FILENO); // Its banner
+        execv(binary, const_cast<char* const*>(argv.data()));
+        _exit(127);
+    }
+
+    for (int i = 0; i < 500; ++i)
+    {
+        if (waitpid(server.pid, nullptr, WNOHANG) == server.pid) return false;
+        int fd = http_connect(server.port);
+        if (fd >= 0)
+        {
+            close(fd);
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    kill(server.pid, SIGKILL);
+    waitpid(server.pid, nullptr, 0);
+    return false;
+}
+
+/// Stop the server the way an operator would and wait for it to exit
+inline void server_stop(server_process& server)
+{
+    kill(server.pid, SIGTERM);
+    waitpid(server.pid, nullptr, 0);
+}
+
+#endif //WEBSERVER_TESTS_SERVER_PROCESS_H
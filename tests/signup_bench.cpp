@@ -0,0 +1,135 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Event loop latency during a burst of registrations. Every signup costs a password hash of tens of
+/// milliseconds, made on the hashing threads: a connection asking for '/' over and over must be answered
+/// about as fast as when the server is idle. Runs the server binary given as the argument (one event loop,
+/// no verification email, registration rate limits out of the way). Fails if a signup doesn't get through or
+/// a request for '/' waited for a good part of the burst, as it would if the loop made the hashes itself
+
+#include "check.h"
+#include "server_process.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+
+#define BENCH_SIGNUPS 64        // Registrations sent at once
+#define BENCH_IDLE_MS 500       // How long '/' is asked for before the burst
+#define BENCH_PROBE_INTERVAL 5  // ms between requests for '/'
+
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+/// Ask for '/' over fd every BENCH_PROBE_INTERVAL ms until done (or until deadline, if it is given)
+static std::vector<double> probe(
+        int fd, const std::atomic<bool>& done, int& unanswered,
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()
+    )
+{
+    std::vector<double> latencies;
+    std::string request = http_get_request("/"), buffer;
+    while (!done && std::chrono::steady_clock::now() < deadline)
+    {
+        auto sent = std::chrono::steady_clock::now();
+        if (!http_write(fd, request) || http_read(fd, buffer) != 200) ++unanswered;
+        else latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent).count());
+        std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_PROBE_INTERVAL));
+    }
+    std::sort(latencies.begin(), latencies.end());
+    return latencies;
+}
+
+static void print_latencies(const char* name, const std::vector<double>& sorted)
+{
+    printf(
+        "%-6s '/' p50 %7.2f ms  p99 %7.2f ms  max %7.2f ms  (%zu requests)\n",
+        name, percentile(sorted, 0.5), percentile(sorted, 0.99), sorted.empty() ? 0 : sorted.back(), sorted.size()
+    );
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <server binary>\n", argv[0]);
+        return 2;
+    }
+
+    char dir[] = "/tmp/signup_bench.XXXXXX";
+    if (mkdtemp(dir) == nullptr) return 1;
+
+    server_process server{ };
+    if (!server_start(server, argv[1], dir, {"--workers", "1", "--rate-register", "1000000:1000000:1000000"}))
+    {
+        CHECK(!"server started");
+        rmdir(dir);
+        return CHECK_RESULT();
+    }
+    long long hashed = server_metric(server, "passwords_hashed");
+
+    int unanswered = 0, probe_fd = http_connect(server.port);
+    std::atomic<bool> done{false};
+    auto idle = probe(probe_fd, done, unanswered, std::chrono::steady_clock::now() + std::chrono::milliseconds(BENCH_IDLE_MS));
+
+    // Users stay in the server's configuration: logins of their own for every run
+    std::string run = std::to_string(getpid()) + "_" + std::to_string(time(nullptr));
+    std::atomic<int> registered{0};
+    std::chrono::steady_clock::time_point burst_started, burst_ended;
+    std::thread burst(
+        [&]
+        {
+            std::vector<int> connections;
+            for (int i = 0; i < BENCH_SIGNUPS; ++i) connections.push_back(http_connect(server.port, 60));
+
+            burst_started = std::chrono::steady_clock::now();
+            for (int i = 0; i < BENCH_SIGNUPS; ++i)
+            {
+                std::string n = std::to_string(i);
+                std::string body = "login=burst_" + run + "_" + n + "&email=burst" + n + "%40example.com&password=password" + n;
+                std::string request = "POST /register HTTP/1.1\r\nHost: localhost\r\n"
+                                      "Content-Type: application/x-www-form-urlencoded\r\n"
+                                      "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+                if (connections[i] >= 0) http_write(connections[i], request);
+            }
+            for (int fd : connections)
+            {
+                std::string buffer;
+                if (fd >= 0 && http_read(fd, buffer) == 200) ++registered;
+                if (fd >= 0) close(fd);
+            }
+            burst_ended = std::chrono::steady_clock::now();
+            done = true;
+        }
+    );
+    auto busy = probe(probe_fd, done, unanswered);
+    burst.join();
+    if (probe_fd >= 0) close(probe_fd);
+    else ++unanswered;
+
+    long long hashed_in_burst = server_metric(server, "passwords_hashed") - hashed;
+    server_stop(server);
+    rmdir(dir);
+
+    double burst_ms = std::chrono::duration<double, std::milli>(burst_ended - burst_started).count();
+    print_latencies("idle", idle);
+    print_latencies("burst", busy);
+    printf("%d signups in %.0f ms (%lld passwords hashed)\n", BENCH_SIGNUPS, burst_ms, hashed_in_burst);
+
+    CHECK(unanswered == 0);
+    CHECK(registered == BENCH_SIGNUPS);
+    CHECK(hashed_in_burst == BENCH_SIGNUPS);
+    CHECK(!busy.empty() && busy.back() < burst_ms / 2); // Nothing waited for the hashes
+    return CHECK_RESULT();
+}
@@ -0,0 +1,191 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Event loop latency while files under /dir/ are slow to open, with '--fs posix' and with '--fs uring'.
+/// Every open of a slow file is held up in the kernel for BENCH_OPEN_DELAY ms by a file lease another process
+/// gives up only that long after the open broke it, the way a slow disk or a network mount would hold it up.
+/// Meanwhile another connection asks for '/' over and over. Runs the server binary given as the argument.
+/// Fails if a request goes unanswered or, when io_uring really ran, if the loop stalled on the opens anyway
+
+#include "check.h"
+#include "server_process.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+
+#define BENCH_FILES 20          // Slow files asked for one after another
+#define BENCH_FILE_SIZE 4096
+#define BENCH_OPEN_DELAY 100    // ms every open of a slow file takes
+#define BENCH_PROBE_INTERVAL 5  // ms between requests for '/'
+
+static const char* server_binary;
+static std::string web_root;
+
+
+/// Take a write lease on every file and give it up BENCH_OPEN_DELAY ms after an open broke it.
+/// Runs in a process of its own: opens by its own process would not break its leases. Returns its pid, -1 on failure
+static pid_t lease_holder_start(const std::vector<std::string>& paths)
+{
+    int ready[2];
+    if (pipe(ready) != 0) return -1;
+
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        char ok = 0;
+        close(ready[1]);
+        if (pid > 0 && (read(ready[0], &ok, 1) != 1 || !ok))
+        {
+            waitpid(pid, nullptr, 0);
+            pid = -1;
+        }
+        close(ready[0]);
+        return pid;
+    }
+
+    // Breaks come as SIGRTMIN, with the leased descriptor in si_fd
+    sigset_t breaks;
+    sigemptyset(&breaks);
+    sigaddset(&breaks, SIGRTMIN);
+    sigprocmask(SIG_BLOCK, &breaks, nullptr);
+
+    char ok = 1;
+    for (const auto& path : paths)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fcntl(fd, F_SETSIG, SIGRTMIN) != 0 || fcntl(fd, F_SETLEASE, F_WRLCK) != 0) ok = 0;
+    }
+    if (write(ready[1], &ok, 1) != 1 || !ok) _exit(1);
+
+    siginfo_t info;
+    while (sigwaitinfo(&breaks, &info) > 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_OPEN_DELAY));
+        fcntl(info.si_fd, F_SETLEASE, F_UNLCK);
+    }
+    _exit(0);
+}
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+
+/// Latencies of '/' while BENCH_FILES slow files are downloaded with backend
+static void bench(const std::string& backend)
+{
+    std::vector<std::string> files;
+    std::string content(BENCH_FILE_SIZE, 'x');
+    for (int i = 0; i < BENCH_FILES; ++i)
+    {
+        // Names of their own: the file cache would skip the open of a file another run already had
+        files.push_back("slow-" + backend + "-" + std::to_string(i) + ".bin");
+        int fd = open((web_root + "/" + files.back()).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        CHECK(fd >= 0 && write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size()));
+        if (fd >= 0) close(fd); // A write lease needs the file closed everywhere else
+    }
+
+    std::vector<std::string> paths;
+    for (const auto& file : files) paths.push_back(web_root + "/" + file);
+    pid_t holder = lease_holder_start(paths);
+    if (holder < 0)
+    {
+        CHECK(!"leases taken");
+        return;
+    }
+
+    server_process server{ };
+    if (!server_start(server, server_binary, web_root, {"--workers", "1", "--fs", backend}))
+    {
+        CHECK(!"server started");
+        kill(holder, SIGKILL);
+        waitpid(holder, nullptr, 0);
+        return;
+    }
+
+    std::atomic<bool> done{false};
+    std::atomic<int> slow_answered{0}, unanswered{0};
+    std::thread downloads(
+        [&]
+        {
+            for (const auto& file : files)
+            {
+                std::string body;
+                int fd = http_connect(server.port);
+                if (fd >= 0 && http_exchange(fd, http_get_request("/dir/" + file), &body) == 200 && body == content)
+                    ++slow_answered;
+                else ++unanswered;
+                if (fd >= 0) close(fd);
+            }
+            done = true;
+        }
+    );
+
+    std::vector<double> latencies;
+    int probe = http_connect(server.port);
+    std::string request = http_get_request("/"), buffer;
+    while (!done && probe >= 0)
+    {
+        auto sent = std::chrono::steady_clock::now();
+        if (!http_write(probe, request) || http_read(probe, buffer) != 200) ++unanswered;
+        else latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent).count());
+        std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_PROBE_INTERVAL));
+    }
+    downloads.join();
+    if (probe >= 0) close(probe);
+    else ++unanswered;
+
+    long long uring_requests = server_metric(server, "fs_uring_requests");
+    server_stop(server);
+    kill(holder, SIGKILL);
+    waitpid(holder, nullptr, 0);
+    for (const auto& path : paths) unlink(path.c_str());
+
+    CHECK(unanswered == 0);
+    CHECK(slow_answered == BENCH_FILES);
+
+    std::sort(latencies.begin(), latencies.end());
+    printf(
+        "%-5s '/' p50 %7.2f ms  p99 %7.2f ms  max %7.2f ms  (%zu requests, %d opens of %d ms)\n",
+        backend.c_str(), percentile(latencies, 0.5), percentile(latencies, 0.99),
+        latencies.empty() ? 0 : latencies.back(), latencies.size(), BENCH_FILES, BENCH_OPEN_DELAY
+    );
+
+    if (backend == "uring")
+    {
+        if (uring_requests <= 0) printf("io_uring is not available: '--fs uring' opened the files like posix\n");
+        else CHECK(percentile(latencies, 0.99) < BENCH_OPEN_DELAY); // Opens didn't hold up the loop
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <server binary>\n", argv[0]);
+        return 2;
+    }
+    server_binary = argv[1];
+
+    char dir[] = "/tmp/slow_fs_bench.XXXXXX";
+    if (mkdtemp(dir) == nullptr) return 1;
+    web_root = dir;
+
+    bench("posix");
+    bench("uring");
+
+    rmdir(dir);
+    return CHECK_RESULT();
+}
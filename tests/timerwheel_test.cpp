@@ -0,0 +1,136 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Timer wheel: every timer fires once, in the advance that reaches its tick and not before,
+/// whatever level it starts on. Cancelled timers never fire
+
+#include "check.h"
+#include "../sources/timerwheel.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+typedef struct : timer_node
+{
+    uint64_t due;   // Tick it was asked for (or the one it was added at, if that's later)
+    int fired = 0;
+    bool cancelled = false;
+} test_timer;
+
+static uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t random_below(uint64_t n)
+{
+    seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+    return seed % n;
+}
+
+
+static void test_random_schedule()
+{
+    auto wheel = std::make_unique<timer_wheel>();
+    timer_wheel_init(*wheel, 1000);
+
+    std::vector<std::unique_ptr<test_timer>> timers;
+    std::vector<timer_node*> expired;
+    uint64_t now = 1000; // Processed up to now - 1
+    int early = 0, late = 0;
+
+    for (int round = 0; round < 2000; ++round)
+    {
+        // Timers on every level, some already overdue
+        for (int i = 0; i < 10; ++i)
+        {
+            auto timer = std::make_unique<test_timer>();
+            uint64_t span = uint64_t{1} << (TIMER_WHEEL_BITS * (1 + random_below(3)));
+            uint64_t expires = now + random_below(span);
+            if (random_below(20) == 0) expires = now > 50 ? now - 50 : 0;
+            timer->due = expires < now ? now : expires;
+            timer_wheel_add(*wheel, timer.get(), expires);
+            timers.push_back(std::move(timer));
+        }
+
+        // Cancel a few
+        for (int i = 0; i < 3; ++i)
+        {
+            auto& timer = timers[random_below(timers.size())];
+            timer_wheel_remove(*wheel, timer.get());
+            timer_wheel_remove(*wheel, timer.get()); // Twice is harmless
+            if (timer->fired == 0) timer->cancelled = true;
+        }
+
+        uint64_t until = now + random_below(round % 10 == 0 ? 20000 : 300);
+        expired.clear();
+        timer_wheel_advance(*wheel, until, expired);
+        for (timer_node* node : expired)
+        {
+            auto* timer = static_cast<test_timer*>(node);
+            ++timer->fired;
+            early += timer->due > until;
+        }
+        for (auto& timer : timers)
+            late += timer->fired == 0 && !timer->cancelled && timer->due <= until;
+        now = until + 1;
+    }
+
+    size_t pending = 0;
+    int twice = 0, cancelled_fired = 0;
+    for (auto& timer : timers)
+    {
+        twice += timer->fired > 1;
+        cancelled_fired += timer->cancelled && timer->fired > 0;
+        pending += timer->fired == 0 && !timer->cancelled;
+    }
+    CHECK(early == 0);
+    CHECK(late == 0);
+    CHECK(twice == 0);
+    CHECK(cancelled_fired == 0);
+    CHECK(wheel->count == pending);
+}
+
+static void test_beyond_horizon()
+{
+    auto wheel = std::make_unique<timer_wheel>();
+    timer_wheel_init(*wheel, 5);
+
+    test_timer near{ }, far{ };
+    uint64_t horizon = uint64_t{1} << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+    timer_wheel_add(*wheel, &near, 7);
+    timer_wheel_add(*wheel, &far, 5 + horizon * 2 + 123);
+
+    std::vector<timer_node*> expired;
+    timer_wheel_advance(*wheel, 7, expired);
+    CHECK(expired.size() == 1 && expired[0] == &near);
+
+    expired.clear();
+    timer_wheel_advance(*wheel, 5 + horizon * 2 + 122, expired);
+    CHECK(expired.empty());
+    timer_wheel_advance(*wheel, 5 + horizon * 2 + 123, expired);
+    CHECK(expired.size() == 1 && expired[0] == &far);
+    CHECK(wheel->count == 0);
+}
+
+static void test_empty_wheel_skips()
+{
+    auto wheel = std::make_unique<timer_wheel>();
+    timer_wheel_init(*wheel, 0);
+    std::vector<timer_node*> expired;
+    timer_wheel_advance(*wheel, uint64_t{1} << 40, expired); // Nothing to walk through
+    CHECK(wheel->next == (uint64_t{1} << 40) + 1);
+
+    test_timer timer{ };
+    timer_wheel_add(*wheel, &timer, (uint64_t{1} << 40) + 10);
+    timer_wheel_advance(*wheel, (uint64_t{1} << 40) + 10, expired);
+    CHECK(expired.size() == 1);
+}
+
+
+int main()
+{
+    test_random_schedule();
+    test_beyond_horizon();
+    test_empty_wheel_skips();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,141 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Full TLS handshakes per second on the server's side, with the keypair read and parsed for every
+/// connection (as mongoose was set up on each accept before) and with the shared context.
+/// Handshakes run over an in-memory BIO pair, so only the TLS work is measured
+
+#include "check.h"
+#include "../sources/tls.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+
+#define BENCH_HANDSHAKES 200
+
+// Options tls.cpp reads
+int tls_ktls = 0;
+long tls_ticket_rotation_interval = 0;
+
+static std::string keypair_dir;
+
+
+/// Self-signed RSA keypair in keypair_dir, like a certbot's one
+static bool write_keypair()
+{
+    EVP_PKEY* key = EVP_RSA_gen(2048);
+    X509* cert = X509_new();
+    if (key == nullptr || cert == nullptr) return false;
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    bool ok = X509_sign(cert, key, EVP_sha256()) > 0;
+
+    FILE* f = fopen((keypair_dir + "/cert.pem").c_str(), "w");
+    ok = ok && f && PEM_write_X509(f, cert) == 1;
+    if (f) fclose(f);
+    f = fopen((keypair_dir + "/key.pem").c_str(), "w");
+    ok = ok && f && PEM_write_PrivateKey(f, key, nullptr, nullptr, 0, nullptr, nullptr) == 1;
+    if (f) fclose(f);
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+/// Context with the keypair read from keypair_dir, the way every connection got one before
+static SSL_CTX* context_per_connection()
+{
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (SSL_CTX_use_certificate_chain_file(ctx, (keypair_dir + "/cert.pem").c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, (keypair_dir + "/key.pem").c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+    return ctx;
+}
+
+/// Complete a handshake between a fresh client and a server made from server_ctx. Takes the reference
+static bool handshake(SSL_CTX* client_ctx, SSL_CTX* server_ctx)
+{
+    if (server_ctx == nullptr) return false;
+    SSL* server = SSL_new(server_ctx);
+    SSL_CTX_free(server_ctx); // The connection holds its own reference
+    SSL* client = SSL_new(client_ctx);
+
+    BIO *server_bio, *client_bio;
+    BIO_new_bio_pair(&server_bio, 0, &client_bio, 0);
+    SSL_set_bio(server, server_bio, server_bio);
+    SSL_set_bio(client, client_bio, client_bio);
+    SSL_set_accept_state(server);
+    SSL_set_connect_state(client);
+
+    bool client_done = false, server_done = false;
+    for (int i = 0; i < 100 && !(client_done && server_done); ++i)
+    {
+        if (!client_done)
+        {
+            int r = SSL_do_handshake(client);
+            client_done = r == 1;
+            if (r <= 0 && SSL_get_error(client, r) != SSL_ERROR_WANT_READ) break;
+        }
+        if (!server_done)
+        {
+            int r = SSL_do_handshake(server);
+            server_done = r == 1;
+            if (r <= 0 && SSL_get_error(server, r) != SSL_ERROR_WANT_READ) break;
+        }
+    }
+
+    SSL_free(client);
+    SSL_free(server);
+    return client_done && server_done;
+}
+
+/// Handshakes per second
+template <typename Context>
+static double bench(const char* name, SSL_CTX* client_ctx, Context context)
+{
+    int done = 0;
+    auto started = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_HANDSHAKES; ++i) done += handshake(client_ctx, context());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    CHECK(done == BENCH_HANDSHAKES);
+
+    printf("%-22s %8.1f handshakes/s (%.0f us each)\n", name, done / seconds, seconds * 1e6 / BENCH_HANDSHAKES);
+    return done / seconds;
+}
+
+
+int main()
+{
+    char dir[] = "/tmp/tls_bench.XXXXXX";
+    if (mkdtemp(dir) == nullptr) return 1;
+    keypair_dir = dir;
+    CHECK(write_keypair());
+    CHECK(tls_context_load(dir));
+
+    SSL_CTX* client_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(client_ctx, SSL_VERIFY_NONE, nullptr);
+
+    bench("context per connection", client_ctx, context_per_connection);
+    bench("shared context", client_ctx, tls_context_acquire);
+
+    SSL_CTX_free(client_ctx);
+    unlink((keypair_dir + "/cert.pem").c_str());
+    unlink((keypair_dir + "/key.pem").c_str());
+    rmdir(dir);
+    return CHECK_RESULT();
+}
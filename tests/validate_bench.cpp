@@ -0,0 +1,73 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Time to check one registration's login and email: the validators against std::regex built
+/// for every request (as handle_register_html() used to) and compiled once. Then hostile emails,
+/// which must take time linear in their length
+
+#include "check.h"
+#include "../sources/settings.h"
+#include "../sources/validate.h"
+
+#include <chrono>
+#include <cstdio>
+#include <regex>
+#include <string>
+
+
+static const std::string logins[] = {"user", "john_doe_1990", "bad login", "Admin"};
+static const std::string emails[] = {"john.doe+news@mail.example.com", "user@host", "a@b.c", "x@y.z.w.v"};
+
+/// Nanoseconds per login and email pair
+template <typename Check>
+static double bench(const char* name, int rounds, Check check)
+{
+    int valid = 0;
+    auto started = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i)
+        for (size_t j = 0; j < std::size(logins); ++j)
+            valid += check(logins[j], emails[j]);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count() /
+        (rounds * std::size(logins));
+    printf("%-22s %12.1f ns per registration (%d valid)\n", name, ns, valid);
+    return ns;
+}
+
+
+int main()
+{
+    bench(
+        "regex per request", 500, [](const std::string& login, const std::string& email)
+        {
+            return std::regex_match(login, std::regex(REGEX_LOGIN)) && std::regex_match(email, std::regex(REGEX_EMAIL));
+        }
+    );
+
+    static const std::regex login_regex(REGEX_LOGIN), email_regex(REGEX_EMAIL);
+    bench(
+        "regex compiled once", 20000, [](const std::string& login, const std::string& email)
+        {
+            return std::regex_match(login, login_regex) && std::regex_match(email, email_regex);
+        }
+    );
+
+    bench(
+        "validators", 2000000, [](const std::string& login, const std::string& email)
+        {
+            return valid_login(login) && valid_email(email);
+        }
+    );
+
+    // Many ways to split the domain between the label and the rest, none of which matches in the end
+    for (size_t size : {1000, 10000, 100000})
+    {
+        std::string hostile = "a@b";
+        while (hostile.size() < size) hostile += "-.";
+        hostile += '!';
+        auto started = std::chrono::steady_clock::now();
+        CHECK(!valid_email(hostile));
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - started).count();
+        printf("hostile email, %6zu bytes: %9.1f us\n", hostile.size(), us);
+    }
+    return CHECK_RESULT();
+}
@@ -0,0 +1,10 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// validate_test with patterns overridden through the macros: the validators go to std::regex then
+
+#define REGEX_LOGIN "^[a-z]{3,8}$"
+#define REGEX_EMAIL R"(^[a-z]+@example\.(com|org)$)"
+
+#include "../sources/validate.cpp"
+#include "validate_test.cpp"
@@ -0,0 +1,72 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Login and email validators against std::regex with the same patterns: hand-picked cases,
+/// then random inputs made of the characters the patterns care about (and some they don't)
+
+#include "check.h"
+#include "../sources/settings.h"
+#include "../sources/validate.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <regex>
+#include <string>
+
+
+static const std::regex regex_login(REGEX_LOGIN), regex_email(REGEX_EMAIL);
+
+/// Number of inputs the validator and std::regex disagree on. The first few are printed
+static int differences(bool (*valid)(std::string_view), const std::regex& regex, const std::string& input)
+{
+    bool expected = std::regex_match(input, regex);
+    if (valid(input) == expected) return 0;
+    static int printed = 0;
+    if (printed++ < 10) fprintf(stderr, "'%s': expected %s\n", input.c_str(), expected ? "valid" : "invalid");
+    return 1;
+}
+
+static void test_cases()
+{
+    static const char* logins[] = {
+        "", "user", "User_01", "_", "user name", "user-name", "user.name", "юзер", "user\n", "a@b", "\xff"
+    };
+    static const char* emails[] = {
+        "", "a@b.c", "user.name+tag@mail-host.example.com", "a@b", "a@b.", "a@.b", "@b.c", "a@@b.c", "a@b@c.d",
+        "a b@c.d", "a@b_c.d", "a@b.c_d", "a@-.-", "a@b..", "a@b.c.", ".@b.c", "a@b.c\n", "a\xff@b.c", "a@b.\xff"
+    };
+    int different = 0;
+    for (const char* login : logins) different += differences(valid_login, regex_login, login);
+    for (const char* email : emails) different += differences(valid_email, regex_email, email);
+    CHECK(different == 0);
+}
+
+static void test_random()
+{
+    static const char alphabet[] = "aZ9_.+-@@@.. \xff!";
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    auto next = [&]
+    {
+        seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+        return seed;
+    };
+
+    int different = 0;
+    std::string input;
+    for (int i = 0; i < 200000; ++i)
+    {
+        input.clear();
+        for (size_t n = next() % 12; n > 0; --n) input += alphabet[next() % (sizeof(alphabet) - 1)];
+        different += differences(valid_login, regex_login, input);
+        different += differences(valid_email, regex_email, input);
+    }
+    CHECK(different == 0);
+}
+
+
+int main()
+{
+    test_cases();
+    test_random();
+    return CHECK_RESULT();
+}
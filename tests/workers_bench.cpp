@@ -0,0 +1,109 @@
+// Copyright (c) 2022 Perets Dmytro
+// Author: Perets Dmytro <dmytroperets@gmail.com>
+
+/// Requests per second the server answers with one event loop (--workers 1) and with one per cpu.
+/// Runs the server binary given as the argument. Fails if a request goes unanswered or
+/// the server didn't run as many loops as it was told to
+
+#include "check.h"
+#include "server_process.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+
+#define BENCH_CLIENTS 4         // Threads sending requests
+#define BENCH_CONNECTIONS 16    // Keep-alive connections of each client
+#define BENCH_SECONDS 2
+
+static const char* server_binary;
+static std::string web_root;
+
+
+/// Requests per second with loops event loops
+static double bench(int loops)
+{
+    server_process server{ };
+    if (!server_start(server, server_binary, web_root, {"--workers", std::to_string(loops)}))
+    {
+        CHECK(!"server started");
+        return 0;
+    }
+    CHECK(server_metric(server, "workers") == loops);
+
+    std::atomic<unsigned long> answered{0}, unanswered{0};
+    std::atomic<bool> done{false};
+    std::vector<std::thread> clients;
+    for (int c = 0; c < BENCH_CLIENTS; ++c)
+        clients.emplace_back(
+            [&]
+            {
+                std::vector<int> connections;
+                for (int i = 0; i < BENCH_CONNECTIONS; ++i)
+                {
+                    int fd = http_connect(server.port);
+                    if (fd >= 0) connections.push_back(fd);
+                    else ++unanswered;
+                }
+
+                // A request on every connection at once, then the answers
+                std::string request = http_get_request("/"), buffer;
+                while (!done)
+                {
+                    for (int fd : connections) http_write(fd, request);
+                    for (int fd : connections)
+                    {
+                        if (http_read(fd, buffer) == 200) ++answered;
+                        else ++unanswered;
+                        buffer.clear();
+                    }
+                }
+                for (int fd : connections) close(fd);
+            }
+        );
+
+    auto started = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(BENCH_SECONDS));
+    done = true;
+    for (auto& client : clients) client.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    server_stop(server);
+
+    CHECK(unanswered == 0);
+    CHECK(answered > 0);
+
+    double rps = static_cast<double>(answered) / seconds;
+    printf("%2d loops %10.0f requests/s\n", loops, rps);
+    return rps;
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <server binary>\n", argv[0]);
+        return 2;
+    }
+    server_binary = argv[1];
+
+    char dir[] = "/tmp/workers_bench.XXXXXX";
+    if (mkdtemp(dir) == nullptr) return 1;
+    web_root = dir;
+
+    int cpus = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%d cpus\n", cpus);
+    double single = bench(1);
+    double many = bench(std::max(cpus, 2)); // Runs even on one cpu, for the sharing of the port
+    if (single > 0) printf("%.2fx\n", many / single);
+
+    rmdir(dir);
+    return CHECK_RESULT();
+}